@@ -18,7 +18,13 @@
 // modified by dazza - 200421
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
+#include <utility>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -46,6 +52,11 @@
 #define CSGJSCPP_REVERSE std::reverse
 #endif
 
+#if !defined(CSGJSCPP_MOVE)
+#include <utility>
+#define CSGJSCPP_MOVE std::move
+#endif
+
 #if !defined(CSGJSCPP_PAIR)
 #define CSGJSCPP_PAIR std::pair
 #endif
@@ -63,10 +74,19 @@
 #define CSGJSCPP_MAP std::map
 #endif
 
+#if !defined(CSGJSCPP_HASHMAP)
+#include <unordered_map>
+#define CSGJSCPP_HASHMAP std::unordered_map
+#endif
+
 #if !defined(CSGJSCPP_FIND_IF)
 #define CSGJSCPP_FIND_IF std::find_if
 #endif
 
+#if !defined(CSGJSCPP_SHAREDPTR)
+#define CSGJSCPP_SHAREDPTR std::shared_ptr
+#endif
+
 #if !defined (CSGJSCPP_INDEX)
 #define CSGJSCPP_INDEX uint32_t
 #endif
@@ -159,6 +179,81 @@ inline bool operator!=(const Vertex &a, const Vertex &b) {
 	return a.pos != b.pos || a.normal != b.normal || a.col != b.col;
 }
 
+// A unit normal in 4 bytes, octahedral encoded with 16 bits per component.
+// Converts to and from Vector so code written against `Vertex::normal` keeps
+// working with CSGJSCPP_COMPACT_VERTEX, model files use it for quantized
+// normals.
+struct OctNormal {
+    int16_t x, y;
+
+    OctNormal() : x(0), y(0) {
+    }
+    OctNormal(const Vector &n) {
+        CSGJSCPP_REAL l = (CSGJSCPP_REAL)(fabs(n.x) + fabs(n.y) + fabs(n.z));
+        CSGJSCPP_REAL u = l > 0 ? n.x / l : 0, v = l > 0 ? n.y / l : 0;
+        if (n.z < 0) {
+            CSGJSCPP_REAL wu = (1 - (CSGJSCPP_REAL)fabs(v)) * (u >= 0 ? 1 : -1);
+            v = (1 - (CSGJSCPP_REAL)fabs(u)) * (v >= 0 ? 1 : -1);
+            u = wu;
+        }
+        x = (int16_t)floor(u * 32767 + 0.5f);
+        y = (int16_t)floor(v * 32767 + 0.5f);
+    }
+    operator Vector() const {
+        CSGJSCPP_REAL u = x / (CSGJSCPP_REAL)32767, v = y / (CSGJSCPP_REAL)32767;
+        CSGJSCPP_REAL z = 1 - (CSGJSCPP_REAL)(fabs(u) + fabs(v));
+        if (z < 0) {
+            CSGJSCPP_REAL wu = (1 - (CSGJSCPP_REAL)fabs(v)) * (u >= 0 ? 1 : -1);
+            v = (1 - (CSGJSCPP_REAL)fabs(u)) * (v >= 0 ? 1 : -1);
+            u = wu;
+        }
+        Vector        n(u, v, z);
+        CSGJSCPP_REAL len = (CSGJSCPP_REAL)sqrt(dot(n, n));
+        return len > 0 ? n / len : n;
+    }
+};
+
+inline bool operator==(const OctNormal &a, const OctNormal &b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+inline bool operator!=(const OctNormal &a, const OctNormal &b) {
+    return a.x != b.x || a.y != b.y;
+}
+
+// Exact in the encoding, flipping twice gives back the same bits.
+inline OctNormal negate(const OctNormal &n) {
+    OctNormal ret;
+    ret.x = (int16_t)((32767 - abs(n.y)) * (n.x <= 0 ? 1 : -1));
+    ret.y = (int16_t)((32767 - abs(n.x)) * (n.y <= 0 ? 1 : -1));
+    return ret;
+}
+
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+
+// What polygons keep per vertex with CSGJSCPP_COMPACT_VERTEX, 16 bytes instead
+// of the 28 of `Vertex`. The colour is kept once per polygon, `Polygon::col`,
+// taken from the first vertex: per-vertex colours within a polygon collapse to
+// that one colour and come back that way from polygonvertex() and models.
+struct PolygonVertex {
+    Vector    pos;
+    OctNormal normal;
+};
+
+inline bool operator==(const PolygonVertex &a, const PolygonVertex &b) {
+    return a.pos == b.pos && a.normal == b.normal;
+}
+
+inline bool operator!=(const PolygonVertex &a, const PolygonVertex &b) {
+    return a.pos != b.pos || a.normal != b.normal;
+}
+
+#else
+
+typedef Vertex PolygonVertex;
+
+#endif
+
 
 struct Polygon;
 
@@ -182,6 +277,9 @@ struct Plane {
     void splitpolygon(const Polygon &poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront,
                       CSGJSCPP_VECTOR<Polygon> &coplanarBack, CSGJSCPP_VECTOR<Polygon> &front,
                       CSGJSCPP_VECTOR<Polygon> &back) const;
+    // As above but `poly` is moved into its list when it doesn't need splitting.
+    void splitpolygon(Polygon &&poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront, CSGJSCPP_VECTOR<Polygon> &coplanarBack,
+                      CSGJSCPP_VECTOR<Polygon> &front, CSGJSCPP_VECTOR<Polygon> &back) const;
 
     enum Classification { COPLANAR = 0, FRONT = 1, BACK = 2, SPANNING = 3 };
     inline Classification classify(const Vector &p) const {
@@ -199,12 +297,26 @@ struct Plane {
 // Each convex polygon has a `shared` property, which is shared between all
 // polygons that are clones of each other or were split from the same polygon.
 // This can be used to define per-polygon properties (such as surface color).
+//
+// Split fragments keep the plane of the polygon they came from rather than
+// working one out from their first three vertices, so coplanar pieces stay on
+// exactly the same plane.
+//
+// With CSGJSCPP_COMPACT_VERTEX vertices are `PolygonVertex`es and the colour
+// of the polygon (the colour of the first vertex it was made from) is `col`,
+// use `polygonvertex()` for whole vertices.
 struct Polygon {
-    CSGJSCPP_VECTOR<Vertex> vertices;
-    Plane                   plane;
+    CSGJSCPP_VECTOR<PolygonVertex> vertices;
+    Plane                          plane;
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+    uint32_t col;
+#endif
 
     Polygon();
     Polygon(const CSGJSCPP_VECTOR<Vertex> &list);
+    Polygon(CSGJSCPP_VECTOR<Vertex> &&list);
+    // a piece of `parent` with its plane and colour.
+    Polygon(CSGJSCPP_VECTOR<PolygonVertex> &&list, const Polygon &parent);
 
     inline void flip() {
         CSGJSCPP_REVERSE(vertices.begin(), vertices.end());
@@ -214,6 +326,15 @@ struct Polygon {
     }
 };
 
+// Vertex `i` of `poly` with the normal and colour it stands for.
+inline Vertex polygonvertex(const Polygon &poly, size_t i) {
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+    return Vertex{poly.vertices[i].pos, poly.vertices[i].normal, poly.col};
+#else
+    return poly.vertices[i];
+#endif
+}
+
 struct Model {
 
     using Index = CSGJSCPP_INDEX;
@@ -234,6 +355,364 @@ struct Model {
     }
 };
 
+// An affine transform `p' = m * p + t`, the linear part `m` is stored as three
+// rows. Default constructs to the identity.
+struct Transform {
+    Vector m[3];
+    Vector t;
+
+    Transform() : m{Vector(1.0f, 0.0f, 0.0f), Vector(0.0f, 1.0f, 0.0f), Vector(0.0f, 0.0f, 1.0f)}, t() {
+    }
+};
+
+inline Vector transformpoint(const Transform &tr, const Vector &p) {
+    return Vector(dot(tr.m[0], p), dot(tr.m[1], p), dot(tr.m[2], p)) + tr.t;
+}
+
+inline Vector transformdirection(const Transform &tr, const Vector &d) {
+    return Vector(dot(tr.m[0], d), dot(tr.m[1], d), dot(tr.m[2], d));
+}
+
+inline CSGJSCPP_REAL determinant(const Transform &tr) {
+    return dot(tr.m[0], cross(tr.m[1], tr.m[2]));
+}
+
+// Apply `b` first and then `a`.
+inline Transform operator*(const Transform &a, const Transform &b) {
+    Transform ret;
+    Vector    col0(b.m[0].x, b.m[1].x, b.m[2].x);
+    Vector    col1(b.m[0].y, b.m[1].y, b.m[2].y);
+    Vector    col2(b.m[0].z, b.m[1].z, b.m[2].z);
+    for (int i = 0; i < 3; i++)
+        ret.m[i] = Vector(dot(a.m[i], col0), dot(a.m[i], col1), dot(a.m[i], col2));
+    ret.t = transformpoint(a, b.t);
+    return ret;
+}
+
+inline Transform inverse(const Transform &tr) {
+    // rows of the inverse are the columns of the cofactor matrix over the determinant.
+    Vector        c0 = cross(tr.m[1], tr.m[2]);
+    Vector        c1 = cross(tr.m[2], tr.m[0]);
+    Vector        c2 = cross(tr.m[0], tr.m[1]);
+    CSGJSCPP_REAL invdet = (CSGJSCPP_REAL)1.0 / dot(tr.m[0], c0);
+
+    Transform ret;
+    ret.m[0] = Vector(c0.x, c1.x, c2.x) * invdet;
+    ret.m[1] = Vector(c0.y, c1.y, c2.y) * invdet;
+    ret.m[2] = Vector(c0.z, c1.z, c2.z) * invdet;
+    ret.t = negate(transformdirection(ret, tr.t));
+    return ret;
+}
+
+// Normals transform by the inverse transpose so they stay perpendicular to the
+// surface under non uniform scales. Build it once with `normalmatrix()` and
+// pass it to `transformnormal()` / `transformplane()`.
+inline Transform normalmatrix(const Transform &tr) {
+    Transform inv = inverse(tr);
+    Transform ret;
+    ret.m[0] = Vector(inv.m[0].x, inv.m[1].x, inv.m[2].x);
+    ret.m[1] = Vector(inv.m[0].y, inv.m[1].y, inv.m[2].y);
+    ret.m[2] = Vector(inv.m[0].z, inv.m[1].z, inv.m[2].z);
+    return ret;
+}
+
+// The result is normalized, zero length normals stay zero.
+inline Vector transformnormal(const Transform &normalmat, const Vector &n) {
+    Vector        ret = transformdirection(normalmat, n);
+    CSGJSCPP_REAL len = length(ret);
+    return len > 0 ? ret / len : ret;
+}
+
+inline Plane transformplane(const Transform &tr, const Transform &normalmat, const Plane &plane) {
+    Plane ret;
+    ret.normal = transformnormal(normalmat, plane.normal);
+    ret.w = dot(ret.normal, transformpoint(tr, plane.normal * plane.w));
+    return ret;
+}
+
+inline Transform csgtranslate(const Vector &v) {
+    Transform ret;
+    ret.t = v;
+    return ret;
+}
+
+inline Transform csgscale(const Vector &v) {
+    Transform ret;
+    ret.m[0].x = v.x;
+    ret.m[1].y = v.y;
+    ret.m[2].z = v.z;
+    return ret;
+}
+
+// Rotation of `angle` radians around `axis`.
+inline Transform csgrotate(const Vector &axis, CSGJSCPP_REAL angle) {
+    Vector        a = unit(axis);
+    CSGJSCPP_REAL c = (CSGJSCPP_REAL)cos(angle);
+    CSGJSCPP_REAL s = (CSGJSCPP_REAL)sin(angle);
+    CSGJSCPP_REAL t = 1.0f - c;
+
+    Transform ret;
+    ret.m[0] = Vector(t * a.x * a.x + c, t * a.x * a.y - s * a.z, t * a.x * a.z + s * a.y);
+    ret.m[1] = Vector(t * a.x * a.y + s * a.z, t * a.y * a.y + c, t * a.y * a.z - s * a.x);
+    ret.m[2] = Vector(t * a.x * a.z - s * a.y, t * a.y * a.z + s * a.x, t * a.z * a.z + c);
+    return ret;
+}
+
+// Where a ray first met a solid: `point = origin + dir * t` on `polygon`.
+struct RayHit {
+    CSGJSCPP_REAL  t;
+    Vector         point;
+    const Polygon *polygon;
+    bool           flipped; // `polygon` is stored facing the other way, see CSGNode::inverted.
+};
+
+struct CSGContext;
+
+// Holds a node in a BSP tree. A BSP tree is built from a collection of polygons
+// by picking a polygon to split along. That polygon (and all other coplanar
+// polygons) are added directly to that node and the other polygons are added to
+// the front and/or back subtrees. This is not a leafy BSP tree since there is
+// no distinction between internal and leaf nodes.
+//
+// Keeping the built tree around is the cheapest way to reuse a solid, a tree
+// can be moved into place with `transform()` rather than being rebuilt.
+struct CSGNode {
+    CSGJSCPP_VECTOR<Polygon> polygons;
+    CSGNode *                front;
+    CSGNode *                back;
+    Plane                    plane;
+    // Set on the root of a tree made by `buildconvex()`, clipping against such
+    // a tree runs over its flat list of face planes instead of walking nodes.
+    bool convex;
+    // A box around the polygons of this node and all nodes below it, empty
+    // (min > max) when there are none. Kept by the builds, `clone()`,
+    // `transform()` and tree files, clipping only takes polygons away so it
+    // stays conservative. Rays skip the subtrees whose box they miss.
+    Vector boundsmin, boundsmax;
+    // Set by `invert()` on the root of a tree, the tree is read as if every
+    // plane and polygon were flipped and the children swapped. The flag is only
+    // read on the root, on the nodes below it it is always false, and `plane`,
+    // `front`, `back` and `polygons` of every node stay as they were built,
+    // un-inverted. Polygons come out flipped from `allpolygons()` and the
+    // booleans.
+    bool inverted;
+
+    CSGNode();
+    CSGNode(const CSGJSCPP_VECTOR<Polygon> &list);
+    ~CSGNode();
+
+    // Read only queries, safe to run from many threads on one shared tree.
+    enum Containment { OUTSIDE = 0, INSIDE = 1, BOUNDARY = 2 };
+    Containment                  classify(const Vector &point) const;
+    CSGJSCPP_VECTOR<Containment> classify(const CSGJSCPP_VECTOR<Vector> &points) const;
+    bool raycast(const Vector &origin, const Vector &dir, RayHit &hit, CSGJSCPP_REAL tmax = HUGE_VALF) const;
+
+    CSGNode *                clone() const;
+    void                     clipto(const CSGNode *other);
+    void                     invert();
+    void                     transform(const Transform &tr);
+    void                     build(const CSGJSCPP_VECTOR<Polygon> &Polygon);
+    void                     buildconvex(const CSGJSCPP_VECTOR<Polygon> &list);
+    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list) const;
+    CSGJSCPP_VECTOR<Polygon> clippolygons(CSGJSCPP_VECTOR<Polygon> &&list) const;
+    CSGJSCPP_VECTOR<Polygon> allpolygons() const;
+
+    // As above, new nodes and scratch lists come from and go back to `context`.
+    CSGNode *                clone(CSGContext &context) const;
+    void                     clipto(const CSGNode *other, CSGContext &context);
+    void                     build(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context);
+    void                     buildconvex(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context);
+    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context) const;
+    CSGJSCPP_VECTOR<Polygon> clippolygons(CSGJSCPP_VECTOR<Polygon> &&list, CSGContext &context) const;
+};
+
+// Why an operation stopped early, see CSGOptions.
+enum CSGStatus {
+    CSG_OK = 0,
+    CSG_CANCELLED = 1,
+    CSG_DEADLINE = 2,
+    CSG_POLYGON_LIMIT = 3,
+    CSG_NODE_LIMIT = 4,
+    CSG_DEPTH_LIMIT = 5,
+    CSG_MEMORY_LIMIT = 6,
+    CSG_INVALID_OPTIONS = 7
+};
+
+const char *csgstatusstring(CSGStatus status);
+
+// What snapping did to the output of an operation, see CSGOptions::snapgrid.
+struct CSGSnapStats {
+    size_t polygonsin, polygonsout;
+    size_t verticesin, verticesout;
+
+    CSGSnapStats() : polygonsin(0), polygonsout(0), verticesin(0), verticesout(0) {
+    }
+};
+
+// Control over a running boolean. The cancel flag and the deadline are polled
+// every few dozen polygons inside the tree builds, the clipping and
+// csgfixtjunc, a stopped operation unwinds promptly and produces no result.
+struct CSGOptions {
+    // stops the operation once it reads true, may be set from any thread.
+    const std::atomic<bool> *cancel;
+    // stops the operation once steady_clock passes it.
+    std::chrono::steady_clock::time_point deadline;
+    // called on the operation's thread with the fraction done, from 0 to 1.
+    std::function<void(float)> progress;
+
+    // Budgets for one operation, 0 is unlimited. They limit what the operation
+    // holds at any one time: polygons, vertices and nodes count from when they
+    // are made (copies and split fragments) until they are given back to the
+    // context, bytes are estimated from those counts. The tree depth is checked
+    // as trees are built.
+    size_t maxpolygons;
+    size_t maxnodes;
+    size_t maxdepth;
+    size_t maxbytes;
+
+    // group coplanar triangles of model operands, see modeltopolygons.
+    bool mergecoplanar;
+
+    // Snap the output of every operation to a grid of this spacing, see
+    // csgsnap, 0 is off. This only cleans up slivers: polygons thinner than
+    // the grid collapse and are dropped. Grids coarser than 2 * csgjs_EPSILON
+    // are refused with CSG_INVALID_OPTIONS before any work is done, rounding
+    // further than the plane tolerance lets neighbouring faces fold through
+    // each other. So only slivers of about 2e-4 and less go, and the rounding
+    // error that builds up over a long chain of booleans is not bounded.
+    CSGJSCPP_REAL snapgrid;
+    // when set, receives what snapping did to the last operation.
+    CSGSnapStats *snapstats;
+
+    // Remember where edges are split while the operation runs and insert those
+    // points into the output polygons that share the edges, so the output of
+    // watertight operands comes out free of T-junctions without csgfixtjunc
+    // and can still be used for further booleans. Edges are matched by their
+    // exact end points, T-junctions already in the operands are left alone.
+    // Seams where faces of the two operands cross are worked out on each side
+    // and may differ in the last bits, a snapgrid closes them. Not honoured by
+    // the partitioned booleans.
+    bool fixtjunctions;
+
+    CSGOptions()
+        : cancel(nullptr), deadline(std::chrono::steady_clock::time_point::max()), maxpolygons(0), maxnodes(0),
+          maxdepth(0), maxbytes(0), mergecoplanar(false), snapgrid(0), snapstats(nullptr), fixtjunctions(false) {
+    }
+};
+
+// A point an edge was split at, see CSGOptions::fixtjunctions.
+struct CSGEdgeSplit {
+    Vector a, b, point;
+};
+
+// Reusable scratch memory for the booleans. Tree nodes, polygon lists and
+// vertex lists released by one operation are kept and handed out again by the
+// next one instead of going back to the allocator, which matters when running
+// many small operations. Keep one context per worker thread, a context must not
+// be used by two threads at once. Nodes handed out are plain heap nodes so
+// trees built from a context can still be deleted normally.
+struct CSGContext {
+    CSGJSCPP_VECTOR<CSGNode *>                nodes;
+    CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>> polygonlists;
+    CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<PolygonVertex>> vertexlists;
+    // pooled memory is trimmed down to `limit` bytes after every operation, 0 keeps it all.
+    size_t limit;
+    // the most bytes held by the pools at the end of an operation.
+    size_t highwater;
+    // bytes held by the pooled nodes and lists, kept up to date as they come and go.
+    size_t pooled;
+    // options honoured by the operations run on this context, may be null.
+    const CSGOptions *options;
+    // CSG_OK unless the last operation was stopped, its result is then empty.
+    CSGStatus status;
+    unsigned  polls;
+    unsigned  stage, stages;
+    // made by the running operation, copies and split fragments included.
+    size_t madepolygons, madevertices, madenodes;
+    // held by the running operation right now, what the budgets in CSGOptions limit.
+    size_t livepolygons, livevertices, livenodes;
+    // what snapping did to the output of the last operation.
+    CSGSnapStats snapstats;
+    // edges split since the last operation finished, by a hash of their ends.
+    CSGJSCPP_HASHMAP<uint64_t, CSGJSCPP_VECTOR<CSGEdgeSplit>> splits;
+
+    CSGContext(size_t limit = 0)
+        : limit(limit), highwater(0), pooled(0), options(nullptr), status(CSG_OK), polls(0), stage(0), stages(0),
+          madepolygons(0), madevertices(0), madenodes(0), livepolygons(0), livevertices(0), livenodes(0) {
+    }
+    CSGContext(const CSGContext &) = delete;
+    CSGContext &operator=(const CSGContext &) = delete;
+    ~CSGContext();
+
+    CSGNode *newnode();
+    // Give a whole tree back, its nodes and the vertex lists of its polygons are pooled.
+    void release(CSGNode *tree);
+
+    CSGJSCPP_VECTOR<Polygon> takepolygons();
+    void                     givepolygons(CSGJSCPP_VECTOR<Polygon> &&list);
+    CSGJSCPP_VECTOR<PolygonVertex> takevertices();
+    void                           givevertices(CSGJSCPP_VECTOR<PolygonVertex> &&list);
+
+    // Bytes currently held by the pools, an estimate based on capacities.
+    size_t pooledbytes() const;
+    // Free pooled memory until no more than `bytes` are held.
+    void trim(size_t bytes = 0);
+    // Called when an operation is done, records the high water mark and applies `limit`.
+    void finish();
+
+    // Start an operation of `stages` steps, clears `status`.
+    void begin(unsigned stages);
+    // One step done, reported to the progress callback.
+    void advance();
+    // Called for every piece of work, true once the operation has to stop.
+    inline bool poll() {
+        if (status != CSG_OK)
+            return true;
+        if (!options || (++polls & 63))
+            return false;
+        return check();
+    }
+    bool check();
+    // Count polygons made by the running operation, and their vertices.
+    inline void made(size_t polygons, size_t vertices) {
+        madepolygons += polygons;
+        madevertices += vertices;
+        livepolygons += polygons;
+        livevertices += vertices;
+    }
+    // Polygons given back, their vertices are counted off as their lists come back.
+    inline void dropped(size_t polygons) {
+        livepolygons -= polygons < livepolygons ? polygons : livepolygons;
+    }
+    // Estimated bytes held by the running operation.
+    size_t livebytes() const;
+
+    // Remember that the edge from `a` to `b` was split at `point`.
+    void recordsplit(const Vector &a, const Vector &b, const Vector &point);
+};
+
+// One shared, already built, tree placed with its own transform. Many instances
+// can point at the same tree, the tree itself is never modified and only gets
+// copied when a transformed tree is asked for.
+struct CSGInstance {
+    CSGJSCPP_SHAREDPTR<const CSGNode> tree;
+    Transform                         transform;
+
+    CSGInstance() {
+    }
+    CSGInstance(const CSGJSCPP_SHAREDPTR<const CSGNode> &tree, const Transform &transform = Transform())
+        : tree(tree), transform(transform) {
+    }
+
+    // A new tree with the transform applied, the caller owns the result.
+    CSGNode *                realize() const;
+    CSGJSCPP_VECTOR<Polygon> allpolygons() const;
+
+    // Queries on the placed tree, answered by moving the query into tree space.
+    CSGNode::Containment classify(const Vector &point) const;
+    bool raycast(const Vector &origin, const Vector &dir, RayHit &hit, CSGJSCPP_REAL tmax = HUGE_VALF) const;
+};
+
 // public interface - not super efficient, if you use multiple CSG operations you should
 // use BSP trees and convert them into model only once. Another optimization trick is
 // replacing model with your own class.
@@ -246,6 +725,140 @@ CSGJSCPP_VECTOR<Polygon> csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJS
 CSGJSCPP_VECTOR<Polygon> csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b);
 CSGJSCPP_VECTOR<Polygon> csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b);
 
+/* The same operations drawing their scratch memory from a context kept by the
+** caller, see CSGContext. */
+Model csgunion(const Model &a, const Model &b, CSGContext &context);
+Model csgintersection(const Model &a, const Model &b, CSGContext &context);
+Model csgsubtract(const Model &a, const Model &b, CSGContext &context);
+
+CSGJSCPP_VECTOR<Polygon> csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                  CSGContext &context);
+CSGJSCPP_VECTOR<Polygon> csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                         CSGContext &context);
+CSGJSCPP_VECTOR<Polygon> csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                     CSGContext &context);
+
+/* Same operations on trees you have built yourself, for example with
+** CSGNode::buildconvex. Neither tree is modified and the caller owns the result. */
+CSGNode *csgunion(const CSGNode *a, const CSGNode *b);
+CSGNode *csgintersection(const CSGNode *a, const CSGNode *b);
+CSGNode *csgsubtract(const CSGNode *a, const CSGNode *b);
+CSGNode *csgunion(const CSGNode *a, const CSGNode *b, CSGContext &context);
+CSGNode *csgintersection(const CSGNode *a, const CSGNode *b, CSGContext &context);
+CSGNode *csgsubtract(const CSGNode *a, const CSGNode *b, CSGContext &context);
+
+/* Booleans that can be cancelled, bounded by a deadline and report progress,
+** see CSGOptions. `out` is only written when CSG_OK is returned. Operations run
+** on a context honour `context.options` and leave the outcome in `context.status`. */
+CSGStatus csgunion(const Model &a, const Model &b, Model &out, const CSGOptions &options);
+CSGStatus csgintersection(const Model &a, const Model &b, Model &out, const CSGOptions &options);
+CSGStatus csgsubtract(const Model &a, const Model &b, Model &out, const CSGOptions &options);
+
+CSGStatus csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                   CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options);
+CSGStatus csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                          CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options);
+CSGStatus csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                      CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options);
+
+/* Runs independent operations on a pool of worker threads so batch jobs can keep
+** every core busy. Each worker keeps its own CSGContext which is handed to the
+** jobs it runs. Jobs start in submission order. Results come back through a
+** future, or are handed to a callback on the worker thread. Operands are taken
+** by value, move them in to save the copy. The destructor finishes all queued
+** jobs before returning. A job that throws does not stop its worker: futures
+** carry the exception, callbacks can take it through `failed`, and anything else
+** thrown by a job is rethrown by the next wait(). */
+struct CSGBatch {
+    // 0 threads starts one per hardware thread, `contextlimit` is the limit of
+    // every worker's context.
+    CSGBatch(unsigned threads = 0, size_t contextlimit = 0);
+    CSGBatch(const CSGBatch &) = delete;
+    CSGBatch &operator=(const CSGBatch &) = delete;
+    ~CSGBatch();
+
+    std::future<Model> csgunion(Model a, Model b);
+    std::future<Model> csgintersection(Model a, Model b);
+    std::future<Model> csgsubtract(Model a, Model b);
+
+    std::future<CSGJSCPP_VECTOR<Polygon>> csgunion(CSGJSCPP_VECTOR<Polygon> a, CSGJSCPP_VECTOR<Polygon> b);
+    std::future<CSGJSCPP_VECTOR<Polygon>> csgintersection(CSGJSCPP_VECTOR<Polygon> a, CSGJSCPP_VECTOR<Polygon> b);
+    std::future<CSGJSCPP_VECTOR<Polygon>> csgsubtract(CSGJSCPP_VECTOR<Polygon> a, CSGJSCPP_VECTOR<Polygon> b);
+
+    std::future<Model>                    modelfrompolygons(CSGJSCPP_VECTOR<Polygon> polygons);
+    std::future<CSGJSCPP_VECTOR<Polygon>> csgfixtjunc(CSGJSCPP_VECTOR<Polygon> polygons);
+
+    // Queue `fun(context)`, the future gets its result (or what it threw).
+    template <typename FUNC>
+    std::future<decltype(std::declval<FUNC &>()(std::declval<CSGContext &>()))> submit(FUNC fun) {
+        typedef decltype(std::declval<FUNC &>()(std::declval<CSGContext &>())) Result;
+        CSGJSCPP_SHAREDPTR<std::packaged_task<Result(CSGContext &)>> task(
+            new std::packaged_task<Result(CSGContext &)>(CSGJSCPP_MOVE(fun)));
+        std::future<Result> ret = task->get_future();
+        post([task](CSGContext &context) { (*task)(context); });
+        return ret;
+    }
+
+    // Queue `fun(context)` and pass its result to `done`, both run on the worker.
+    template <typename FUNC, typename DONE> void submit(FUNC fun, DONE done) {
+        post([fun, done](CSGContext &context) mutable { done(fun(context)); });
+    }
+
+    // As above, when `fun` or `done` throws the exception is passed to `failed`
+    // on the worker instead.
+    template <typename FUNC, typename DONE, typename FAILED> void submit(FUNC fun, DONE done, FAILED failed) {
+        post([fun, done, failed](CSGContext &context) mutable {
+            std::exception_ptr error;
+            try {
+                done(fun(context));
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (error)
+                failed(error);
+        });
+    }
+
+    // Queue a job with no result.
+    void post(std::function<void(CSGContext &)> job);
+    // Block until every job queued so far has finished, then rethrow the first
+    // exception a job let escape since the last wait(), if any.
+    void     wait();
+    unsigned threads() const;
+
+    struct Workers;
+    CSGJSCPP_UNIQUEPTR<Workers> workers;
+};
+
+/* Spatially partitioned booleans for very large operands. Space is cut into a
+** uniform grid, each operand's polygons are split along the grid planes and the
+** ordinary boolean runs independently per cell on a pool of threads, so the cost
+** follows the local complexity of each cell rather than the total polygon count.
+** The cells' results are concatenated, cell walls split polygons but open no
+** seams since both sides share the split vertices. */
+struct CSGPartition {
+    int      cells[3]; // grid cells along x, y and z.
+    unsigned threads;  // worker threads, 0 uses one per hardware thread.
+
+    CSGPartition(int n = 4, unsigned threads = 0) : cells{n, n, n}, threads(threads) {
+    }
+};
+
+CSGJSCPP_VECTOR<Polygon> csgpartition_union(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                            const CSGPartition &partition = CSGPartition());
+CSGJSCPP_VECTOR<Polygon> csgpartition_intersection(const CSGJSCPP_VECTOR<Polygon> &a,
+                                                   const CSGJSCPP_VECTOR<Polygon> &b,
+                                                   const CSGPartition &partition = CSGPartition());
+CSGJSCPP_VECTOR<Polygon> csgpartition_subtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                               const CSGPartition &partition = CSGPartition());
+
+/* True when the polygons bound a convex solid: they form one closed surface whose
+** edges meet exactly and every face is on or behind the plane of its neighbours.
+** The edges are sorted once rather than every plane tested against every vertex.
+** Surfaces with T-junctions count as not convex. csgpolygon_cube, csgpolygon_sphere
+** and csgpolygon_cylinder always are convex. */
+bool csgisconvex(const CSGJSCPP_VECTOR<Polygon> &polygons);
+
 /* API to build a set of polygons representning primatves. */
 CSGJSCPP_VECTOR<Polygon> csgpolygon_cube(const Vector &center = {0.0f, 0.0f, 0.0f},
                                          const Vector &dim = {1.0f, 1.0f, 1.0f}, const uint32_t col = 0xFFFFFF);
@@ -256,9 +869,303 @@ CSGJSCPP_VECTOR<Polygon> csgpolygon_cylinder(const Vector &s = {0.0f, -1.0f, 0.0
                                              const uint32_t col = 0xFFFFFF, int slices = 16);
 
 CSGJSCPP_VECTOR<Polygon> csgfixtjunc(const CSGJSCPP_VECTOR<Polygon> &polygons);
+CSGStatus                csgfixtjunc(const CSGJSCPP_VECTOR<Polygon> &polygons, CSGJSCPP_VECTOR<Polygon> &out,
+                                     const CSGOptions &options);
+
+/* Round every vertex position to a multiple of `grid`. Vertices that land on
+** the same point are merged and polygons left with less than three vertices, no
+** area or turned over are dropped. A polygon whose vertices end up off its
+** plane gets a plane fitted to them, or is cut into triangles when no plane
+** fits. */
+CSGJSCPP_VECTOR<Polygon> csgsnap(const CSGJSCPP_VECTOR<Polygon> &polygons, CSGJSCPP_REAL grid,
+                                 CSGSnapStats *stats = nullptr);
+
+/* A boolean expression over primitives and polygon sets, kept so it can be
+** evaluated again at another resolution. Operands are shared, building a large
+** expression copies no polygons. */
+struct CSGExpr {
+    enum Kind { POLYGONS, CUBE, SPHERE, CYLINDER, UNION, INTERSECTION, SUBTRACT };
+
+    Kind kind;
+    // POLYGONS
+    CSGJSCPP_SHAREDPTR<const CSGJSCPP_VECTOR<Polygon>> polygons;
+    // CUBE (centre, dim), SPHERE (centre) and CYLINDER (start, end).
+    Vector        a, b;
+    CSGJSCPP_REAL radius;
+    uint32_t      col;
+    int           slices, stacks;
+    // UNION, INTERSECTION and SUBTRACT
+    CSGJSCPP_SHAREDPTR<const CSGExpr> left, right;
+
+    CSGExpr() : kind(POLYGONS), radius(0), col(0), slices(0), stacks(0) {
+    }
+};
+
+CSGExpr csgexpr_polygons(CSGJSCPP_VECTOR<Polygon> polygons);
+CSGExpr csgexpr_cube(const Vector &center = {0.0f, 0.0f, 0.0f}, const Vector &dim = {1.0f, 1.0f, 1.0f},
+                     const uint32_t col = 0xFFFFFF);
+CSGExpr csgexpr_sphere(const Vector &center = {0.0f, 0.0f, 0.0f}, CSGJSCPP_REAL radius = 1.0f,
+                       const uint32_t col = 0xFFFFFF, int slices = 16, int stacks = 8);
+CSGExpr csgexpr_cylinder(const Vector &s = {0.0f, -1.0f, 0.0f}, const Vector &e = {0.0f, 1.0f, 0.0f},
+                         CSGJSCPP_REAL radius = 1.0f, const uint32_t col = 0xFFFFFF, int slices = 16);
+CSGExpr csgexpr_union(const CSGExpr &a, const CSGExpr &b);
+CSGExpr csgexpr_intersection(const CSGExpr &a, const CSGExpr &b);
+CSGExpr csgexpr_subtract(const CSGExpr &a, const CSGExpr &b);
+
+/* Evaluate an expression with the slices and stacks of its spheres and
+** cylinders divided by `coarsen` (keeping at least 3 slices and 2 stacks). A
+** `coarsen` of 1 is the full result. An operation used more than once in the
+** expression is evaluated once. */
+CSGJSCPP_VECTOR<Polygon> csgevaluate(const CSGExpr &expr, int coarsen = 1);
+CSGStatus csgevaluate(const CSGExpr &expr, CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options, int coarsen = 1);
+
+/* Interactive evaluation. The constructor evaluates a coarse preview, with the
+** primitives coarsened and the output snapped to 2 * csgjs_EPSILON, and returns
+** with it in `preview`. The full result, the same as `csgevaluate(expr)`, is
+** then worked out on a background thread. Destroying the preview cancels the
+** refinement and waits for it, dropping anything the refinement threw. */
+struct CSGPreview {
+    CSGPreview(const CSGExpr &expr, int coarsen = 4);
+    CSGPreview(const CSGPreview &) = delete;
+    CSGPreview &operator=(const CSGPreview &) = delete;
+    ~CSGPreview();
+
+    // true once the full result is ready, without blocking.
+    bool ready() const;
+    // Wait for the full result, empty when the refinement was cancelled.
+    const CSGJSCPP_VECTOR<Polygon> &result();
+    // How the refinement ended, waits for it like result(). Both rethrow what
+    // the refinement threw (std::bad_alloc, or from a CSGJSCPP_VECTOR), on
+    // every call.
+    CSGStatus status();
+    // Stop the refinement early, result() is then empty.
+    void cancel();
+
+    CSGJSCPP_VECTOR<Polygon> preview;
+
+    std::atomic<bool>        stop;
+    CSGOptions               options; // of the refinement
+    CSGJSCPP_VECTOR<Polygon> full;
+    std::future<CSGStatus>   refine;
+    CSGStatus                refined;
+    std::exception_ptr       failed; // what the refinement threw
+};
+
+/* Append every call of csgunion, csgintersection, csgsubtract and csgfixtjunc
+** (the operation, its operands and options, how long it took and how it ended)
+** to a binary log at `path` until csgrecordstop(). Calls from any thread are
+** recorded, each one as it returns. Tree operands are stored as their polygons.
+** Returns false when the file can't be opened. Replay logs with csgreplay. */
+bool csgrecordstart(const char *path);
+void csgrecordstop();
+
+// One call read back from a log, see CSGLogReader.
+struct CSGLogRecord {
+    enum Operation { UNION = 0, INTERSECTION = 1, SUBTRACT = 2, FIXTJUNC = 3 };
+    enum Operands { POLYGONS = 0, MODELS = 1, TREES = 2 };
+
+    Operation operation;
+    Operands  operands;
+    CSGStatus status;
+    double    milliseconds;
+    // the options the call ran with, if any. The cancel flag and the progress
+    // callback are not recorded and the deadline is `deadlinems` from the start.
+    bool       hasoptions;
+    CSGOptions options;
+    double     deadlinems;
+    // the operands, `b` is empty for csgfixtjunc.
+    CSGJSCPP_VECTOR<Polygon> a, b;
+    Model                    modela, modelb;
+};
+
+// Reads a log written by csgrecordstart() one call at a time.
+struct CSGLogReader {
+    CSGLogReader(const char *path);
+    ~CSGLogReader();
+    CSGLogReader(const CSGLogReader &) = delete;
+    CSGLogReader &operator=(const CSGLogReader &) = delete;
+
+    // false when the file is missing or not a log.
+    bool ok() const;
+    // false at the end of the log, or at a record cut short or with counts
+    // the rest of the file can't hold.
+    bool next(CSGLogRecord &record);
+
+    void *   file; // FILE *
+    unsigned realsize;
+    unsigned version; // of the log format, older logs are still read.
+    uint64_t size;    // of the file, counts read from it are checked against what is left.
+};
 
 Model modelfrompolygons(const CSGJSCPP_VECTOR<Polygon> &polygons);
 
+/* One polygon per triangle of the model. With `mergecoplanar` adjacent triangles
+** in one plane with the same normal and colour are grouped into larger convex
+** polygons, so a flat face stored as many triangles costs the booleans one
+** polygon. The booleans on models do this when CSGOptions::mergecoplanar is set. */
+CSGJSCPP_VECTOR<Polygon> modeltopolygons(const Model &model, bool mergecoplanar = false);
+/* A model of all polygons of a tree, without collecting them into a list first. */
+Model modelfromtree(const CSGNode *tree);
+
+/* A model with the connectivity of its triangles. Half-edge `h` is corner `h`
+** of `model.indices`, it belongs to triangle h / 3 and runs from the position
+** of its corner to the position of the next corner. Vertices that differ only
+** in normal or colour share a position so adjacency carries across hard edges. */
+struct HalfEdgeMesh {
+    enum : uint32_t { NONE = 0xffffffff };
+
+    Model model;
+    // per vertex of the model, the position it is at.
+    CSGJSCPP_VECTOR<uint32_t> position;
+    // per half-edge, the one running the other way along the same edge. NONE on
+    // the boundary and on edges shared by more than two triangles.
+    CSGJSCPP_VECTOR<uint32_t> twin;
+    // per position, a half-edge leaving it, a boundary one when there is one so
+    // walking round with `twin[prev(h)]` visits every triangle of the fan.
+    CSGJSCPP_VECTOR<uint32_t> outgoing;
+
+    static uint32_t next(uint32_t h) {
+        return h % 3 == 2 ? h - 2 : h + 1;
+    }
+    static uint32_t prev(uint32_t h) {
+        return h % 3 == 0 ? h + 2 : h - 1;
+    }
+    uint32_t origin(uint32_t h) const {
+        return position[model.indices[h]];
+    }
+    uint32_t target(uint32_t h) const {
+        return origin(next(h));
+    }
+    size_t positions() const {
+        return outgoing.size();
+    }
+};
+
+/* Build the connectivity of a model in one pass over its triangles, expected
+** linear time. With more than one thread (0 is one per hardware thread) the
+** edges are matched in parallel, which pays off for large meshes. A model
+** whose index count is not a multiple of 3 gives an empty mesh. */
+HalfEdgeMesh halfedgemesh(const Model &model, unsigned threads = 1);
+HalfEdgeMesh halfedgemesh(Model &&model, unsigned threads = 1);
+
+/* Write a built tree (planes, topology and polygons) to `path` in a versioned
+** binary format that CSGMappedTree maps back without rebuilding it. Files are
+** native byte order and `CSGJSCPP_REAL`, a reader built otherwise refuses them.
+** Returns false when the file can't be written. */
+bool csgsavetree(const CSGNode *tree, const char *path);
+
+/* A tree file from csgsavetree() mapped into memory. Clipping reads the mapped
+** nodes directly, `load()` makes an ordinary tree of it by copying nodes and
+** polygons out, with no splitting. The mapping is read only and may be shared
+** by many threads. */
+struct CSGMappedTree {
+    explicit CSGMappedTree(const char *path);
+    ~CSGMappedTree();
+    CSGMappedTree(const CSGMappedTree &) = delete;
+    CSGMappedTree &operator=(const CSGMappedTree &) = delete;
+
+    // false when the file is missing, from another version or build, or damaged.
+    bool   ok() const;
+    size_t nodecount() const;
+    size_t polygoncount() const;
+
+    // As CSGNode::clippolygons (without the convex fast path).
+    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list) const;
+    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context) const;
+
+    // A new tree the caller owns, nullptr when not ok().
+    CSGNode *load() const;
+    CSGNode *load(CSGContext &context) const;
+
+    const char *data;
+    size_t      size;
+    void *      mapping; // the file mapping handle on Windows
+    bool        valid;
+};
+
+/* How csgsavemodel() stores a model. The defaults store it exactly. */
+struct CSGModelFileOptions {
+    // positions as 16 bits per axis inside the model's bounds, which is exact
+    // to 1/131070 of the largest extent.
+    bool quantizepositions;
+    // normals octahedral encoded in 2 x 16 bits, as with CSGJSCPP_COMPACT_VERTEX.
+    // They come back unit length, interpolated normals of split edges may not be.
+    bool quantizenormals;
+    // indices as variable length deltas, or with CSGJSCPP_USE_MESHOPTIMIZER both
+    // buffers with meshoptimizer's index and vertex codecs.
+    bool compress;
+
+    CSGModelFileOptions() : quantizepositions(false), quantizenormals(false), compress(false) {
+    }
+};
+
+/* Write a model to `path` in a compact binary format, read back with
+** csgloadmodel() by mapping the file and decoding it in one pass. Meant for
+** caching results between runs, it is native byte order and `CSGJSCPP_REAL`
+** like csgsavetree(). Returns false when the file can't be written. */
+bool csgsavemodel(const Model &model, const char *path);
+bool csgsavemodel(const Model &model, const char *path, const CSGModelFileOptions &options);
+
+/* Read a file from csgsavemodel() into `out`. Returns false, leaving `out`
+** untouched, when the file is missing, damaged, from another version or build,
+** or compressed with meshoptimizer in a build without CSGJSCPP_USE_MESHOPTIMIZER. */
+bool csgloadmodel(const char *path, Model &out);
+
+/* What csgoptimizemodel() changed. ACMR is the vertices transformed per triangle
+** and ATVR per vertex through a FIFO post-transform cache of `cachesize`
+** entries, 0.5 and 1 are the best a mesh can do. */
+struct CSGOptimizeStats {
+    size_t verticesbefore, verticesafter;
+    size_t trianglesbefore, trianglesafter;
+    float  acmrbefore, acmrafter;
+    float  atvrbefore, atvrafter;
+
+    CSGOptimizeStats()
+        : verticesbefore(0), verticesafter(0), trianglesbefore(0), trianglesafter(0), acmrbefore(0), acmrafter(0),
+          atvrbefore(0), atvrafter(0) {
+    }
+};
+
+/* Which passes csgoptimizemodel() runs, in this order after welding duplicate
+** vertices. The defaults prepare a model for drawing without changing its shape. */
+struct CSGOptimizeOptions {
+    // keep the triangles `simplify` of the original, 1 keeps them all. The
+    // simplifier moves no vertices and stops before the error passes
+    // `simplifyerror`, relative to the model's extent, so it may keep more.
+    float simplify;
+    float simplifyerror;
+    // reorder triangles for the post-transform cache.
+    bool vertexcache;
+    // reorder clusters of triangles to draw front to back, letting the cache
+    // hit ratio get `overdrawthreshold` worse.
+    bool  overdraw;
+    float overdrawthreshold;
+    // reorder vertices in the order the triangles use them, also dropping the
+    // vertices simplify left unused.
+    bool vertexfetch;
+    // the cache the stats are measured with.
+    unsigned cachesize;
+
+    CSGOptimizeOptions()
+        : simplify(1), simplifyerror(0.01f), vertexcache(true), overdraw(true), overdrawthreshold(1.05f),
+          vertexfetch(true), cachesize(16) {
+    }
+};
+
+/* Ready a model for a GPU with meshoptimizer, available with
+** CSGJSCPP_USE_MESHOPTIMIZER. Works for any `CSGJSCPP_REAL` and
+** `CSGJSCPP_INDEX`, converting to the float positions and 32 bit indices
+** meshoptimizer takes. `stats`, when given, is filled in either way. Returns
+** false, leaving `model` untouched, in a build without meshoptimizer. A model
+** without vertices or triangles is left as it is. */
+bool csgoptimizemodel(Model &model, const CSGOptimizeOptions &options = CSGOptimizeOptions(),
+                      CSGOptimizeStats *stats = nullptr);
+
+/* Apply an affine transform to a set of polygons, vertex normals and planes are
+** transformed with the inverse transpose and winding is kept outward facing for
+** mirroring transforms. */
+CSGJSCPP_VECTOR<Polygon> csgtransform(const CSGJSCPP_VECTOR<Polygon> &polygons, const Transform &tr);
+
 /* API to build models representing primatives */
 Model csgmodel_cube(const Vector &center = {0.0f, 0.0f, 0.0f}, const Vector &dim = {1.0f, 1.0f, 1.0f},
                     const uint32_t col = 0xFFFFFF);
@@ -280,31 +1187,33 @@ Model csgmodel_cylinder(const Vector &s = {0.0f, -1.0f, 0.0f}, const Vector &e =
 /* implementation below here */
 
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#if !defined(WIN32_LEAN_AND_MEAN)
+#define WIN32_LEAN_AND_MEAN
+#endif
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-namespace csgjscpp {
-
-// Holds a node in a BSP tree. A BSP tree is built from a collection of polygons
-// by picking a polygon to split along. That polygon (and all other coplanar
-// polygons) are added directly to that node and the other polygons are added to
-// the front and/or back subtrees. This is not a leafy BSP tree since there is
-// no distinction between internal and leaf nodes.
-struct CSGNode {
-    CSGJSCPP_VECTOR<Polygon> polygons;
-    CSGNode *                front;
-    CSGNode *                back;
-    Plane                    plane;
-
-    CSGNode();
-    CSGNode(const CSGJSCPP_VECTOR<Polygon> &list);
-    ~CSGNode();
+#if defined(CSGJSCPP_USE_MESHOPTIMIZER)
+#include "meshoptimizer.h"
+#endif
+#include <mutex>
+#include <thread>
 
-    CSGNode *                clone() const;
-    void                     clipto(const CSGNode *other);
-    void                     invert();
-    void                     build(const CSGJSCPP_VECTOR<Polygon> &Polygon);
-    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list) const;
-    CSGJSCPP_VECTOR<Polygon> allpolygons() const;
-};
+namespace csgjscpp {
 
 // Vertex implementation
 
@@ -326,6 +1235,36 @@ inline Vertex interpolate(const Vertex &a, const Vertex &b, CSGJSCPP_REAL t) {
     return ret;
 }
 
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+// Normals are only decoded when they differ, which they don't along the
+// edges of flat faces.
+inline PolygonVertex interpolate(const PolygonVertex &a, const PolygonVertex &b, CSGJSCPP_REAL t) {
+    PolygonVertex ret;
+    ret.pos = lerp(a.pos, b.pos, t);
+    ret.normal = a.normal == b.normal ? a.normal : OctNormal(lerp(Vector(a.normal), Vector(b.normal), t));
+    return ret;
+}
+#endif
+
+// The vertex a polygon keeps for `v`.
+inline PolygonVertex packvertex(const Vertex &v) {
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+    return PolygonVertex{v.pos, v.normal};
+#else
+    return v;
+#endif
+}
+
+// What a polygon keeps besides its vertices, plane and plane id.
+inline void copyattributes(Polygon &to, const Polygon &from) {
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+    to.col = from.col;
+#else
+    (void)to;
+    (void)from;
+#endif
+}
+
 // Plane implementation
 
 Plane::Plane() : normal(), w(0.0f) {
@@ -336,201 +1275,723 @@ Plane::Plane(const Vector &a, const Vector &b, const Vector &c) {
     this->w = dot(this->normal, a);
 }
 
-// Split `polygon` by this plane if needed, then put the polygon or polygon
-// fragments in the appropriate lists. Coplanar polygons go into either
-// `coplanarFront` or `coplanarBack` depending on their orientation with
-// respect to this plane. Polygons in front or in back of this plane go into
-// either `front` or `back`.
-void Plane::splitpolygon(const Polygon &poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront,
-                         CSGJSCPP_VECTOR<Polygon> &coplanarBack, CSGJSCPP_VECTOR<Polygon> &front,
-                         CSGJSCPP_VECTOR<Polygon> &back) const {
+// The vertex list of a polygon that got split is of no further use, when the
+// polygon is ours it goes back to the context.
+inline void recyclevertices(CSGContext *context, Polygon &&poly) {
+    if (context) {
+        context->dropped(1);
+        context->givevertices(CSGJSCPP_MOVE(poly.vertices));
+    }
+}
+
+inline void recyclevertices(CSGContext *, const Polygon &) {
+}
+
+// Polygons we own are moved on, others are copied into a vertex list from the
+// context so the pools stay balanced.
+inline Polygon &&passpolygon(CSGContext *, Polygon &&poly) {
+    return CSGJSCPP_MOVE(poly);
+}
+
+inline Polygon passpolygon(CSGContext *context, const Polygon &poly) {
+    if (!context)
+        return poly;
+    Polygon ret;
+    ret.vertices = context->takevertices();
+    ret.vertices.assign(poly.vertices.begin(), poly.vertices.end());
+    ret.plane = poly.plane;
+    copyattributes(ret, poly);
+    context->made(1, ret.vertices.size());
+    return ret;
+}
+
+template <typename POLYGON>
+inline void splitpolygoninto(const Plane &plane, POLYGON &&poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront,
+                             CSGJSCPP_VECTOR<Polygon> &coplanarBack, CSGJSCPP_VECTOR<Polygon> &front,
+                             CSGJSCPP_VECTOR<Polygon> &back, CSGContext *context = nullptr) {
 
     // Classify each point as well as the entire polygon into one of the above
     // four classes.
     int polygonType = 0;
     for (const auto &v : poly.vertices) {
-        polygonType |= classify(v.pos);
+        polygonType |= plane.classify(v.pos);
     }
 
     // Put the polygon in the correct list, splitting it when necessary.
     switch (polygonType) {
-    case COPLANAR: {
-        if (dot(this->normal, poly.plane.normal) > 0)
-            coplanarFront.push_back(poly);
+    case Plane::COPLANAR: {
+        if (dot(plane.normal, poly.plane.normal) > 0)
+            coplanarFront.push_back(passpolygon(context, std::forward<POLYGON>(poly)));
         else
-            coplanarBack.push_back(poly);
+            coplanarBack.push_back(passpolygon(context, std::forward<POLYGON>(poly)));
         break;
     }
-    case FRONT: {
-        front.push_back(poly);
+    case Plane::FRONT: {
+        front.push_back(passpolygon(context, std::forward<POLYGON>(poly)));
         break;
     }
-    case BACK: {
-        back.push_back(poly);
+    case Plane::BACK: {
+        back.push_back(passpolygon(context, std::forward<POLYGON>(poly)));
         break;
     }
-    case SPANNING: {
-        CSGJSCPP_VECTOR<Vertex> f, b;
+    case Plane::SPANNING: {
+        CSGJSCPP_VECTOR<PolygonVertex> f, b;
+        if (context) {
+            f = context->takevertices();
+            b = context->takevertices();
+        }
 
         for (size_t i = 0; i < poly.vertices.size(); i++) {
 
             size_t j = (i + 1) % poly.vertices.size();
 
-            const Vertex &vi = poly.vertices[i];
-            const Vertex &vj = poly.vertices[j];
+            const PolygonVertex &vi = poly.vertices[i];
+            const PolygonVertex &vj = poly.vertices[j];
 
-            int ti = classify(vi.pos);
-            int tj = classify(vj.pos);
+            int ti = plane.classify(vi.pos);
+            int tj = plane.classify(vj.pos);
 
-            if (ti != BACK)
+            if (ti != Plane::BACK)
                 f.push_back(vi);
-            if (ti != FRONT)
+            if (ti != Plane::FRONT)
                 b.push_back(vi);
-            if ((ti | tj) == SPANNING) {
-                CSGJSCPP_REAL t = (this->w - dot(this->normal, vi.pos)) / dot(this->normal, vj.pos - vi.pos);
-                Vertex        v = interpolate(vi, vj, t);
+            if ((ti | tj) == Plane::SPANNING) {
+                // worked out from the same end whichever way the edge is walked,
+                // so a flipped polygon and the neighbour sharing the edge get
+                // the very same point.
+                bool                 forward = vi.pos.x != vj.pos.x   ? vi.pos.x < vj.pos.x
+                                               : vi.pos.y != vj.pos.y ? vi.pos.y < vj.pos.y
+                                                                      : vi.pos.z < vj.pos.z;
+                const PolygonVertex &va = forward ? vi : vj;
+                const PolygonVertex &vb = forward ? vj : vi;
+                CSGJSCPP_REAL t = (plane.w - dot(plane.normal, va.pos)) / dot(plane.normal, vb.pos - va.pos);
+                PolygonVertex v = interpolate(va, vb, t);
                 f.push_back(v);
                 b.push_back(v);
+                if (context && context->options && context->options->fixtjunctions)
+                    context->recordsplit(vi.pos, vj.pos, v.pos);
             }
         }
+        if (context)
+            context->made((f.size() >= 3) + (b.size() >= 3), f.size() + b.size());
+        // fragments lie in the plane of the polygon they came from.
         if (f.size() >= 3)
-            front.push_back(Polygon(f));
+            front.push_back(Polygon(CSGJSCPP_MOVE(f), poly));
+        else if (context)
+            context->givevertices(CSGJSCPP_MOVE(f));
         if (b.size() >= 3)
-            back.push_back(Polygon(b));
+            back.push_back(Polygon(CSGJSCPP_MOVE(b), poly));
+        else if (context)
+            context->givevertices(CSGJSCPP_MOVE(b));
+        recyclevertices(context, std::forward<POLYGON>(poly));
         break;
     }
     }
 }
 
-// Polygon implementation
+// Split `polygon` by this plane if needed, then put the polygon or polygon
+// fragments in the appropriate lists. Coplanar polygons go into either
+// `coplanarFront` or `coplanarBack` depending on their orientation with
+// respect to this plane. Polygons in front or in back of this plane go into
+// either `front` or `back`.
+void Plane::splitpolygon(const Polygon &poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront,
+                         CSGJSCPP_VECTOR<Polygon> &coplanarBack, CSGJSCPP_VECTOR<Polygon> &front,
+                         CSGJSCPP_VECTOR<Polygon> &back) const {
+    splitpolygoninto(*this, poly, coplanarFront, coplanarBack, front, back);
+}
 
-Polygon::Polygon() {
+void Plane::splitpolygon(Polygon &&poly, CSGJSCPP_VECTOR<Polygon> &coplanarFront,
+                         CSGJSCPP_VECTOR<Polygon> &coplanarBack, CSGJSCPP_VECTOR<Polygon> &front,
+                         CSGJSCPP_VECTOR<Polygon> &back) const {
+    splitpolygoninto(*this, CSGJSCPP_MOVE(poly), coplanarFront, coplanarBack, front, back);
 }
 
-Polygon::Polygon(const CSGJSCPP_VECTOR<Vertex> &list)
-    : vertices(list), plane(vertices[0].pos, vertices[1].pos, vertices[2].pos) {
+// Split every polygon of `list`, polygons are moved out of lists we own.
+inline void splitpolygons(const Plane &plane, const CSGJSCPP_VECTOR<Polygon> &list,
+                          CSGJSCPP_VECTOR<Polygon> &coplanarFront, CSGJSCPP_VECTOR<Polygon> &coplanarBack,
+                          CSGJSCPP_VECTOR<Polygon> &front, CSGJSCPP_VECTOR<Polygon> &back, CSGContext *context) {
+    for (const auto &poly : list)
+        splitpolygoninto(plane, poly, coplanarFront, coplanarBack, front, back, context);
 }
 
-// Node implementation
+inline void splitpolygons(const Plane &plane, CSGJSCPP_VECTOR<Polygon> &&list,
+                          CSGJSCPP_VECTOR<Polygon> &coplanarFront, CSGJSCPP_VECTOR<Polygon> &coplanarBack,
+                          CSGJSCPP_VECTOR<Polygon> &front, CSGJSCPP_VECTOR<Polygon> &back, CSGContext *context) {
+    for (auto &poly : list)
+        splitpolygoninto(plane, CSGJSCPP_MOVE(poly), coplanarFront, coplanarBack, front, back, context);
+    list.clear();
+}
 
-// Return a new CSG solid representing space in either this solid or in the
-// solid `csg`. Neither this solid nor the solid `csg` are modified.
-inline CSGNode *csg_union(const CSGNode *a1, const CSGNode *b1) {
-    CSGNode *a = a1->clone();
-    CSGNode *b = b1->clone();
-    a->clipto(b);
-    b->clipto(a);
-    b->invert();
-    b->clipto(a);
-    b->invert();
-    a->build(b->allpolygons());
-    CSGNode *ret = new CSGNode(a->allpolygons());
-    delete a;
-    delete b;
+// Move the polygons of `list` to the end of `dest`, `list` is left empty.
+inline void appendpolygons(CSGJSCPP_VECTOR<Polygon> &dest, CSGJSCPP_VECTOR<Polygon> &list) {
+    if (!dest.size()) {
+        dest.swap(list);
+        return;
+    }
+    for (auto &poly : list)
+        dest.push_back(CSGJSCPP_MOVE(poly));
+    list.clear();
+}
+
+// Empty `list` but keep its storage, the vertex lists go back to `context`.
+inline void clearpolygons(CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context) {
+    context.dropped(list.size());
+    for (auto &poly : list)
+        context.givevertices(CSGJSCPP_MOVE(poly.vertices));
+    list.clear();
+}
+
+// A copy of `poly` whose vertex list comes from `context`.
+inline Polygon copypolygon(const Polygon &poly, CSGContext &context) {
+    return passpolygon(&context, poly);
+}
+
+// Polygon implementation
+
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+
+Polygon::Polygon() : col(0) {
+}
+
+Polygon::Polygon(const CSGJSCPP_VECTOR<Vertex> &list)
+    : plane(list[0].pos, list[1].pos, list[2].pos), col(list[0].col) {
+    vertices.reserve(list.size());
+    for (const auto &v : list)
+        vertices.push_back(packvertex(v));
+}
+
+Polygon::Polygon(CSGJSCPP_VECTOR<Vertex> &&list) : Polygon((const CSGJSCPP_VECTOR<Vertex> &)list) {
+}
+
+Polygon::Polygon(CSGJSCPP_VECTOR<PolygonVertex> &&list, const Polygon &parent)
+    : vertices(CSGJSCPP_MOVE(list)), plane(parent.plane), col(parent.col) {
+}
+
+#else
+
+Polygon::Polygon() {
+}
+
+Polygon::Polygon(const CSGJSCPP_VECTOR<Vertex> &list)
+    : vertices(list), plane(vertices[0].pos, vertices[1].pos, vertices[2].pos) {
+}
+
+Polygon::Polygon(CSGJSCPP_VECTOR<Vertex> &&list)
+    : vertices(CSGJSCPP_MOVE(list)), plane(vertices[0].pos, vertices[1].pos, vertices[2].pos) {
+}
+
+Polygon::Polygon(CSGJSCPP_VECTOR<Vertex> &&list, const Polygon &parent)
+    : vertices(CSGJSCPP_MOVE(list)), plane(parent.plane) {
+}
+
+#endif
+
+// How the clipping walk reads a tree of CSGNodes, see MappedTree for the other.
+// An inverted tree is read flipped, as `invert()` used to leave it.
+struct NodeTree {
+    typedef const CSGNode *Node;
+
+    bool inverted;
+
+    static bool ok(Node me) {
+        return me != nullptr;
+    }
+    Plane plane(Node me) const {
+        Plane ret = me->plane;
+        if (inverted)
+            ret.flip();
+        return ret;
+    }
+    Node front(Node me) const {
+        return inverted ? me->back : me->front;
+    }
+    Node back(Node me) const {
+        return inverted ? me->front : me->back;
+    }
+};
+
+// Split `list` by a node's plane for clipping, coplanar polygons go down the
+// side they face. `flipped` polygons belong to an inverted tree and are stored
+// facing the other way, which only changes where the coplanar ones go.
+template <typename LIST>
+inline void clipsplit(const Plane &plane, LIST &&list, CSGJSCPP_VECTOR<Polygon> &front,
+                      CSGJSCPP_VECTOR<Polygon> &back, CSGContext &context, bool flipped) {
+    if (flipped)
+        splitpolygons(plane, std::forward<LIST>(list), back, front, front, back, &context);
+    else
+        splitpolygons(plane, std::forward<LIST>(list), front, back, front, back, &context);
+}
+
+// Clipping against a convex solid needs no tree walk, the tree made by
+// `CSGNode::buildconvex()` is a chain so a polygon can be clipped against the
+// face planes in order. The planes are copied into separate arrays so the
+// distance loop over all planes vectorizes and no node pointers are chased.
+//
+// A chain linked through `back` is the solid: whatever ends up in front of a
+// plane is outside and kept, what is behind every plane is dropped. An
+// inverted chain is read linked through `front`: whatever is behind a plane is
+// dropped and what is in front of every plane is kept. Chains are inverted by
+// the flag on their root, the planes are flipped as they are copied.
+struct ConvexClipper {
+    CSGJSCPP_VECTOR<Plane>         planes;
+    CSGJSCPP_VECTOR<CSGJSCPP_REAL> nx, ny, nz, w;
+    bool                           inverted;
+
+    // scratch for the per polygon distance ranges.
+    mutable CSGJSCPP_VECTOR<CSGJSCPP_REAL> mind, maxd;
+
+    ConvexClipper(const CSGNode *root) : inverted((root->front != nullptr) != root->inverted) {
+        // a chain has one child per node, linked through `front` if it was
+        // flipped in place rather than by the flag.
+        NodeTree tree = {root->inverted};
+        for (const CSGNode *me = root; me; me = me->front ? me->front : me->back) {
+            Plane plane = tree.plane(me);
+            planes.push_back(plane);
+            nx.push_back(plane.normal.x);
+            ny.push_back(plane.normal.y);
+            nz.push_back(plane.normal.z);
+            w.push_back(plane.w);
+        }
+        mind.resize(planes.size());
+        maxd.resize(planes.size());
+    }
+
+    static const size_t kBlock = 16;
+
+    // `flipped` as for clipsplit().
+    CSGJSCPP_VECTOR<Polygon> clippolygons(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context,
+                                          bool flipped = false) const {
+        CSGJSCPP_VECTOR<Polygon> result = context.takepolygons();
+        CSGJSCPP_VECTOR<Polygon> pieces = context.takepolygons();
+        CSGJSCPP_VECTOR<Polygon> front = context.takepolygons(), back = context.takepolygons();
+        const size_t             count = planes.size();
+
+        for (const auto &poly : list) {
+            if (context.poll())
+                break;
+
+            // distance ranges are worked out a block of planes at a time so a
+            // polygon entirely on the far side of an early plane stops there.
+            bool decided = false;
+            for (size_t start = 0; start < count && !decided; start += kBlock) {
+                const size_t end = start + kBlock < count ? start + kBlock : count;
+                for (size_t i = start; i < end; i++) {
+                    mind[i] = maxd[i] = dot(poly.vertices[0].pos, planes[i].normal) - w[i];
+                }
+                for (size_t v = 1; v < poly.vertices.size(); v++) {
+                    const Vector &p = poly.vertices[v].pos;
+                    for (size_t i = start; i < end; i++) {
+                        CSGJSCPP_REAL d = nx[i] * p.x + ny[i] * p.y + nz[i] * p.z - w[i];
+                        mind[i] = d < mind[i] ? d : mind[i];
+                        maxd[i] = d > maxd[i] ? d : maxd[i];
+                    }
+                }
+                // fully on the far side of any one plane decides the whole polygon.
+                for (size_t i = start; i < end && !decided; i++)
+                    decided = inverted ? maxd[i] < -csgjs_EPSILON : mind[i] > csgjs_EPSILON;
+            }
+            if (decided) {
+                if (!inverted)
+                    result.push_back(copypolygon(poly, context));
+                continue;
+            }
+
+            // otherwise clip in chain order, planes the polygon is entirely on the
+            // continuing side of can't split it so they are skipped.
+            pieces.push_back(copypolygon(poly, context));
+            for (size_t i = 0; i < count && pieces.size(); i++) {
+                if (inverted ? mind[i] > csgjs_EPSILON : maxd[i] < -csgjs_EPSILON)
+                    continue;
+
+                clipsplit(planes[i], CSGJSCPP_MOVE(pieces), front, back, context, flipped);
+                if (inverted) {
+                    pieces.swap(front);
+                    clearpolygons(back, context);
+                } else {
+                    appendpolygons(result, front);
+                    pieces.swap(back);
+                }
+            }
+            if (inverted)
+                appendpolygons(result, pieces);
+            else
+                clearpolygons(pieces, context);
+        }
+        context.givepolygons(CSGJSCPP_MOVE(pieces));
+        context.givepolygons(CSGJSCPP_MOVE(front));
+        context.givepolygons(CSGJSCPP_MOVE(back));
+        return result;
+    }
+};
+
+// Axis aligned box, starts empty (min > max).
+struct BoundingBox {
+    Vector min, max;
+
+    BoundingBox() : min(HUGE_VALF, HUGE_VALF, HUGE_VALF), max(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF) {
+    }
+
+    inline void extend(const Vector &p) {
+        min = Vector(p.x < min.x ? p.x : min.x, p.y < min.y ? p.y : min.y, p.z < min.z ? p.z : min.z);
+        max = Vector(p.x > max.x ? p.x : max.x, p.y > max.y ? p.y : max.y, p.z > max.z ? p.z : max.z);
+    }
+    inline void extend(const Polygon &poly) {
+        for (const auto &v : poly.vertices)
+            extend(v.pos);
+    }
+    inline void extend(const CSGJSCPP_VECTOR<Polygon> &list) {
+        for (const auto &poly : list)
+            extend(poly);
+    }
+    inline void extend(const BoundingBox &box) {
+        if (box.min.x <= box.max.x) {
+            extend(box.min);
+            extend(box.max);
+        }
+    }
+
+    // Where everything in the box is relative to `plane`, FRONT or BACK when
+    // every point inside classifies that way and SPANNING otherwise. The
+    // nearest and farthest corners round the same way as the points do.
+    inline Plane::Classification side(const Plane &plane) const {
+        const Vector &n = plane.normal;
+        Vector        nearest(n.x > 0 ? min.x : max.x, n.y > 0 ? min.y : max.y, n.z > 0 ? min.z : max.z);
+        Vector        farthest(n.x > 0 ? max.x : min.x, n.y > 0 ? max.y : min.y, n.z > 0 ? max.z : min.z);
+        if (plane.classify(nearest) == Plane::FRONT)
+            return Plane::FRONT;
+        if (plane.classify(farthest) == Plane::BACK)
+            return Plane::BACK;
+        return Plane::SPANNING;
+    }
+};
+
+inline BoundingBox nodebounds(const CSGNode *node) {
+    BoundingBox box;
+    box.min = node->boundsmin;
+    box.max = node->boundsmax;
+    return box;
+}
+
+// Work out the bounds of every node of the tree under `root`, children first.
+inline void updatebounds(CSGNode *root) {
+    CSGJSCPP_VECTOR<CSGNode *> nodes(1, root);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i]->front)
+            nodes.push_back(nodes[i]->front);
+        if (nodes[i]->back)
+            nodes.push_back(nodes[i]->back);
+    }
+    for (size_t i = nodes.size(); i--;) {
+        CSGNode *   me = nodes[i];
+        BoundingBox box;
+        box.extend(me->polygons);
+        if (me->front)
+            box.extend(nodebounds(me->front));
+        if (me->back)
+            box.extend(nodebounds(me->back));
+        me->boundsmin = box.min;
+        me->boundsmax = box.max;
+    }
+}
+
+// Clip the ray `origin + t * dir` for t in [tmin, tmax] to a box grown by
+// epsilon, false when it misses.
+inline bool raybox(const BoundingBox &box, const Vector &origin, const Vector &dir, CSGJSCPP_REAL tmin,
+                   CSGJSCPP_REAL tmax) {
+    const CSGJSCPP_REAL o[] = {origin.x, origin.y, origin.z}, d[] = {dir.x, dir.y, dir.z};
+    const CSGJSCPP_REAL lo[] = {box.min.x, box.min.y, box.min.z}, hi[] = {box.max.x, box.max.y, box.max.z};
+    for (int i = 0; i < 3; i++) {
+        if (!(lo[i] <= hi[i]))
+            return false;
+        CSGJSCPP_REAL l = lo[i] - csgjs_EPSILON, h = hi[i] + csgjs_EPSILON;
+        if (d[i] == 0) {
+            if (o[i] < l || o[i] > h)
+                return false;
+            continue;
+        }
+        CSGJSCPP_REAL t0 = (l - o[i]) / d[i], t1 = (h - o[i]) / d[i];
+        if (t0 > t1)
+            CSGJSCPP_SWAP(t0, t1);
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmin > tmax)
+            return false;
+    }
+    return true;
+}
+
+// Intersect the ray `origin + t * dir` with a convex polygon, on a hit `t` is
+// set. Points exactly on an edge count as a hit.
+inline bool raypolygon(const Polygon &poly, const Vector &origin, const Vector &dir, CSGJSCPP_REAL &t) {
+    CSGJSCPP_REAL denom = dot(poly.plane.normal, dir);
+    if (denom == 0)
+        return false;
+
+    CSGJSCPP_REAL hit = (poly.plane.w - dot(poly.plane.normal, origin)) / denom;
+    Vector        p = origin + dir * hit;
+    for (size_t i = 0; i < poly.vertices.size(); i++) {
+        const Vector &a = poly.vertices[i].pos;
+        const Vector &b = poly.vertices[(i + 1) % poly.vertices.size()].pos;
+        if (dot(cross(b - a, p - a), poly.plane.normal) < 0)
+            return false;
+    }
+    t = hit;
+    return true;
+}
+
+// Node implementation
+
+// Move every polygon out of the tree `node` into a list from `context`, in the
+// same order as `allpolygons()`. They are flipped as needed to be stored in a
+// tree whose `inverted` flag is `inverted`.
+inline CSGJSCPP_VECTOR<Polygon> takeallpolygons(CSGNode *node, CSGContext &context, bool inverted = false) {
+    CSGJSCPP_VECTOR<Polygon>   result = context.takepolygons();
+    CSGJSCPP_VECTOR<CSGNode *> nodes(1, node);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        CSGNode *me = nodes[i];
+        assert((me == node || !me->inverted) && "only the root of a tree is inverted");
+        appendpolygons(result, me->polygons);
+        if (me->front)
+            nodes.push_back(me->front);
+        if (me->back)
+            nodes.push_back(me->back);
+    }
+    if (node->inverted != inverted) {
+        for (auto &poly : result)
+            poly.flip();
+    }
+    return result;
+}
+
+template <typename LIST> void buildtree(CSGNode *root, LIST &&ilist, CSGContext &context);
+
+// The tree a boolean leaves behind holds the right polygons but its cells
+// don't all classify space, rebuild it into a proper tree of the result.
+inline CSGNode *csg_rebuild(CSGNode *a, CSGContext &context) {
+    CSGNode *                ret = context.newnode();
+    CSGJSCPP_VECTOR<Polygon> list = takeallpolygons(a, context);
+    buildtree(ret, CSGJSCPP_MOVE(list), context);
+    context.givepolygons(CSGJSCPP_MOVE(list));
+    context.release(a);
+    context.advance();
     return ret;
 }
 
+// Add the polygons of `b` to the tree of `a` and release `b`.
+inline void csg_merge(CSGNode *a, CSGNode *b, CSGContext &context) {
+    CSGJSCPP_VECTOR<Polygon> list = takeallpolygons(b, context, a->inverted);
+    buildtree(a, CSGJSCPP_MOVE(list), context);
+    context.givepolygons(CSGJSCPP_MOVE(list));
+    context.release(b);
+}
+
+// The three booleans return a tree holding the polygons of the result, use
+// `csg_rebuild()` on it when the tree itself is going to be used.
+
+// Return a new CSG solid representing space in either this solid or in the
+// solid `csg`. Neither this solid nor the solid `csg` are modified.
+inline CSGNode *csg_union(const CSGNode *a1, const CSGNode *b1, CSGContext &context) {
+    CSGNode *a = a1->clone(context);
+    CSGNode *b = b1->clone(context);
+    a->clipto(b, context);
+    context.advance();
+    b->clipto(a, context);
+    context.advance();
+    b->invert();
+    b->clipto(a, context);
+    context.advance();
+    b->invert();
+    csg_merge(a, b, context);
+    context.advance();
+    return a;
+}
+
 // Return a new CSG solid representing space in this solid but not in the
 // solid `csg`. Neither this solid nor the solid `csg` are modified.
-inline CSGNode *csg_subtract(const CSGNode *a1, const CSGNode *b1) {
-    CSGNode *a = a1->clone();
-    CSGNode *b = b1->clone();
+inline CSGNode *csg_subtract(const CSGNode *a1, const CSGNode *b1, CSGContext &context) {
+    CSGNode *a = a1->clone(context);
+    CSGNode *b = b1->clone(context);
     a->invert();
-    a->clipto(b);
-    b->clipto(a);
+    a->clipto(b, context);
+    context.advance();
+    b->clipto(a, context);
+    context.advance();
     b->invert();
-    b->clipto(a);
+    b->clipto(a, context);
+    context.advance();
     b->invert();
-    a->build(b->allpolygons());
+    csg_merge(a, b, context);
+    context.advance();
     a->invert();
-    CSGNode *ret = new CSGNode(a->allpolygons());
-    delete a;
-    delete b;
-    return ret;
+    return a;
 }
 
 // Return a new CSG solid representing space both this solid and in the
 // solid `csg`. Neither this solid nor the solid `csg` are modified.
-inline CSGNode *csg_intersect(const CSGNode *a1, const CSGNode *b1) {
-    CSGNode *a = a1->clone();
-    CSGNode *b = b1->clone();
+inline CSGNode *csg_intersect(const CSGNode *a1, const CSGNode *b1, CSGContext &context) {
+    CSGNode *a = a1->clone(context);
+    CSGNode *b = b1->clone(context);
     a->invert();
-    b->clipto(a);
+    b->clipto(a, context);
+    context.advance();
     b->invert();
-    a->clipto(b);
-    b->clipto(a);
-    a->build(b->allpolygons());
+    a->clipto(b, context);
+    context.advance();
+    b->clipto(a, context);
+    context.advance();
+    csg_merge(a, b, context);
+    context.advance();
     a->invert();
-    CSGNode *ret = new CSGNode(a->allpolygons());
-    delete a;
-    delete b;
-    return ret;
+    return a;
 }
 
-// Convert solid space to empty space and empty space to solid space.
+// Convert solid space to empty space and empty space to solid space. Only
+// the flag changes, the walks flip planes and polygons as they read them.
+// Call it on the root, the walks read no flag below where they start.
 void CSGNode::invert() {
-    CSGJSCPP_DEQUE<CSGNode *> nodes;
-    nodes.push_back(this);
-    while (nodes.size()) {
-        CSGNode *me = nodes.front();
-        nodes.pop_front();
+    inverted = !inverted;
+}
 
-        for (size_t i = 0; i < me->polygons.size(); i++)
-            me->polygons[i].flip();
-        me->plane.flip();
-        CSGJSCPP_SWAP(me->front, me->back);
-        if (me->front)
-            nodes.push_back(me->front);
-        if (me->back)
-            nodes.push_back(me->back);
-    }
+// Move a whole batch to the side of `plane` its bounding box is on, false when
+// the box straddles the plane and the polygons need classifying one by one.
+inline bool routepolygons(const Plane &plane, const BoundingBox &box, const CSGJSCPP_VECTOR<Polygon> &list,
+                          CSGJSCPP_VECTOR<Polygon> &front, CSGJSCPP_VECTOR<Polygon> &back, CSGContext &context) {
+    Plane::Classification side = box.side(plane);
+    if (side == Plane::SPANNING)
+        return false;
+    for (const auto &poly : list)
+        (side == Plane::FRONT ? front : back).push_back(passpolygon(&context, poly));
+    return true;
 }
 
-// Recursively remove all polygons in `polygons` that are inside this BSP
-// tree.
-CSGJSCPP_VECTOR<Polygon> CSGNode::clippolygons(const CSGJSCPP_VECTOR<Polygon> &ilist) const {
-    CSGJSCPP_VECTOR<Polygon> result;
+inline bool routepolygons(const Plane &plane, const BoundingBox &box, CSGJSCPP_VECTOR<Polygon> &&list,
+                          CSGJSCPP_VECTOR<Polygon> &front, CSGJSCPP_VECTOR<Polygon> &back, CSGContext &) {
+    Plane::Classification side = box.side(plane);
+    if (side == Plane::SPANNING)
+        return false;
+    appendpolygons(side == Plane::FRONT ? front : back, list);
+    return true;
+}
 
-    CSGJSCPP_DEQUE<CSGJSCPP_PAIR<const CSGNode *const, CSGJSCPP_VECTOR<Polygon>>> clips;
-    clips.push_back(CSGJSCPP_MAKEPAIR(this, ilist));
-    while (clips.size()) {
-        const CSGNode *                 me = clips.front().first;
-        const CSGJSCPP_VECTOR<Polygon> &list = clips.front().second;
+// Recursively remove all polygons in `polygons` that are inside this BSP
+// tree. The walk is depth first and lists are moved into the child work
+// items, so only the lists along one path down the tree are alive at once.
+//
+// Each list carries its bounding box. A list whose box is on one side of a
+// node's plane goes down that side whole, or is dropped with it, after one
+// test rather than one per vertex. Lists that were split get new boxes.
+template <typename TREE, typename LIST>
+CSGJSCPP_VECTOR<Polygon> clippolygonsdepthfirst(const TREE &tree, typename TREE::Node root, LIST &&ilist,
+                                                CSGContext &context, bool flipped = false) {
+    if (!tree.plane(root).ok())
+        return CSGJSCPP_VECTOR<Polygon>(std::forward<LIST>(ilist));
+
+    typedef typename TREE::Node Node;
+    struct Clip {
+        Node                     node;
+        CSGJSCPP_VECTOR<Polygon> list;
+        BoundingBox              box;
+    };
+    CSGJSCPP_VECTOR<Clip>    clips;
+    CSGJSCPP_VECTOR<Polygon> result = context.takepolygons();
+
+    // `routed` lists kept the box they came with.
+    auto clip = [&tree, &clips, &result, &context](Node me, CSGJSCPP_VECTOR<Polygon> &list_front,
+                                                   CSGJSCPP_VECTOR<Polygon> &list_back, const BoundingBox &box,
+                                                   bool routed) {
+        auto push = [&](Node node, CSGJSCPP_VECTOR<Polygon> &list) {
+            BoundingBox bounds = box;
+            if (!routed) {
+                bounds = BoundingBox();
+                bounds.extend(list);
+            }
+            clips.push_back(Clip{node, CSGJSCPP_MOVE(list), bounds});
+        };
+        Node back = tree.back(me), front = tree.front(me);
+        if (tree.ok(back) && tree.plane(back).ok() && list_back.size())
+            push(back, list_back);
+        else if (tree.ok(back))
+            appendpolygons(result, list_back);
+        context.givepolygons(CSGJSCPP_MOVE(list_back));
+
+        if (tree.ok(front) && tree.plane(front).ok() && list_front.size())
+            push(front, list_front);
+        else
+            appendpolygons(result, list_front);
+        context.givepolygons(CSGJSCPP_MOVE(list_front));
+    };
 
-        if (!me->plane.ok()) {
-            result.insert(result.end(), list.begin(), list.end());
-            clips.pop_front();
-            continue;
-        }
+    {
+        BoundingBox box;
+        box.extend(ilist);
+        CSGJSCPP_VECTOR<Polygon> list_front = context.takepolygons(), list_back = context.takepolygons();
+        bool routed = routepolygons(tree.plane(root), box, std::forward<LIST>(ilist), list_front, list_back, context);
+        if (!routed)
+            clipsplit(tree.plane(root), std::forward<LIST>(ilist), list_front, list_back, context, flipped);
+        clip(root, list_front, list_back, box, routed);
+    }
 
-        CSGJSCPP_VECTOR<Polygon> list_front, list_back;
-        for (size_t i = 0; i < list.size(); i++)
-            me->plane.splitpolygon(list[i], list_front, list_back, list_front, list_back);
+    while (clips.size() && !context.poll()) {
+        Clip me = CSGJSCPP_MOVE(clips.back());
+        clips.pop_back();
+
+        CSGJSCPP_VECTOR<Polygon> list_front = context.takepolygons(), list_back = context.takepolygons();
+        bool routed =
+            routepolygons(tree.plane(me.node), me.box, CSGJSCPP_MOVE(me.list), list_front, list_back, context);
+        if (!routed)
+            clipsplit(tree.plane(me.node), CSGJSCPP_MOVE(me.list), list_front, list_back, context, flipped);
+        context.givepolygons(CSGJSCPP_MOVE(me.list));
+        clip(me.node, list_front, list_back, me.box, routed);
+    }
 
-        if (me->front)
-            clips.push_back(CSGJSCPP_MAKEPAIR(me->front, list_front));
-        else
-            result.insert(result.end(), list_front.begin(), list_front.end());
+    return result;
+}
 
-        if (me->back)
-            clips.push_back(CSGJSCPP_MAKEPAIR(me->back, list_back));
+CSGJSCPP_VECTOR<Polygon> CSGNode::clippolygons(const CSGJSCPP_VECTOR<Polygon> &ilist, CSGContext &context) const {
+    if (convex)
+        return ConvexClipper(this).clippolygons(ilist, context);
+    return clippolygonsdepthfirst(NodeTree{inverted}, this, ilist, context);
+}
 
-        clips.pop_front();
+CSGJSCPP_VECTOR<Polygon> CSGNode::clippolygons(CSGJSCPP_VECTOR<Polygon> &&ilist, CSGContext &context) const {
+    if (convex) {
+        CSGJSCPP_VECTOR<Polygon> ret = ConvexClipper(this).clippolygons(ilist, context);
+        clearpolygons(ilist, context);
+        return ret;
     }
+    return clippolygonsdepthfirst(NodeTree{inverted}, this, CSGJSCPP_MOVE(ilist), context);
+}
 
-    return result;
+CSGJSCPP_VECTOR<Polygon> CSGNode::clippolygons(const CSGJSCPP_VECTOR<Polygon> &ilist) const {
+    CSGContext context;
+    return clippolygons(ilist, context);
 }
 
-// Remove all polygons in this BSP tree that are inside the other BSP tree
-// `bsp`.
-void CSGNode::clipto(const CSGNode *other) {
-    CSGJSCPP_DEQUE<CSGNode *> nodes;
-    nodes.push_back(this);
-    while (nodes.size()) {
-        CSGNode *me = nodes.front();
-        nodes.pop_front();
+CSGJSCPP_VECTOR<Polygon> CSGNode::clippolygons(CSGJSCPP_VECTOR<Polygon> &&ilist) const {
+    CSGContext context;
+    return clippolygons(CSGJSCPP_MOVE(ilist), context);
+}
 
-        me->polygons = other->clippolygons(me->polygons);
+// Remove all polygons in this BSP tree that are inside the other BSP tree
+// `bsp`. The polygons of an inverted tree are clipped as the flipped
+// polygons they stand for.
+void CSGNode::clipto(const CSGNode *other, CSGContext &context) {
+    // flatten a convex tree once rather than for every node of this one.
+    CSGJSCPP_UNIQUEPTR<ConvexClipper> clipper(other->convex ? new ConvexClipper(other) : nullptr);
+    NodeTree                          tree = {other->inverted};
+
+    CSGJSCPP_VECTOR<CSGNode *> nodes(1, this);
+    while (nodes.size() && !context.poll()) {
+        CSGNode *me = nodes.back();
+        nodes.pop_back();
+        assert((me == this || !me->inverted) && "only the root of a tree is inverted");
+
+        CSGJSCPP_VECTOR<Polygon> clipped =
+            clipper ? clipper->clippolygons(me->polygons, context, inverted)
+                    : clippolygonsdepthfirst(tree, other, CSGJSCPP_MOVE(me->polygons), context, inverted);
+        clearpolygons(me->polygons, context);
+        context.givepolygons(CSGJSCPP_MOVE(me->polygons));
+        me->polygons = CSGJSCPP_MOVE(clipped);
         if (me->front)
             nodes.push_back(me->front);
         if (me->back)
@@ -538,6 +1999,11 @@ void CSGNode::clipto(const CSGNode *other) {
     }
 }
 
+void CSGNode::clipto(const CSGNode *other) {
+    CSGContext context;
+    clipto(other, context);
+}
+
 // Return a list of all polygons in this BSP tree.
 CSGJSCPP_VECTOR<Polygon> CSGNode::allpolygons() const {
     CSGJSCPP_VECTOR<Polygon> result;
@@ -547,6 +2013,7 @@ CSGJSCPP_VECTOR<Polygon> CSGNode::allpolygons() const {
     while (nodes.size()) {
         const CSGNode *me = nodes.front();
         nodes.pop_front();
+        assert((me == this || !me->inverted) && "only the root of a tree is inverted");
 
         result.insert(result.end(), me->polygons.begin(), me->polygons.end());
         if (me->front)
@@ -554,28 +2021,37 @@ CSGJSCPP_VECTOR<Polygon> CSGNode::allpolygons() const {
         if (me->back)
             nodes.push_back(me->back);
     }
+    if (inverted) {
+        for (auto &poly : result)
+            poly.flip();
+    }
 
     return result;
 }
 
-CSGNode *CSGNode::clone() const {
-    CSGNode *ret = new CSGNode();
+CSGNode *CSGNode::clone(CSGContext &context) const {
+    CSGNode *ret = context.newnode();
 
-    CSGJSCPP_DEQUE<CSGJSCPP_PAIR<const CSGNode *, CSGNode *>> nodes;
+    CSGJSCPP_VECTOR<CSGJSCPP_PAIR<const CSGNode *, CSGNode *>> nodes;
     nodes.push_back(CSGJSCPP_MAKEPAIR(this, ret));
     while (nodes.size()) {
-        const CSGNode *original = nodes.front().first;
-        CSGNode *      clone = nodes.front().second;
-        nodes.pop_front();
+        const CSGNode *original = nodes.back().first;
+        CSGNode *      clone = nodes.back().second;
+        nodes.pop_back();
 
-        clone->polygons = original->polygons;
+        for (const auto &poly : original->polygons)
+            clone->polygons.push_back(copypolygon(poly, context));
         clone->plane = original->plane;
+        clone->convex = original->convex;
+        clone->boundsmin = original->boundsmin;
+        clone->boundsmax = original->boundsmax;
+        clone->inverted = original == this && inverted;
         if (original->front) {
-            clone->front = new CSGNode();
+            clone->front = context.newnode();
             nodes.push_back(CSGJSCPP_MAKEPAIR(original->front, clone->front));
         }
         if (original->back) {
-            clone->back = new CSGNode();
+            clone->back = context.newnode();
             nodes.push_back(CSGJSCPP_MAKEPAIR(original->back, clone->back));
         }
     }
@@ -583,260 +2059,2518 @@ CSGNode *CSGNode::clone() const {
     return ret;
 }
 
-// Build a BSP tree out of `polygons`. When called on an existing tree, the
-// new polygons are filtered down to the bottom of the tree and become new
-// nodes there. Each set of polygons is partitioned using the first polygon
-// (no heuristic is used to pick a good split).
-void CSGNode::build(const CSGJSCPP_VECTOR<Polygon> &ilist) {
-    if (!ilist.size())
-        return;
+CSGNode *CSGNode::clone() const {
+    CSGContext context;
+    return clone(context);
+}
+
+// Move a polygon by `tr`. When the transform mirrors (negative determinant) the
+// vertex order is reversed so the winding still agrees with the plane.
+inline void transformpolygon(Polygon &poly, const Transform &tr, const Transform &normalmat, bool mirror) {
+    for (auto &v : poly.vertices) {
+        v.pos = transformpoint(tr, v.pos);
+        v.normal = transformnormal(normalmat, v.normal);
+    }
+    if (mirror)
+        CSGJSCPP_REVERSE(poly.vertices.begin(), poly.vertices.end());
+    poly.plane = transformplane(tr, normalmat, poly.plane);
+}
+
+// Affine transforms map a BSP tree to an equally valid BSP tree, a point in
+// front of a plane stays in front of the transformed plane, so the tree is
+// updated in place and its topology is left alone.
+void CSGNode::transform(const Transform &tr) {
+    Transform normalmat = normalmatrix(tr);
+    bool      mirror = determinant(tr) < 0;
 
-    CSGJSCPP_DEQUE<CSGJSCPP_PAIR<CSGNode *, CSGJSCPP_VECTOR<Polygon>>> builds;
-    builds.push_back(CSGJSCPP_MAKEPAIR(this, ilist));
+    CSGJSCPP_DEQUE<CSGNode *> nodes;
+    nodes.push_back(this);
+    while (nodes.size()) {
+        CSGNode *me = nodes.front();
+        nodes.pop_front();
 
-    while (builds.size()) {
-        CSGNode *                       me = builds.front().first;
-        const CSGJSCPP_VECTOR<Polygon> &list = builds.front().second;
+        for (auto &poly : me->polygons)
+            transformpolygon(poly, tr, normalmat, mirror);
+        if (me->plane.ok())
+            me->plane = transformplane(tr, normalmat, me->plane);
+        if (me->front)
+            nodes.push_back(me->front);
+        if (me->back)
+            nodes.push_back(me->back);
+    }
+    updatebounds(this);
+}
 
-        assert(list.size() > 0 && "logic error");
+CSGNode *CSGInstance::realize() const {
+    CSGNode *ret = tree->clone();
+    ret->transform(transform);
+    return ret;
+}
 
-        if (!me->plane.ok())
-            me->plane = list[0].plane;
-        CSGJSCPP_VECTOR<Polygon> list_front, list_back;
+CSGJSCPP_VECTOR<Polygon> CSGInstance::allpolygons() const {
+    return csgtransform(tree->allpolygons(), transform);
+}
 
-        // me->polygons.push_back(list[0]);
-        for (size_t i = 0; i < list.size(); i++)
-            me->plane.splitpolygon(list[i], me->polygons, me->polygons, list_front, list_back);
+// Classify `point` starting at `node`. Falling off a null front child is
+// outside and off a null back child is inside. A point on a node plane is
+// followed down both sides, if they disagree it is on the surface.
+inline CSGNode::Containment classifyfrom(const CSGNode *node, const Vector &point) {
+    if (!node->plane.ok())
+        return CSGNode::OUTSIDE;
 
-        if (list_front.size()) {
-            if (!me->front)
-                me->front = new CSGNode;
-            builds.push_back(CSGJSCPP_MAKEPAIR(me->front, list_front));
+    bool                             inside = false, outside = false;
+    CSGJSCPP_VECTOR<const CSGNode *> nodes(1, node);
+    while (nodes.size()) {
+        const CSGNode *me = nodes.back();
+        nodes.pop_back();
+
+        Plane::Classification c = me->plane.classify(point);
+        if (c != Plane::BACK) {
+            if (me->front)
+                nodes.push_back(me->front);
+            else
+                outside = true;
         }
-        if (list_back.size()) {
-            if (!me->back)
-                me->back = new CSGNode;
-            builds.push_back(CSGJSCPP_MAKEPAIR(me->back, list_back));
+        if (c != Plane::FRONT) {
+            if (me->back)
+                nodes.push_back(me->back);
+            else
+                inside = true;
+        }
+        if (inside && outside)
+            return CSGNode::BOUNDARY;
+    }
+    return inside ? CSGNode::INSIDE : CSGNode::OUTSIDE;
+}
+
+// An inverted tree reaches the same leaf with the planes flipped and the
+// children swapped, the leaf just means the opposite.
+inline CSGNode::Containment invertcontainment(CSGNode::Containment c) {
+    return c == CSGNode::BOUNDARY ? c : (c == CSGNode::INSIDE ? CSGNode::OUTSIDE : CSGNode::INSIDE);
+}
+
+CSGNode::Containment CSGNode::classify(const Vector &point) const {
+    Containment c = classifyfrom(this, point);
+    return inverted && plane.ok() ? invertcontainment(c) : c;
+}
+
+// Points are walked down the tree together. Each node gets a contiguous range
+// of the points which is partitioned in place into front, back and on-plane
+// runs, so the distance loop runs over flat arrays. The few points on a plane
+// are finished one at a time.
+CSGJSCPP_VECTOR<CSGNode::Containment> CSGNode::classify(const CSGJSCPP_VECTOR<Vector> &points) const {
+    CSGJSCPP_VECTOR<Containment> result(points.size(), OUTSIDE);
+    if (!plane.ok())
+        return result;
+
+    CSGJSCPP_VECTOR<CSGJSCPP_REAL> x(points.size()), y(points.size()), z(points.size()), d(points.size());
+    CSGJSCPP_VECTOR<size_t>        ids(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        x[i] = points[i].x;
+        y[i] = points[i].y;
+        z[i] = points[i].z;
+        ids[i] = i;
+    }
+
+    struct Range {
+        const CSGNode *node;
+        size_t         begin, end;
+    };
+    CSGJSCPP_VECTOR<Range> ranges(1, Range{this, 0, points.size()});
+    while (ranges.size()) {
+        Range r = ranges.back();
+        ranges.pop_back();
+
+        const Vector &      n = r.node->plane.normal;
+        const CSGJSCPP_REAL w = r.node->plane.w;
+        for (size_t i = r.begin; i < r.end; i++)
+            d[i] = n.x * x[i] + n.y * y[i] + n.z * z[i] - w;
+
+        auto swappoints = [&](size_t a, size_t b) {
+            CSGJSCPP_SWAP(x[a], x[b]);
+            CSGJSCPP_SWAP(y[a], y[b]);
+            CSGJSCPP_SWAP(z[a], z[b]);
+            CSGJSCPP_SWAP(d[a], d[b]);
+            CSGJSCPP_SWAP(ids[a], ids[b]);
+        };
+        // [begin, mid) front, [mid, on) back, [on, end) on the plane.
+        size_t mid = r.begin, i = r.begin, on = r.end;
+        while (i < on) {
+            if (d[i] > csgjs_EPSILON)
+                swappoints(i++, mid++);
+            else if (d[i] < -csgjs_EPSILON)
+                i++;
+            else
+                swappoints(i, --on);
         }
 
-        builds.pop_front();
+        for (size_t i = on; i < r.end; i++)
+            result[ids[i]] = classifyfrom(r.node, points[ids[i]]);
+
+        if (r.node->front)
+            ranges.push_back(Range{r.node->front, r.begin, mid});
+        if (r.node->back)
+            ranges.push_back(Range{r.node->back, mid, on});
+        else {
+            for (size_t i = mid; i < on; i++)
+                result[ids[i]] = INSIDE;
+        }
     }
+    if (inverted) {
+        for (auto &c : result)
+            c = invertcontainment(c);
+    }
+    return result;
 }
 
-CSGNode::CSGNode() : front(nullptr), back(nullptr) {
+// Walk the tree front to back along the ray. A node's polygons can only be
+// hit where the ray crosses its plane, after everything on the near side and
+// before everything on the far side, so the first hit found is the nearest.
+bool CSGNode::raycast(const Vector &origin, const Vector &dir, RayHit &hit, CSGJSCPP_REAL tmax) const {
+    struct Segment {
+        const CSGNode *node;
+        CSGJSCPP_REAL  tmin, tmax;
+        bool           polygons; // test the node's polygons at tmin rather than descend.
+    };
+    CSGJSCPP_VECTOR<Segment> segments(1, Segment{this, 0, tmax, false});
+    while (segments.size()) {
+        Segment seg = segments.back();
+        segments.pop_back();
+        const CSGNode *me = seg.node;
+
+        if (seg.polygons) {
+            for (const auto &poly : me->polygons) {
+                CSGJSCPP_REAL t;
+                if (raypolygon(poly, origin, dir, t) && t >= 0 && t <= tmax) {
+                    hit.t = t;
+                    hit.point = origin + dir * t;
+                    hit.polygon = &poly;
+                    hit.flipped = inverted;
+                    return true;
+                }
+            }
+            continue;
+        }
+        if (!me->plane.ok() || !raybox(nodebounds(me), origin, dir, seg.tmin, seg.tmax))
+            continue;
+
+        CSGJSCPP_REAL dist = dot(me->plane.normal, origin) - me->plane.w;
+        CSGJSCPP_REAL denom = dot(me->plane.normal, dir);
+        CSGJSCPP_REAL start = dist + denom * seg.tmin;
+        bool          nearfront = start > csgjs_EPSILON || (start >= -csgjs_EPSILON && denom > 0);
+        if (denom == 0 && fabs(dist) <= csgjs_EPSILON) {
+            // running along the plane, both sides may hold the hit.
+            if (me->back)
+                segments.push_back(Segment{me->back, seg.tmin, seg.tmax, false});
+            if (me->front)
+                segments.push_back(Segment{me->front, seg.tmin, seg.tmax, false});
+            continue;
+        }
+
+        const CSGNode *nearnode = nearfront ? me->front : me->back;
+        const CSGNode *farnode = nearfront ? me->back : me->front;
+        CSGJSCPP_REAL  t = denom != 0 ? -dist / denom : HUGE_VALF;
+        if (t < seg.tmin || t > seg.tmax) {
+            if (nearnode)
+                segments.push_back(Segment{nearnode, seg.tmin, seg.tmax, false});
+            continue;
+        }
+        if (farnode)
+            segments.push_back(Segment{farnode, t, seg.tmax, false});
+        segments.push_back(Segment{me, t, t, true});
+        if (nearnode)
+            segments.push_back(Segment{nearnode, seg.tmin, t, false});
+    }
+    return false;
 }
 
-CSGNode::CSGNode(const CSGJSCPP_VECTOR<Polygon> &list) : front(nullptr), back(nullptr) {
-    build(list);
+CSGNode::Containment CSGInstance::classify(const Vector &point) const {
+    return tree->classify(transformpoint(inverse(transform), point));
 }
 
-CSGNode::~CSGNode() {
+bool CSGInstance::raycast(const Vector &origin, const Vector &dir, RayHit &hit, CSGJSCPP_REAL tmax) const {
+    // affine maps keep the ray parameter, only the hit point moves back.
+    Transform inv = inverse(transform);
+    if (!tree->raycast(transformpoint(inv, origin), transformdirection(inv, dir), hit, tmax))
+        return false;
+    hit.point = origin + dir * hit.t;
+    return true;
+}
 
-    CSGJSCPP_DEQUE<CSGNode *> nodes_to_delete;
-    CSGJSCPP_DEQUE<CSGNode *> nodes_to_disassemble;
+// Build a BSP tree out of `polygons`. When called on an existing tree, the
+// new polygons are filtered down to the bottom of the tree and become new
+// nodes there. Each set of polygons is partitioned using the first polygon
+// (no heuristic is used to pick a good split).
+template <typename LIST> void buildtree(CSGNode *root, LIST &&ilist, CSGContext &context) {
+    if (!ilist.size() || context.poll())
+        return;
 
-    nodes_to_disassemble.push_back(this);
-    while (nodes_to_disassemble.size()) {
-        CSGNode *me = nodes_to_disassemble.front();
-        nodes_to_disassemble.pop_front();
+    // new nodes hang off the end of the chain so it is no longer one.
+    root->convex = false;
 
-        if (me->front) {
-            nodes_to_disassemble.push_back(me->front);
-            nodes_to_delete.push_back(me->front);
-            me->front = NULL;
+    // depth first, see clippolygons.
+    struct Build {
+        CSGNode *                node;
+        CSGJSCPP_VECTOR<Polygon> list;
+        size_t                   depth;
+    };
+    CSGJSCPP_VECTOR<Build> builds;
+    const size_t           maxdepth = context.options ? context.options->maxdepth : 0;
+
+    auto build = [&builds, &context, maxdepth](CSGNode *me, size_t depth, CSGJSCPP_VECTOR<Polygon> &list_front,
+                                               CSGJSCPP_VECTOR<Polygon> &list_back) {
+        // `depth` counts the nodes from the root down to `me`.
+        if ((list_back.size() || list_front.size()) && maxdepth && depth + 1 > maxdepth && context.status == CSG_OK)
+            context.status = CSG_DEPTH_LIMIT;
+        if (list_back.size()) {
+            if (!me->back)
+                me->back = context.newnode();
+            builds.push_back(Build{me->back, CSGJSCPP_MOVE(list_back), depth + 1});
+        } else {
+            context.givepolygons(CSGJSCPP_MOVE(list_back));
         }
-        if (me->back) {
-            nodes_to_disassemble.push_back(me->back);
-            nodes_to_delete.push_back(me->back);
-            me->back = NULL;
+        if (list_front.size()) {
+            if (!me->front)
+                me->front = context.newnode();
+            builds.push_back(Build{me->front, CSGJSCPP_MOVE(list_front), depth + 1});
+        } else {
+            context.givepolygons(CSGJSCPP_MOVE(list_front));
+        }
+    };
+
+    {
+        if (!root->plane.ok())
+            root->plane = ilist[0].plane;
+        CSGJSCPP_VECTOR<Polygon> list_front = context.takepolygons(), list_back = context.takepolygons();
+        splitpolygons(root->plane, std::forward<LIST>(ilist), root->polygons, root->polygons, list_front,
+                      list_back, &context);
+        build(root, 1, list_front, list_back);
+    }
+
+    while (builds.size() && !context.poll()) {
+        Build me = CSGJSCPP_MOVE(builds.back());
+        builds.pop_back();
+
+        assert(me.list.size() > 0 && "logic error");
+
+        if (!me.node->plane.ok())
+            me.node->plane = me.list[0].plane;
+        CSGJSCPP_VECTOR<Polygon> list_front = context.takepolygons(), list_back = context.takepolygons();
+        splitpolygons(me.node->plane, CSGJSCPP_MOVE(me.list), me.node->polygons, me.node->polygons, list_front,
+                      list_back, &context);
+        context.givepolygons(CSGJSCPP_MOVE(me.list));
+        build(me.node, me.depth, list_front, list_back);
+    }
+    updatebounds(root);
+}
+
+// An empty tree starts over the right way round, an inverted one stores the
+// polygons flipped.
+void CSGNode::build(const CSGJSCPP_VECTOR<Polygon> &ilist, CSGContext &context) {
+    if (!plane.ok())
+        inverted = false;
+    if (!inverted) {
+        buildtree(this, ilist, context);
+        return;
+    }
+    CSGJSCPP_VECTOR<Polygon> list = context.takepolygons();
+    for (const auto &poly : ilist) {
+        list.push_back(copypolygon(poly, context));
+        list.back().flip();
+    }
+    buildtree(this, CSGJSCPP_MOVE(list), context);
+    context.givepolygons(CSGJSCPP_MOVE(list));
+}
+
+void CSGNode::build(const CSGJSCPP_VECTOR<Polygon> &ilist) {
+    CSGContext context;
+    build(ilist, context);
+}
+
+// Build the tree of a convex solid directly. Every polygon is behind the plane
+// of every other polygon so the general build never splits anything and ends
+// up with a chain of face planes linked through `back`, this makes that chain
+// in a single pass. Coplanar polygons share a node. Only valid when
+// `csgisconvex(list)` holds, an existing tree falls back to `build()`.
+void CSGNode::buildconvex(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context) {
+    if (!list.size())
+        return;
+    if (plane.ok()) {
+        build(list, context);
+        return;
+    }
+    inverted = false;
+
+    // coplanar faces are rarely next to each other (cylinder caps interleave with
+    // the sides) so nodes are looked up by a quantized plane.
+    auto key = [](const Plane &p) -> uint64_t {
+        const CSGJSCPP_REAL scale = 1.0f / csgjs_EPSILON;
+        const CSGJSCPP_REAL c[] = {p.normal.x, p.normal.y, p.normal.z, p.w};
+        uint64_t            h = 14695981039346656037ull;
+        for (CSGJSCPP_REAL v : c) {
+            h ^= (uint64_t)(int64_t)floor(v * scale);
+            h *= 1099511628211ull;
+        }
+        return h;
+    };
+    CSGJSCPP_HASHMAP<uint64_t, CSGNode *> nodes;
+
+    CSGNode *last = nullptr;
+    for (const auto &poly : list) {
+        if (context.poll())
+            break;
+        CSGNode *&me = nodes[key(poly.plane)];
+        if (!me || !(me->plane.normal == poly.plane.normal && approxequal(me->plane.w, poly.plane.w))) {
+            me = last ? context.newnode() : this;
+            me->plane = poly.plane;
+            if (last)
+                last->back = me;
+            last = me;
+        }
+        me->polygons.push_back(copypolygon(poly, context));
+    }
+    convex = true;
+    updatebounds(this);
+}
+
+void CSGNode::buildconvex(const CSGJSCPP_VECTOR<Polygon> &list) {
+    CSGContext context;
+    buildconvex(list, context);
+}
+
+// A closed surface that is all one piece and bends outwards along every edge
+// bounds a convex solid, so each edge is only tested against the polygon on its
+// other side instead of every plane against every vertex. Edges are matched by
+// exact position, surfaces with cracks or T-junctions are reported as not convex
+// and take the general build.
+bool csgisconvex(const CSGJSCPP_VECTOR<Polygon> &polygons) {
+    if (!polygons.size())
+        return false;
+
+    struct Edge {
+        Vector a, b;
+        size_t poly;
+    };
+    auto less = [](const Vector &p, const Vector &q) {
+        return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+    };
+    auto before = [&](const Edge &e, const Edge &f) {
+        return less(e.a, f.a) || (!less(f.a, e.a) && less(e.b, f.b));
+    };
+
+    CSGJSCPP_VECTOR<Edge> edges;
+    for (size_t i = 0; i < polygons.size(); i++) {
+        const Polygon &poly = polygons[i];
+        if (!poly.plane.ok())
+            return false;
+        for (size_t j = 0; j < poly.vertices.size(); j++)
+            edges.push_back({poly.vertices[j].pos, poly.vertices[(j + 1) % poly.vertices.size()].pos, i});
+    }
+    std::sort(edges.begin(), edges.end(), before);
+
+    // polygons joined by an edge share a piece.
+    CSGJSCPP_VECTOR<size_t> piece(polygons.size());
+    for (size_t i = 0; i < piece.size(); i++)
+        piece[i] = i;
+    auto find = [&](size_t i) {
+        while (piece[i] != i)
+            i = piece[i] = piece[piece[i]];
+        return i;
+    };
+    size_t pieces = polygons.size();
+
+    for (const auto &e : edges) {
+        Edge twin = {e.b, e.a, 0};
+        auto other = std::lower_bound(edges.begin(), edges.end(), twin, before);
+        if (other == edges.end() || before(twin, *other))
+            return false;
+        for (const auto &v : polygons[other->poly].vertices) {
+            if (polygons[e.poly].plane.classify(v.pos) == Plane::FRONT)
+                return false;
+        }
+        size_t p = find(e.poly), q = find(other->poly);
+        if (p != q) {
+            piece[p] = q;
+            pieces--;
+        }
+    }
+    return pieces == 1;
+}
+
+CSGNode::CSGNode()
+    : front(nullptr), back(nullptr), convex(false), boundsmin(HUGE_VALF, HUGE_VALF, HUGE_VALF),
+      boundsmax(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF), inverted(false) {
+}
+
+CSGNode::CSGNode(const CSGJSCPP_VECTOR<Polygon> &list)
+    : front(nullptr), back(nullptr), convex(false), boundsmin(HUGE_VALF, HUGE_VALF, HUGE_VALF),
+      boundsmax(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF), inverted(false) {
+    build(list);
+}
+
+CSGNode::~CSGNode() {
+
+    CSGJSCPP_DEQUE<CSGNode *> nodes_to_delete;
+    CSGJSCPP_DEQUE<CSGNode *> nodes_to_disassemble;
+
+    nodes_to_disassemble.push_back(this);
+    while (nodes_to_disassemble.size()) {
+        CSGNode *me = nodes_to_disassemble.front();
+        nodes_to_disassemble.pop_front();
+
+        if (me->front) {
+            nodes_to_disassemble.push_back(me->front);
+            nodes_to_delete.push_back(me->front);
+            me->front = NULL;
+        }
+        if (me->back) {
+            nodes_to_disassemble.push_back(me->back);
+            nodes_to_delete.push_back(me->back);
+            me->back = NULL;
+        }
+    }
+
+    for (auto it = nodes_to_delete.begin(); it != nodes_to_delete.end(); ++it)
+        delete *it;
+}
+
+// Context implementation
+
+CSGContext::~CSGContext() {
+    for (auto node : nodes)
+        delete node;
+}
+
+CSGNode *CSGContext::newnode() {
+    madenodes++;
+    livenodes++;
+    CSGNode *ret;
+    if (nodes.size()) {
+        ret = nodes.back();
+        nodes.pop_back();
+        pooled -= sizeof(CSGNode);
+    } else {
+        ret = new CSGNode;
+    }
+    return ret;
+}
+
+void CSGContext::release(CSGNode *tree) {
+    if (!tree)
+        return;
+
+    // the pool itself is the work list, nodes are reset as they are reached.
+    size_t first = nodes.size();
+    nodes.push_back(tree);
+    for (size_t i = first; i < nodes.size(); i++) {
+        CSGNode *me = nodes[i];
+        if (me->front)
+            nodes.push_back(me->front);
+        if (me->back)
+            nodes.push_back(me->back);
+        livenodes -= livenodes ? 1 : 0;
+        // a node's list is sized for that node, pooling it would let every
+        // pooled list grow to the largest one seen so it is freed.
+        clearpolygons(me->polygons, *this);
+        CSGJSCPP_VECTOR<Polygon>().swap(me->polygons);
+        me->front = nullptr;
+        me->back = nullptr;
+        me->plane = Plane();
+        me->convex = false;
+        me->boundsmin = Vector(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+        me->boundsmax = Vector(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+        me->inverted = false;
+        pooled += sizeof(CSGNode);
+    }
+}
+
+CSGJSCPP_VECTOR<Polygon> CSGContext::takepolygons() {
+    if (!polygonlists.size())
+        return CSGJSCPP_VECTOR<Polygon>();
+    CSGJSCPP_VECTOR<Polygon> ret = CSGJSCPP_MOVE(polygonlists.back());
+    polygonlists.pop_back();
+    pooled -= ret.capacity() * sizeof(Polygon);
+    return ret;
+}
+
+void CSGContext::givepolygons(CSGJSCPP_VECTOR<Polygon> &&list) {
+    if (!list.capacity())
+        return;
+    clearpolygons(list, *this);
+    pooled += list.capacity() * sizeof(Polygon);
+    polygonlists.push_back(CSGJSCPP_MOVE(list));
+}
+
+CSGJSCPP_VECTOR<PolygonVertex> CSGContext::takevertices() {
+    if (!vertexlists.size())
+        return CSGJSCPP_VECTOR<PolygonVertex>();
+    CSGJSCPP_VECTOR<PolygonVertex> ret = CSGJSCPP_MOVE(vertexlists.back());
+    vertexlists.pop_back();
+    pooled -= ret.capacity() * sizeof(PolygonVertex);
+    return ret;
+}
+
+void CSGContext::givevertices(CSGJSCPP_VECTOR<PolygonVertex> &&list) {
+    livevertices -= list.size() < livevertices ? list.size() : livevertices;
+    if (!list.capacity())
+        return;
+    list.clear();
+    pooled += list.capacity() * sizeof(PolygonVertex);
+    vertexlists.push_back(CSGJSCPP_MOVE(list));
+}
+
+size_t CSGContext::pooledbytes() const {
+    return pooled + (nodes.capacity() * sizeof(CSGNode *)) +
+           (polygonlists.capacity() * sizeof(CSGJSCPP_VECTOR<Polygon>)) +
+           (vertexlists.capacity() * sizeof(CSGJSCPP_VECTOR<PolygonVertex>));
+}
+
+void CSGContext::trim(size_t bytes) {
+    // vertex lists are the most numerous, then polygon lists, nodes last.
+    while (pooledbytes() > bytes && vertexlists.size())
+        takevertices();
+    while (pooledbytes() > bytes && polygonlists.size())
+        takepolygons();
+    while (pooledbytes() > bytes && nodes.size()) {
+        delete nodes.back();
+        nodes.pop_back();
+        pooled -= sizeof(CSGNode);
+    }
+    if (!vertexlists.size())
+        CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<PolygonVertex>>().swap(vertexlists);
+    if (!polygonlists.size())
+        CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>>().swap(polygonlists);
+    if (!nodes.size())
+        CSGJSCPP_VECTOR<CSGNode *>().swap(nodes);
+}
+
+void CSGContext::finish() {
+    splits.clear();
+    if (options && options->snapstats)
+        *options->snapstats = snapstats;
+    size_t bytes = pooledbytes();
+    highwater = bytes > highwater ? bytes : highwater;
+    if (limit && bytes > limit)
+        trim(limit);
+}
+
+void CSGContext::begin(unsigned count) {
+    status = CSG_OK;
+    // polls find the status set and the operation stops before it starts.
+    if (options && options->snapgrid > 2 * csgjs_EPSILON)
+        status = CSG_INVALID_OPTIONS;
+    snapstats = CSGSnapStats();
+    polls = 0;
+    stage = 0;
+    stages = count;
+    madepolygons = 0;
+    madevertices = 0;
+    madenodes = 0;
+    livepolygons = 0;
+    livevertices = 0;
+    livenodes = 0;
+}
+
+void CSGContext::advance() {
+    if (stage < stages)
+        stage++;
+    if (status == CSG_OK && options && options->progress)
+        options->progress((float)stage / (float)(stages ? stages : 1));
+}
+
+bool CSGContext::check() {
+    if (options->cancel && options->cancel->load(std::memory_order_relaxed))
+        status = CSG_CANCELLED;
+    else if (options->deadline != std::chrono::steady_clock::time_point::max() &&
+             std::chrono::steady_clock::now() >= options->deadline)
+        status = CSG_DEADLINE;
+    else if (options->maxpolygons && livepolygons > options->maxpolygons)
+        status = CSG_POLYGON_LIMIT;
+    else if (options->maxnodes && livenodes > options->maxnodes)
+        status = CSG_NODE_LIMIT;
+    else if (options->maxbytes && livebytes() > options->maxbytes)
+        status = CSG_MEMORY_LIMIT;
+    return status != CSG_OK;
+}
+
+// A hash of the bits of a position, +0 and -0 hash the same.
+inline uint64_t positionbits(const Vector &p) {
+    const CSGJSCPP_REAL c[] = {p.x, p.y, p.z};
+    uint64_t            h = 14695981039346656037ull;
+    for (CSGJSCPP_REAL v : c) {
+        if (v == 0)
+            v = 0;
+        const unsigned char *b = (const unsigned char *)&v;
+        for (size_t i = 0; i < sizeof(v); i++)
+            h = (h ^ b[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// The same for both directions of an edge.
+inline uint64_t edgebits(const Vector &a, const Vector &b) {
+    uint64_t ha = positionbits(a), hb = positionbits(b);
+    return ha < hb ? ha ^ (hb * 1099511628211ull) : hb ^ (ha * 1099511628211ull);
+}
+
+void CSGContext::recordsplit(const Vector &a, const Vector &b, const Vector &point) {
+    CSGJSCPP_VECTOR<CSGEdgeSplit> &list = splits[edgebits(a, b)];
+    for (const auto &split : list) {
+        if (split.point == point && ((split.a == a && split.b == b) || (split.a == b && split.b == a)))
+            return;
+    }
+    list.push_back(CSGEdgeSplit{a, b, point});
+}
+
+size_t CSGContext::livebytes() const {
+    return livenodes * sizeof(CSGNode) + livepolygons * sizeof(Polygon) + livevertices * sizeof(PolygonVertex);
+}
+
+const char *csgstatusstring(CSGStatus status) {
+    switch (status) {
+    case CSG_OK:
+        return "ok";
+    case CSG_CANCELLED:
+        return "cancelled";
+    case CSG_DEADLINE:
+        return "deadline exceeded";
+    case CSG_POLYGON_LIMIT:
+        return "polygon limit exceeded";
+    case CSG_NODE_LIMIT:
+        return "node limit exceeded";
+    case CSG_DEPTH_LIMIT:
+        return "tree depth limit exceeded";
+    case CSG_MEMORY_LIMIT:
+        return "memory limit exceeded";
+    case CSG_INVALID_OPTIONS:
+        return "invalid options";
+    }
+    return "unknown status";
+}
+
+// Public interface implementation
+
+// Whether the corner at `b` of the loop ..., a, b, c, ... turns the same way
+// as `normal` (or goes straight on).
+inline bool convexcorner(const Vector &a, const Vector &b, const Vector &c, const Vector &normal) {
+    return dot(cross(b - a, c - b), normal) > -csgjs_EPSILON;
+}
+
+// Grow a polygon from the triangle `seed` by taking in neighbouring triangles
+// across its edges. A neighbour is taken when it lies in the same plane, its
+// vertices have the same normal and colour, and the polygon stays convex with
+// its third vertex inserted between the two shared ones.
+inline Polygon mergecoplanartriangles(const Model &model, size_t seed,
+                                      const CSGJSCPP_HASHMAP<uint64_t, size_t> &edges, CSGJSCPP_VECTOR<bool> &used) {
+    auto key = [](Model::Index a, Model::Index b) { return ((uint64_t)a << 32) | (uint64_t)b; };
+    auto pos = [&model](Model::Index i) -> const Vector & { return model.vertices[i].pos; };
+    const Model::Index *tri = &model.indices[seed * 3];
+
+    Polygon ret;
+    ret.plane = Plane(pos(tri[0]), pos(tri[1]), pos(tri[2]));
+    CSGJSCPP_VECTOR<Model::Index> loop(tri, tri + 3);
+    used[seed] = true;
+
+    const Vertex &first = model.vertices[tri[0]];
+    auto          matches = [&](Model::Index i) {
+        const Vertex &v = model.vertices[i];
+        return v.normal == first.normal && v.col == first.col;
+    };
+    if (ret.plane.ok() && matches(tri[1]) && matches(tri[2])) {
+        bool grown = true;
+        while (grown) {
+            grown = false;
+            for (size_t i = 0; i < loop.size(); i++) {
+                Model::Index p = loop[i], q = loop[(i + 1) % loop.size()];
+                auto         edge = edges.find(key(q, p));
+                if (edge == edges.end() || used[edge->second])
+                    continue;
+
+                const Model::Index *other = &model.indices[edge->second * 3];
+                Model::Index        r = other[2];
+                if (other[0] != p && other[0] != q)
+                    r = other[0];
+                else if (other[1] != p && other[1] != q)
+                    r = other[1];
+                Plane plane(pos(other[0]), pos(other[1]), pos(other[2]));
+                if (!plane.ok() || !(plane.normal == ret.plane.normal) || !approxequal(plane.w, ret.plane.w) ||
+                    !matches(r) || std::find(loop.begin(), loop.end(), r) != loop.end())
+                    continue;
+
+                Model::Index prev = loop[(i + loop.size() - 1) % loop.size()];
+                Model::Index next = loop[(i + 2) % loop.size()];
+                if (!convexcorner(pos(prev), pos(p), pos(r), ret.plane.normal) ||
+                    !convexcorner(pos(p), pos(r), pos(q), ret.plane.normal) ||
+                    !convexcorner(pos(r), pos(q), pos(next), ret.plane.normal))
+                    continue;
+
+                loop.insert(loop.begin() + i + 1, r);
+                used[edge->second] = true;
+                grown = true;
+            }
+        }
+    }
+
+    for (Model::Index i : loop)
+        ret.vertices.push_back(packvertex(model.vertices[i]));
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+    ret.col = first.col;
+#endif
+    return ret;
+}
+
+CSGJSCPP_VECTOR<Polygon> modeltopolygons(const Model &model, bool mergecoplanar) {
+    CSGJSCPP_VECTOR<Polygon> list;
+    if (!mergecoplanar) {
+        for (size_t i = 0; i < model.indices.size(); i += 3) {
+            CSGJSCPP_VECTOR<Vertex> triangle;
+            for (int j = 0; j < 3; j++) {
+                Vertex v = model.vertices[model.indices[i + j]];
+                triangle.push_back(v);
+            }
+            list.push_back(Polygon(triangle));
+        }
+        return list;
+    }
+
+    // triangles by their directed edges, a neighbour has the edge reversed.
+    size_t                             triangles = model.indices.size() / 3;
+    CSGJSCPP_HASHMAP<uint64_t, size_t> edges;
+    for (size_t t = 0; t < triangles; t++) {
+        const Model::Index *tri = &model.indices[t * 3];
+        for (int j = 0; j < 3; j++)
+            edges[((uint64_t)tri[j] << 32) | (uint64_t)tri[(j + 1) % 3]] = t;
+    }
+
+    CSGJSCPP_VECTOR<bool> used(triangles, false);
+    for (size_t t = 0; t < triangles; t++) {
+        if (!used[t])
+            list.push_back(mergecoplanartriangles(model, t, edges, used));
+    }
+    return list;
+}
+
+// Welds vertices into a model like `Model::AddVertex()` does, without the
+// linear search. Positions are hashed into a grid of cells two epsilons wide
+// so every vertex that compares equal to a new one is in one of the (at most
+// eight) cells its epsilon box touches. The lowest matching index wins, as
+// it does with the search.
+struct VertexWelder {
+    Model &                                                     model;
+    CSGJSCPP_HASHMAP<uint64_t, CSGJSCPP_VECTOR<Model::Index>> cells;
+
+    VertexWelder(Model &model) : model(model) {
+        for (size_t i = 0; i < model.vertices.size(); i++)
+            cells[cellkey(cellof(model.vertices[i].pos.x), cellof(model.vertices[i].pos.y),
+                          cellof(model.vertices[i].pos.z))]
+                .push_back((Model::Index)i);
+    }
+
+    static inline int64_t cellof(CSGJSCPP_REAL v) {
+        return (int64_t)floor(v / (2 * csgjs_EPSILON));
+    }
+    static inline uint64_t cellkey(int64_t x, int64_t y, int64_t z) {
+        uint64_t h = 14695981039346656037ull;
+        h = (h ^ (uint64_t)x) * 1099511628211ull;
+        h = (h ^ (uint64_t)y) * 1099511628211ull;
+        h = (h ^ (uint64_t)z) * 1099511628211ull;
+        return h;
+    }
+
+    Model::Index add(const Vertex &v) {
+        const Vector &p = v.pos;
+        int64_t       x0 = cellof(p.x - csgjs_EPSILON), x1 = cellof(p.x + csgjs_EPSILON);
+        int64_t       y0 = cellof(p.y - csgjs_EPSILON), y1 = cellof(p.y + csgjs_EPSILON);
+        int64_t       z0 = cellof(p.z - csgjs_EPSILON), z1 = cellof(p.z + csgjs_EPSILON);
+
+        Model::Index found = (Model::Index)model.vertices.size();
+        for (int64_t x = x0; x <= x1; x++) {
+            for (int64_t y = y0; y <= y1; y++) {
+                for (int64_t z = z0; z <= z1; z++) {
+                    auto cell = cells.find(cellkey(x, y, z));
+                    if (cell == cells.end())
+                        continue;
+                    for (Model::Index i : cell->second) {
+                        if (i < found && model.vertices[i] == v) {
+                            found = i;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        if (found == model.vertices.size()) {
+            model.vertices.push_back(v);
+            cells[cellkey(cellof(p.x), cellof(p.y), cellof(p.z))].push_back(found);
+        }
+        return found;
+    }
+
+    // Fan triangulate `poly` into the model, dropping triangles that welding
+    // made degenerate.
+    void addpolygon(const Polygon &poly) {
+        if (!poly.vertices.size())
+            return;
+
+        Model::Index a = add(polygonvertex(poly, 0));
+        for (size_t j = 2; j < poly.vertices.size(); j++) {
+
+            Model::Index b = add(polygonvertex(poly, j - 1));
+            Model::Index c = add(polygonvertex(poly, j));
+
+            if (a != b && b != c && c != a) {
+                model.indices.push_back(a);
+                model.indices.push_back(b);
+                model.indices.push_back(c);
+            }
+        }
+    }
+};
+
+Model modelfrompolygons(const CSGJSCPP_VECTOR<Polygon> &polygons) {
+    Model        model;
+    VertexWelder welder(model);
+    for (const auto &poly : polygons)
+        welder.addpolygon(poly);
+    return model;
+}
+
+// Write the polygons of a tree straight into a model, in `allpolygons()` order.
+Model modelfromtree(const CSGNode *tree) {
+    Model        model;
+    VertexWelder welder(model);
+
+    CSGJSCPP_VECTOR<const CSGNode *> nodes(1, tree);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const CSGNode *me = nodes[i];
+        for (const auto &poly : me->polygons) {
+            if (!tree->inverted) {
+                welder.addpolygon(poly);
+                continue;
+            }
+            Polygon flipped = poly;
+            flipped.flip();
+            welder.addpolygon(flipped);
+        }
+        if (me->front)
+            nodes.push_back(me->front);
+        if (me->back)
+            nodes.push_back(me->back);
+    }
+    return model;
+}
+
+// Snap `poly` to the grid, false when it collapses. When a corner ends up more
+// than csgjs_EPSILON / 2 off the plane, a plane is fitted to the snapped
+// corners, and when that doesn't fit either the polygon is cut into a fan of
+// triangles that each get their own plane, the ones after the first go to
+// `extra`. Either way every vertex lies on the plane of its polygon, which
+// later operations rely on. Corners may move inwards by up to the grid, the
+// dents that leaves are within the tolerance the operations work to.
+inline bool snappolygon(Polygon &poly, CSGJSCPP_REAL grid, CSGJSCPP_VECTOR<Polygon> &extra, CSGContext *context) {
+    auto snap = [grid](CSGJSCPP_REAL v) { return (CSGJSCPP_REAL)floor(v / grid + 0.5f) * grid; };
+
+    size_t count = 0;
+    for (size_t i = 0; i < poly.vertices.size(); i++) {
+        PolygonVertex v = poly.vertices[i];
+        v.pos = Vector(snap(v.pos.x), snap(v.pos.y), snap(v.pos.z));
+        if (count && poly.vertices[count - 1].pos == v.pos)
+            continue;
+        poly.vertices[count++] = v;
+    }
+    while (count > 1 && poly.vertices[count - 1].pos == poly.vertices[0].pos)
+        count--;
+    poly.vertices.resize(count);
+    if (count < 3)
+        return false;
+
+    // Newell's normal is twice the area, a polygon with its corners on the grid
+    // has at least half a cell of area unless it is degenerate or folded over.
+    const CSGJSCPP_REAL least = 0.5f * grid * grid;
+    Vector              normal, centre;
+    for (size_t i = 0; i < count; i++) {
+        const Vector &a = poly.vertices[i].pos;
+        const Vector &b = poly.vertices[(i + 1) % count].pos;
+        normal = normal + Vector((a.y - b.y) * (a.z + b.z), (a.z - b.z) * (a.x + b.x), (a.x - b.x) * (a.y + b.y));
+        centre = centre + a;
+    }
+    if (dot(normal, poly.plane.normal) < least)
+        return false;
+
+    // the plane is kept when the corners are still on it, so the pieces of one
+    // face stay coplanar, otherwise one is fitted to them.
+    auto fits = [&](const Plane &plane) {
+        for (size_t i = 0; i < count; i++) {
+            if (fabs(dot(plane.normal, poly.vertices[i].pos) - plane.w) > 0.5f * csgjs_EPSILON)
+                return false;
+        }
+        return true;
+    };
+    if (fits(poly.plane))
+        return true;
+    Plane fitted;
+    fitted.normal = unit(normal);
+    fitted.w = dot(fitted.normal, centre / (CSGJSCPP_REAL)count);
+    if (fits(fitted)) {
+        poly.plane = fitted;
+        return true;
+    }
+
+    // triangles that are degenerate or turned over are left out.
+    size_t first = 0;
+    for (size_t i = 1; i + 1 < count; i++) {
+        const Vector &a = poly.vertices[0].pos, &b = poly.vertices[i].pos, &c = poly.vertices[i + 1].pos;
+        if (dot(cross(b - a, c - a), poly.plane.normal) < least)
+            continue;
+        if (!first) {
+            first = i;
+            continue;
+        }
+        CSGJSCPP_VECTOR<PolygonVertex> list;
+        if (context)
+            list = context->takevertices();
+        list.push_back(poly.vertices[0]);
+        list.push_back(poly.vertices[i]);
+        list.push_back(poly.vertices[i + 1]);
+        extra.push_back(Polygon(CSGJSCPP_MOVE(list), poly));
+        extra.back().plane = Plane(a, b, c);
+        if (context)
+            context->made(1, 3);
+    }
+    if (!first)
+        return false;
+    PolygonVertex b = poly.vertices[first], c = poly.vertices[first + 1];
+    poly.vertices.resize(3);
+    poly.vertices[1] = b;
+    poly.vertices[2] = c;
+    poly.plane = Plane(poly.vertices[0].pos, b.pos, c.pos);
+    return true;
+}
+
+// Snap the polygons of `list` in place, dropped polygons go back to the context
+// and the triangles polygons are cut into are added at the end.
+inline void snappolygons(CSGJSCPP_VECTOR<Polygon> &list, CSGJSCPP_REAL grid, CSGSnapStats &stats,
+                         CSGContext *context) {
+    CSGJSCPP_VECTOR<Polygon> extra;
+    size_t                   count = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        stats.polygonsin++;
+        stats.verticesin += list[i].vertices.size();
+        if (!snappolygon(list[i], grid, extra, context)) {
+            recyclevertices(context, CSGJSCPP_MOVE(list[i]));
+            continue;
+        }
+        stats.polygonsout++;
+        stats.verticesout += list[i].vertices.size();
+        if (count != i)
+            list[count] = CSGJSCPP_MOVE(list[i]);
+        count++;
+    }
+    list.resize(count);
+    for (auto &poly : extra) {
+        stats.polygonsout++;
+        stats.verticesout += poly.vertices.size();
+        list.push_back(CSGJSCPP_MOVE(poly));
+    }
+}
+
+// Snap the output of an operation when the options ask for it. The tree is no
+// longer a valid BSP tree afterwards, it is only good for taking polygons from.
+inline CSGNode *snaptree(CSGNode *tree, CSGContext &context) {
+    if (!tree || !context.options || context.options->snapgrid <= 0 || context.status != CSG_OK)
+        return tree;
+    CSGJSCPP_VECTOR<CSGNode *> nodes(1, tree);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        snappolygons(nodes[i]->polygons, context.options->snapgrid, context.snapstats, &context);
+        if (nodes[i]->front)
+            nodes.push_back(nodes[i]->front);
+        if (nodes[i]->back)
+            nodes.push_back(nodes[i]->back);
+    }
+    return tree;
+}
+
+// Add the points recorded on the edge from `a` to `b`, and on the pieces it was
+// split into, that are vertices of the output (`used`) to `points`.
+inline void gathersplits(const CSGContext &context, const Vector &a, const Vector &b,
+                         const CSGJSCPP_HASHMAP<uint64_t, bool> &used, CSGJSCPP_VECTOR<Vector> &points) {
+    auto found = context.splits.find(edgebits(a, b));
+    if (found == context.splits.end())
+        return;
+    for (const auto &split : found->second) {
+        const Vector &m = split.point;
+        if (!((split.a == a && split.b == b) || (split.a == b && split.b == a)) || m == a || m == b)
+            continue;
+        if (used.count(positionbits(m)))
+            points.push_back(m);
+        gathersplits(context, a, m, used, points);
+        gathersplits(context, m, b, used, points);
+    }
+}
+
+// Insert the split points recorded by the operation into the edges of the
+// output polygons they lie on, see CSGOptions::fixtjunctions. The points are
+// on the edges so the tree stays a valid BSP tree.
+inline CSGNode *fixsplits(CSGNode *tree, CSGContext &context) {
+    if (!tree || !context.options || !context.options->fixtjunctions || context.splits.empty() ||
+        context.status != CSG_OK)
+        return tree;
+
+    CSGJSCPP_VECTOR<CSGNode *>       nodes(1, tree);
+    CSGJSCPP_HASHMAP<uint64_t, bool> used;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (const auto &poly : nodes[i]->polygons) {
+            for (const auto &v : poly.vertices)
+                used[positionbits(v.pos)] = true;
+        }
+        if (nodes[i]->front)
+            nodes.push_back(nodes[i]->front);
+        if (nodes[i]->back)
+            nodes.push_back(nodes[i]->back);
+    }
+
+    CSGJSCPP_VECTOR<Vector> points;
+    for (CSGNode *node : nodes) {
+        for (auto &poly : node->polygons) {
+            CSGJSCPP_VECTOR<PolygonVertex> list = context.takevertices();
+            for (size_t i = 0; i < poly.vertices.size(); i++) {
+                const PolygonVertex &vi = poly.vertices[i];
+                const PolygonVertex &vj = poly.vertices[(i + 1) % poly.vertices.size()];
+                list.push_back(vi);
+
+                points.clear();
+                gathersplits(context, vi.pos, vj.pos, used, points);
+                Vector        edge = vj.pos - vi.pos;
+                CSGJSCPP_REAL length2 = dot(edge, edge);
+                std::sort(points.begin(), points.end(), [&](const Vector &p, const Vector &q) {
+                    return dot(p - vi.pos, edge) < dot(q - vi.pos, edge);
+                });
+                for (size_t j = 0; j < points.size(); j++) {
+                    if (j && points[j] == points[j - 1])
+                        continue;
+                    PolygonVertex v = interpolate(vi, vj, dot(points[j] - vi.pos, edge) / length2);
+                    v.pos = points[j];
+                    list.push_back(v);
+                }
+            }
+            // the list is counted as made, whichever one is given back is counted off.
+            context.made(0, list.size());
+            if (list.size() != poly.vertices.size())
+                CSGJSCPP_SWAP(list, poly.vertices);
+            context.givevertices(CSGJSCPP_MOVE(list));
+        }
+    }
+    return tree;
+}
+
+typedef CSGNode *csg_function(const CSGNode *a1, const CSGNode *b1, CSGContext &context);
+
+// Build trees of both operands and run `fun` on them, the caller releases the
+// tree of the result.
+inline CSGNode *csgjs_tree(const CSGJSCPP_VECTOR<Polygon> &apoly, const CSGJSCPP_VECTOR<Polygon> &bpoly,
+                           csg_function fun, CSGContext &context) {
+
+    // two builds, the four steps of the boolean and the output.
+    context.begin(7);
+    CSGNode *A = context.newnode();
+    CSGNode *B = context.newnode();
+    if (csgisconvex(apoly))
+        A->buildconvex(apoly, context);
+    else
+        A->build(apoly, context);
+    context.advance();
+    if (csgisconvex(bpoly))
+        B->buildconvex(bpoly, context);
+    else
+        B->build(bpoly, context);
+    context.advance();
+
+    CSGNode *AB = snaptree(fixsplits(fun(A, B, context), context), context);
+    context.release(A);
+    context.release(B);
+    return AB;
+}
+
+CSGJSCPP_VECTOR<Polygon> csgjs_operation(const CSGJSCPP_VECTOR<Polygon> &apoly, const CSGJSCPP_VECTOR<Polygon> &bpoly,
+                                         csg_function fun, CSGContext &context) {
+    CSGNode *                AB = csgjs_tree(apoly, bpoly, fun, context);
+    CSGJSCPP_VECTOR<Polygon> result = takeallpolygons(AB, context);
+    context.release(AB);
+    if (context.status != CSG_OK)
+        clearpolygons(result, context);
+    context.advance();
+    context.finish();
+    return result;
+}
+
+inline CSGJSCPP_VECTOR<Polygon> csgjs_operation(const CSGJSCPP_VECTOR<Polygon> &apoly,
+                                                const CSGJSCPP_VECTOR<Polygon> &bpoly, csg_function fun) {
+    CSGContext context;
+    return csgjs_operation(apoly, bpoly, fun, context);
+}
+
+// Models are written straight from the tree of the result.
+inline Model csgjs_operation(const Model &a, const Model &b, csg_function fun, CSGContext &context) {
+    bool     merge = context.options && context.options->mergecoplanar;
+    CSGNode *AB = csgjs_tree(modeltopolygons(a, merge), modeltopolygons(b, merge), fun, context);
+    Model    result;
+    if (context.status == CSG_OK)
+        result = modelfromtree(AB);
+    context.release(AB);
+    context.advance();
+    context.finish();
+    return result;
+}
+
+inline Model csgjs_operation(const Model &a, const Model &b, csg_function fun) {
+    CSGContext context;
+    return csgjs_operation(a, b, fun, context);
+}
+
+template <typename OPERAND>
+inline CSGStatus csgjs_operation(const OPERAND &a, const OPERAND &b, OPERAND &out, csg_function fun,
+                                 const CSGOptions &options) {
+    CSGContext context;
+    context.options = &options;
+    OPERAND    result = csgjs_operation(a, b, fun, context);
+    if (context.status == CSG_OK)
+        out = CSGJSCPP_MOVE(result);
+    return context.status;
+}
+
+CSGExpr csgexpr_polygons(CSGJSCPP_VECTOR<Polygon> polygons) {
+    CSGExpr ret;
+    ret.polygons.reset(new CSGJSCPP_VECTOR<Polygon>(CSGJSCPP_MOVE(polygons)));
+    return ret;
+}
+
+CSGExpr csgexpr_cube(const Vector &center, const Vector &dim, uint32_t col) {
+    CSGExpr ret;
+    ret.kind = CSGExpr::CUBE;
+    ret.a = center;
+    ret.b = dim;
+    ret.col = col;
+    return ret;
+}
+
+CSGExpr csgexpr_sphere(const Vector &center, CSGJSCPP_REAL radius, uint32_t col, int slices, int stacks) {
+    CSGExpr ret;
+    ret.kind = CSGExpr::SPHERE;
+    ret.a = center;
+    ret.radius = radius;
+    ret.col = col;
+    ret.slices = slices;
+    ret.stacks = stacks;
+    return ret;
+}
+
+CSGExpr csgexpr_cylinder(const Vector &s, const Vector &e, CSGJSCPP_REAL radius, uint32_t col, int slices) {
+    CSGExpr ret;
+    ret.kind = CSGExpr::CYLINDER;
+    ret.a = s;
+    ret.b = e;
+    ret.radius = radius;
+    ret.col = col;
+    ret.slices = slices;
+    return ret;
+}
+
+inline CSGExpr csgexpr_operation(CSGExpr::Kind kind, const CSGExpr &a, const CSGExpr &b) {
+    CSGExpr ret;
+    ret.kind = kind;
+    ret.left.reset(new CSGExpr(a));
+    ret.right.reset(new CSGExpr(b));
+    return ret;
+}
+
+CSGExpr csgexpr_union(const CSGExpr &a, const CSGExpr &b) {
+    return csgexpr_operation(CSGExpr::UNION, a, b);
+}
+
+CSGExpr csgexpr_intersection(const CSGExpr &a, const CSGExpr &b) {
+    return csgexpr_operation(CSGExpr::INTERSECTION, a, b);
+}
+
+CSGExpr csgexpr_subtract(const CSGExpr &a, const CSGExpr &b) {
+    return csgexpr_operation(CSGExpr::SUBTRACT, a, b);
+}
+
+// `n` divided by `coarsen` but no less than `least`, unless it was already.
+inline int coarsened(int n, int coarsen, int least) {
+    return n / coarsen < least ? std::min(n, least) : n / coarsen;
+}
+
+// Results of operations used more than once in an expression, kept for one
+// evaluation. The csgexpr_ functions copy their operands, so copies of one
+// operation are different nodes sharing the operands below them, operations
+// are told apart by kind and operands rather than by address.
+struct ExprMemo {
+    struct Key {
+        CSGExpr::Kind  kind;
+        const CSGExpr *left, *right;
+
+        bool operator<(const Key &o) const {
+            return kind != o.kind ? kind < o.kind : left != o.left ? left < o.left : right < o.right;
+        }
+    };
+    struct Entry {
+        size_t                   uses; // left to evaluate
+        bool                     done;
+        CSGJSCPP_VECTOR<Polygon> result;
+
+        Entry() : uses(0), done(false) {
+        }
+    };
+
+    static Key keyof(const CSGExpr &expr) {
+        return Key{expr.kind, expr.left.get(), expr.right.get()};
+    }
+
+    // count the uses of every operation, the operands of one used again are
+    // not visited again.
+    void count(const CSGExpr &expr) {
+        if (!expr.left || !expr.right || entries[keyof(expr)].uses++)
+            return;
+        count(*expr.left);
+        count(*expr.right);
+    }
+
+    CSGJSCPP_MAP<Key, Entry> entries;
+};
+
+// Evaluate bottom up on one context, an operation that stops leaves its status
+// on the context and the rest of the expression is skipped. Operations used
+// more than once are evaluated once, the result is kept until its last use.
+inline CSGJSCPP_VECTOR<Polygon> evaluateexpr(const CSGExpr &expr, int coarsen, CSGContext &context, ExprMemo &memo) {
+    switch (expr.kind) {
+    case CSGExpr::POLYGONS:
+        return expr.polygons ? *expr.polygons : CSGJSCPP_VECTOR<Polygon>();
+    case CSGExpr::CUBE:
+        return csgpolygon_cube(expr.a, expr.b, expr.col);
+    case CSGExpr::SPHERE:
+        return csgpolygon_sphere(expr.a, expr.radius, expr.col, coarsened(expr.slices, coarsen, 3),
+                                 coarsened(expr.stacks, coarsen, 2));
+    case CSGExpr::CYLINDER:
+        return csgpolygon_cylinder(expr.a, expr.b, expr.radius, expr.col, coarsened(expr.slices, coarsen, 3));
+    default:
+        break;
+    }
+
+    ExprMemo::Entry &entry = memo.entries[ExprMemo::keyof(expr)];
+    if (entry.done) {
+        if (--entry.uses)
+            return entry.result;
+        return CSGJSCPP_MOVE(entry.result);
+    }
+
+    CSGJSCPP_VECTOR<Polygon> a = evaluateexpr(*expr.left, coarsen, context, memo);
+    if (context.status != CSG_OK)
+        return CSGJSCPP_VECTOR<Polygon>();
+    CSGJSCPP_VECTOR<Polygon> b = evaluateexpr(*expr.right, coarsen, context, memo);
+    if (context.status != CSG_OK)
+        return CSGJSCPP_VECTOR<Polygon>();
+    CSGJSCPP_VECTOR<Polygon> result;
+    if (expr.kind == CSGExpr::UNION)
+        result = csgunion(a, b, context);
+    else if (expr.kind == CSGExpr::INTERSECTION)
+        result = csgintersection(a, b, context);
+    else
+        result = csgsubtract(a, b, context);
+    if (--entry.uses && context.status == CSG_OK) {
+        entry.result = result;
+        entry.done = true;
+    }
+    return result;
+}
+
+CSGJSCPP_VECTOR<Polygon> csgevaluate(const CSGExpr &expr, int coarsen) {
+    CSGContext context;
+    ExprMemo   memo;
+    memo.count(expr);
+    return evaluateexpr(expr, coarsen < 1 ? 1 : coarsen, context, memo);
+}
+
+CSGStatus csgevaluate(const CSGExpr &expr, CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options, int coarsen) {
+    CSGContext context;
+    ExprMemo   memo;
+    context.options = &options;
+    memo.count(expr);
+    CSGJSCPP_VECTOR<Polygon> result = evaluateexpr(expr, coarsen < 1 ? 1 : coarsen, context, memo);
+    if (context.status == CSG_OK)
+        out = CSGJSCPP_MOVE(result);
+    return context.status;
+}
+
+CSGPreview::CSGPreview(const CSGExpr &expr, int coarsen) : stop(false), refined(CSG_OK) {
+    CSGOptions coarse;
+    coarse.snapgrid = 2 * csgjs_EPSILON;
+    csgevaluate(expr, preview, coarse, coarsen);
+
+    options.cancel = &stop;
+    refine = std::async(std::launch::async, [this, expr]() { return csgevaluate(expr, full, options); });
+}
+
+CSGPreview::~CSGPreview() {
+    // wait without get(), whatever the refinement threw must not leave a destructor.
+    stop = true;
+    if (refine.valid())
+        refine.wait();
+}
+
+bool CSGPreview::ready() const {
+    return !refine.valid() || refine.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+CSGStatus CSGPreview::status() {
+    // get() can only be called once, what it threw is kept for later calls.
+    if (refine.valid()) {
+        try {
+            refined = refine.get();
+        } catch (...) {
+            failed = std::current_exception();
+        }
+    }
+    if (failed)
+        std::rethrow_exception(failed);
+    return refined;
+}
+
+const CSGJSCPP_VECTOR<Polygon> &CSGPreview::result() {
+    status();
+    return full;
+}
+
+void CSGPreview::cancel() {
+    stop = true;
+    status();
+}
+
+CSGJSCPP_VECTOR<Polygon> csgtransform(const CSGJSCPP_VECTOR<Polygon> &polygons, const Transform &tr) {
+    Transform normalmat = normalmatrix(tr);
+    bool      mirror = determinant(tr) < 0;
+
+    CSGJSCPP_VECTOR<Polygon> ret = polygons;
+    for (auto &poly : ret)
+        transformpolygon(poly, tr, normalmat, mirror);
+    return ret;
+}
+
+// Threads used to run `count` items when asked for `threads`, 0 meaning one per
+// hardware thread.
+inline unsigned workercount(size_t count, unsigned threads) {
+    if (!threads)
+        threads = std::thread::hardware_concurrency();
+    if (threads > count)
+        threads = (unsigned)count;
+    return threads ? threads : 1;
+}
+
+// Run `fun(i, worker)` for every i in [0, count) on `workercount(count, threads)`
+// threads, `worker` is the index of the thread running the item.
+template <typename FUNC> void parallelfor(size_t count, unsigned threads, FUNC fun) {
+    threads = workercount(count, threads);
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++)
+            fun(i, 0u);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto                worker = [&next, count, &fun](unsigned index) {
+        for (size_t i = next++; i < count; i = next++)
+            fun(i, index);
+    };
+    CSGJSCPP_VECTOR<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.push_back(std::thread(worker, i));
+    worker(0);
+    for (auto &t : pool)
+        t.join();
+}
+
+HalfEdgeMesh halfedgemesh(Model &&model, unsigned threads) {
+    HalfEdgeMesh mesh;
+    if (model.indices.size() % 3)
+        return mesh;
+    mesh.model = CSGJSCPP_MOVE(model);
+    const CSGJSCPP_VECTOR<Vertex> &vertices = mesh.model.vertices;
+    const size_t                   count = mesh.model.indices.size();
+
+    // positions by the hash of their bits, a collision moves on to the next slot.
+    CSGJSCPP_HASHMAP<uint64_t, uint32_t> positions;
+    CSGJSCPP_VECTOR<Vector>              unique;
+    mesh.position.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        for (uint64_t h = positionbits(vertices[i].pos);; h++) {
+            auto found = positions.find(h);
+            if (found == positions.end()) {
+                positions[h] = (uint32_t)unique.size();
+                mesh.position[i] = (uint32_t)unique.size();
+                unique.push_back(vertices[i].pos);
+                break;
+            }
+            if (unique[found->second] == vertices[i].pos) {
+                mesh.position[i] = found->second;
+                break;
+            }
+        }
+    }
+
+    // half-edges are shared out by their undirected edge so every bucket can be
+    // matched on its own thread.
+    unsigned workers = workercount(count / 3, threads);
+    size_t   buckets = workers > 1 ? workers * 4 : 1;
+    auto     edgeof = [&](uint32_t h) {
+        uint64_t a = mesh.origin(h), b = mesh.target(h);
+        return a < b ? a << 32 | b : b << 32 | a;
+    };
+    auto bucketof = [&](uint64_t edge) { return (size_t)((edge * 0x9e3779b97f4a7c15ull) >> 32) % buckets; };
+
+    CSGJSCPP_VECTOR<uint32_t> order(count), starts(buckets + 1, 0);
+    for (uint32_t h = 0; h < count; h++)
+        starts[bucketof(edgeof(h)) + 1]++;
+    for (size_t i = 0; i < buckets; i++)
+        starts[i + 1] += starts[i];
+    CSGJSCPP_VECTOR<uint32_t> fill(starts.begin(), starts.end() - 1);
+    for (uint32_t h = 0; h < count; h++)
+        order[fill[bucketof(edgeof(h))]++] = h;
+
+    // twins are only set on edges with exactly one half-edge each way.
+    struct Match {
+        uint32_t first, second, count;
+    };
+    mesh.twin.assign(count, HalfEdgeMesh::NONE);
+    parallelfor(buckets, workers, [&](size_t bucket, unsigned) {
+        CSGJSCPP_HASHMAP<uint64_t, Match> edges;
+        edges.reserve(starts[bucket + 1] - starts[bucket]);
+        for (uint32_t i = starts[bucket]; i < starts[bucket + 1]; i++) {
+            uint32_t h = order[i];
+            if (mesh.origin(h) == mesh.target(h))
+                continue;
+            auto found = edges.find(edgeof(h));
+            if (found == edges.end())
+                edges[edgeof(h)] = Match{h, HalfEdgeMesh::NONE, 1};
+            else if (++found->second.count == 2)
+                found->second.second = h;
+        }
+        for (const auto &edge : edges) {
+            const Match &m = edge.second;
+            if (m.count == 2 && mesh.origin(m.first) == mesh.target(m.second)) {
+                mesh.twin[m.first] = m.second;
+                mesh.twin[m.second] = m.first;
+            }
+        }
+    });
+
+    mesh.outgoing.assign(unique.size(), HalfEdgeMesh::NONE);
+    for (uint32_t h = 0; h < count; h++) {
+        uint32_t &out = mesh.outgoing[mesh.origin(h)];
+        if (out == HalfEdgeMesh::NONE || (mesh.twin[h] == HalfEdgeMesh::NONE && mesh.twin[out] != HalfEdgeMesh::NONE))
+            out = h;
+    }
+    return mesh;
+}
+
+HalfEdgeMesh halfedgemesh(const Model &model, unsigned threads) {
+    return halfedgemesh(Model(model), threads);
+}
+
+enum PartitionOperation { PARTITION_UNION, PARTITION_SUBTRACT, PARTITION_INTERSECT };
+
+// Uniform grid used by the partitioned booleans.
+struct PartitionGrid {
+    Vector origin;
+    Vector size; // of a single cell.
+    int    cells[3];
+
+    inline size_t cellcount() const {
+        return (size_t)cells[0] * cells[1] * cells[2];
+    }
+    inline size_t cellindex(int x, int y, int z) const {
+        return (size_t)x + cells[0] * ((size_t)y + cells[1] * (size_t)z);
+    }
+    inline CSGJSCPP_REAL wall(int axis, int i) const {
+        return (&origin.x)[axis] + (&size.x)[axis] * i;
+    }
+    inline int cellof(int axis, CSGJSCPP_REAL v) const {
+        int i = (int)floor((v - (&origin.x)[axis]) / (&size.x)[axis]);
+        return i < 0 ? 0 : (i >= cells[axis] ? cells[axis] - 1 : i);
+    }
+
+    // Split the polygons along the grid walls and drop every piece in its cell.
+    // Pieces lying in a wall belong to the cell below it, for both operands, so
+    // coincident faces always meet in the same cell.
+    void partition(const CSGJSCPP_VECTOR<Polygon> &list, CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>> &out) const {
+        out.resize(cellcount());
+        for (const auto &poly : list) {
+            int index[3] = {0, 0, 0};
+            partitionaxis(0, CSGJSCPP_VECTOR<Polygon>(1, poly), index, out);
+        }
+    }
+
+    void partitionaxis(int axis, const CSGJSCPP_VECTOR<Polygon> &pieces, int *index,
+                       CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>> &out) const {
+        for (const auto &piece : pieces) {
+            BoundingBox box;
+            box.extend(piece);
+            int first = cellof(axis, (&box.min.x)[axis] - csgjs_EPSILON);
+            int last = cellof(axis, (&box.max.x)[axis] + csgjs_EPSILON);
+
+            CSGJSCPP_VECTOR<Polygon> current(1, piece);
+            for (int i = first; i <= last && current.size(); i++) {
+                CSGJSCPP_VECTOR<Polygon> cell, rest;
+                if (i == last) {
+                    cell.swap(current);
+                } else {
+                    Plane wallplane;
+                    (&wallplane.normal.x)[axis] = 1.0f;
+                    wallplane.w = wall(axis, i + 1);
+                    for (const auto &p : current)
+                        wallplane.splitpolygon(p, cell, cell, rest, cell);
+                    current.swap(rest);
+                }
+                if (!cell.size())
+                    continue;
+
+                index[axis] = i;
+                if (axis == 2) {
+                    auto &dest = out[cellindex(index[0], index[1], index[2])];
+                    dest.insert(dest.end(), cell.begin(), cell.end());
+                } else {
+                    partitionaxis(axis + 1, cell, index, out);
+                }
+            }
+        }
+    }
+
+    // Whether the middle of cell (x, y, z) is inside the solid, by the parity of
+    // crossings of a ray along +x with the polygons in the cells it passes.
+    bool inside(const CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>> &solid, int x, int y, int z) const {
+        // nudged off the middle so the ray doesn't run exactly along edges of
+        // regular geometry.
+        Vector origin(wall(0, x) + size.x * 0.5f, wall(1, y) + size.y * 0.5123457f,
+                      wall(2, z) + size.z * 0.4876543f);
+        Vector dir(1.0f, 0.0f, 0.0f);
+
+        int crossings = 0;
+        for (int i = x; i < cells[0]; i++) {
+            for (const auto &poly : solid[cellindex(i, y, z)]) {
+                CSGJSCPP_REAL t;
+                if (raypolygon(poly, origin, dir, t) && t > 0)
+                    crossings++;
+            }
+        }
+        return (crossings & 1) != 0;
+    }
+};
+
+CSGJSCPP_VECTOR<Polygon> csgpartition_operation(const CSGJSCPP_VECTOR<Polygon> &apoly,
+                                                const CSGJSCPP_VECTOR<Polygon> &bpoly, PartitionOperation op,
+                                                const CSGPartition &partition) {
+    BoundingBox box;
+    for (const auto &poly : apoly)
+        box.extend(poly);
+    for (const auto &poly : bpoly)
+        box.extend(poly);
+    if (!apoly.size() || !bpoly.size() || box.min.x > box.max.x) {
+        csg_function *fun =
+            op == PARTITION_UNION ? csg_union : (op == PARTITION_SUBTRACT ? csg_subtract : csg_intersect);
+        return csgjs_operation(apoly, bpoly, fun);
+    }
+
+    // pad the box so no polygon lies in the outer walls.
+    PartitionGrid grid;
+    Vector        pad(csgjs_EPSILON * 4, csgjs_EPSILON * 4, csgjs_EPSILON * 4);
+    grid.origin = box.min - pad;
+    Vector extent = box.max + pad - grid.origin;
+    for (int axis = 0; axis < 3; axis++) {
+        grid.cells[axis] = partition.cells[axis] > 0 ? partition.cells[axis] : 1;
+        (&grid.size.x)[axis] = (&extent.x)[axis] / grid.cells[axis];
+    }
+
+    CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<Polygon>> acells, bcells, results;
+    grid.partition(apoly, acells);
+    grid.partition(bpoly, bcells);
+    results.resize(grid.cellcount());
+    CSGJSCPP_VECTOR<CSGContext> contexts(workercount(grid.cellcount(), partition.threads));
+
+    // Inside a cell the fragments of one operand classify every point of the
+    // cell correctly, each empty region of the local tree borders one of them.
+    // A cell where one operand has no fragments is entirely in or out of it.
+    parallelfor(grid.cellcount(), partition.threads, [&](size_t cell, unsigned worker) {
+        const auto &a = acells[cell];
+        const auto &b = bcells[cell];
+        auto &      result = results[cell];
+        if (!a.size() && !b.size())
+            return;
+
+        int x = (int)(cell % grid.cells[0]);
+        int y = (int)((cell / grid.cells[0]) % grid.cells[1]);
+        int z = (int)(cell / ((size_t)grid.cells[0] * grid.cells[1]));
+
+        if (a.size() && b.size()) {
+            csg_function *fun =
+                op == PARTITION_UNION ? csg_union : (op == PARTITION_SUBTRACT ? csg_subtract : csg_intersect);
+            result = csgjs_operation(a, b, fun, contexts[worker]);
+        } else if (!b.size()) {
+            bool inb = grid.inside(bcells, x, y, z);
+            if (op == PARTITION_INTERSECT ? inb : !inb)
+                result = a;
+        } else {
+            bool ina = grid.inside(acells, x, y, z);
+            if (op == PARTITION_UNION ? !ina : ina) {
+                result = b;
+                if (op == PARTITION_SUBTRACT) {
+                    for (auto &poly : result)
+                        poly.flip();
+                }
+            }
+        }
+    });
+
+    CSGJSCPP_VECTOR<Polygon> ret;
+    for (const auto &cell : results)
+        ret.insert(ret.end(), cell.begin(), cell.end());
+    return ret;
+}
+
+CSGJSCPP_VECTOR<Polygon> csgpartition_union(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                            const CSGPartition &partition) {
+    return csgpartition_operation(a, b, PARTITION_UNION, partition);
+}
+
+CSGJSCPP_VECTOR<Polygon> csgpartition_intersection(const CSGJSCPP_VECTOR<Polygon> &a,
+                                                   const CSGJSCPP_VECTOR<Polygon> &b, const CSGPartition &partition) {
+    return csgpartition_operation(a, b, PARTITION_INTERSECT, partition);
+}
+
+CSGJSCPP_VECTOR<Polygon> csgpartition_subtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                               const CSGPartition &partition) {
+    return csgpartition_operation(a, b, PARTITION_SUBTRACT, partition);
+}
+
+// Batch implementation
+
+struct CSGBatch::Workers {
+    std::mutex                                         mutex;
+    std::condition_variable                            wake, idle;
+    CSGJSCPP_DEQUE<std::function<void(CSGContext &)>> jobs;
+    CSGJSCPP_VECTOR<std::thread>                       threads;
+    size_t                                             running;
+    size_t                                             contextlimit;
+    bool                                               stopping;
+    // the first exception a job let escape, handed to wait().
+    std::exception_ptr error;
+
+    Workers(size_t contextlimit) : running(0), contextlimit(contextlimit), stopping(false) {
+    }
+
+    // Counts a job as running while it is in scope, unlocked, however it ends.
+    // What the job threw is recorded before wait() can see it finish.
+    struct Running {
+        Workers &                     workers;
+        std::unique_lock<std::mutex> &lock;
+        std::exception_ptr            failed;
+
+        Running(Workers &workers, std::unique_lock<std::mutex> &lock) : workers(workers), lock(lock) {
+            workers.running++;
+            lock.unlock();
+        }
+        ~Running() {
+            lock.lock();
+            if (failed && !workers.error)
+                workers.error = failed;
+            workers.running--;
+            if (!workers.jobs.size() && !workers.running)
+                workers.idle.notify_all();
+        }
+    };
+
+    void run() {
+        CSGJSCPP_UNIQUEPTR<CSGContext> context(new CSGContext(contextlimit));
+        std::unique_lock<std::mutex>   lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || jobs.size(); });
+            // queued jobs are finished before stopping.
+            if (!jobs.size())
+                return;
+            std::function<void(CSGContext &)> job = CSGJSCPP_MOVE(jobs.front());
+            jobs.pop_front();
+            Running running(*this, lock);
+            try {
+                job(*context);
+            } catch (...) {
+                running.failed = std::current_exception();
+            }
+            // a job stopped half way may have left state behind, start afresh.
+            if (running.failed)
+                context.reset(new CSGContext(contextlimit));
+        }
+    }
+};
+
+CSGBatch::CSGBatch(unsigned threads, size_t contextlimit) : workers(new Workers(contextlimit)) {
+    if (!threads)
+        threads = std::thread::hardware_concurrency();
+    if (!threads)
+        threads = 1;
+    for (unsigned i = 0; i < threads; i++)
+        workers->threads.push_back(std::thread(&Workers::run, workers.get()));
+}
+
+CSGBatch::~CSGBatch() {
+    {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        workers->stopping = true;
+    }
+    workers->wake.notify_all();
+    for (auto &t : workers->threads)
+        t.join();
+}
+
+void CSGBatch::post(std::function<void(CSGContext &)> job) {
+    {
+        std::lock_guard<std::mutex> lock(workers->mutex);
+        workers->jobs.push_back(CSGJSCPP_MOVE(job));
+    }
+    workers->wake.notify_one();
+}
+
+void CSGBatch::wait() {
+    std::unique_lock<std::mutex> lock(workers->mutex);
+    workers->idle.wait(lock, [this] { return !workers->jobs.size() && !workers->running; });
+    std::exception_ptr error;
+    CSGJSCPP_SWAP(error, workers->error);
+    lock.unlock();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+unsigned CSGBatch::threads() const {
+    return (unsigned)workers->threads.size();
+}
+
+// The operands are moved into a pair kept alive by the queued job.
+template <typename OPERAND, typename RESULT>
+inline std::future<RESULT> batchoperation(CSGBatch &batch, OPERAND &&a, OPERAND &&b,
+                                          RESULT (*op)(const OPERAND &, const OPERAND &, CSGContext &)) {
+    CSGJSCPP_SHAREDPTR<CSGJSCPP_PAIR<OPERAND, OPERAND>> operands(
+        new CSGJSCPP_PAIR<OPERAND, OPERAND>(CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b)));
+    return batch.submit(
+        [operands, op](CSGContext &context) { return op(operands->first, operands->second, context); });
+}
+
+std::future<Model> CSGBatch::csgunion(Model a, Model b) {
+    return batchoperation<Model, Model>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b), csgjscpp::csgunion);
+}
+
+std::future<Model> CSGBatch::csgintersection(Model a, Model b) {
+    return batchoperation<Model, Model>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b), csgjscpp::csgintersection);
+}
+
+std::future<Model> CSGBatch::csgsubtract(Model a, Model b) {
+    return batchoperation<Model, Model>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b), csgjscpp::csgsubtract);
+}
+
+std::future<CSGJSCPP_VECTOR<Polygon>> CSGBatch::csgunion(CSGJSCPP_VECTOR<Polygon> a, CSGJSCPP_VECTOR<Polygon> b) {
+    return batchoperation<CSGJSCPP_VECTOR<Polygon>, CSGJSCPP_VECTOR<Polygon>>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b),
+                                                                              csgjscpp::csgunion);
+}
+
+std::future<CSGJSCPP_VECTOR<Polygon>> CSGBatch::csgintersection(CSGJSCPP_VECTOR<Polygon> a,
+                                                                CSGJSCPP_VECTOR<Polygon> b) {
+    return batchoperation<CSGJSCPP_VECTOR<Polygon>, CSGJSCPP_VECTOR<Polygon>>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b),
+                                                                              csgjscpp::csgintersection);
+}
+
+std::future<CSGJSCPP_VECTOR<Polygon>> CSGBatch::csgsubtract(CSGJSCPP_VECTOR<Polygon> a, CSGJSCPP_VECTOR<Polygon> b) {
+    return batchoperation<CSGJSCPP_VECTOR<Polygon>, CSGJSCPP_VECTOR<Polygon>>(*this, CSGJSCPP_MOVE(a), CSGJSCPP_MOVE(b),
+                                                                              csgjscpp::csgsubtract);
+}
+
+std::future<Model> CSGBatch::modelfrompolygons(CSGJSCPP_VECTOR<Polygon> polygons) {
+    CSGJSCPP_SHAREDPTR<CSGJSCPP_VECTOR<Polygon>> list(new CSGJSCPP_VECTOR<Polygon>(CSGJSCPP_MOVE(polygons)));
+    return submit([list](CSGContext &) { return csgjscpp::modelfrompolygons(*list); });
+}
+
+std::future<CSGJSCPP_VECTOR<Polygon>> CSGBatch::csgfixtjunc(CSGJSCPP_VECTOR<Polygon> polygons) {
+    CSGJSCPP_SHAREDPTR<CSGJSCPP_VECTOR<Polygon>> list(new CSGJSCPP_VECTOR<Polygon>(CSGJSCPP_MOVE(polygons)));
+    return submit([list](CSGContext &) { return csgjscpp::csgfixtjunc(*list); });
+}
+
+// The corners of the unit cube in `csgpolygon_cube()` order, a bit per axis.
+static const struct CubeQuad {
+    int    indices[4];
+    Vector normal;
+} csgjs_cubequads[] = {{{0, 4, 6, 2}, {-1, 0, 0}}, {{1, 3, 7, 5}, {+1, 0, 0}}, {{0, 1, 5, 4}, {0, -1, 0}},
+                       {{2, 6, 7, 3}, {0, +1, 0}}, {{0, 2, 3, 1}, {0, 0, -1}}, {{4, 5, 7, 6}, {0, 0, +1}}};
+
+inline Vector cubecorner(const Vector &center, const Vector &dim, int i) {
+    return Vector(center.x + dim.x * (2.0f * !!(i & 1) - 1), center.y + dim.y * (2.0f * !!(i & 2) - 1),
+                  center.z + dim.z * (2.0f * !!(i & 4) - 1));
+}
+
+CSGJSCPP_VECTOR<Polygon> csgpolygon_cube(const Vector &center, const Vector &dim, const uint32_t col) {
+    CSGJSCPP_VECTOR<Polygon> polygons;
+    for (const auto &q : csgjs_cubequads) {
+
+        CSGJSCPP_VECTOR<Vertex> verts;
+
+        for (auto i : q.indices)
+            verts.push_back({cubecorner(center, dim, i), q.normal, col});
+        polygons.push_back(Polygon(verts));
+    }
+    return polygons;
+}
+
+Model csgmodel_cube(const Vector &center, const Vector &dim, uint32_t col) {
+    Model model;
+    model.vertices.reserve(24);
+    model.indices.reserve(36);
+    for (const auto &q : csgjs_cubequads) {
+        Model::Index first = (Model::Index)model.vertices.size();
+        for (auto i : q.indices)
+            model.vertices.push_back({cubecorner(center, dim, i), q.normal, col});
+        for (Model::Index i : {0, 1, 2, 0, 2, 3})
+            model.indices.push_back(first + i);
+    }
+    return model;
+}
+
+// cos and sin of the `n + 1` angles i / n * `turn` for i = 0..n, worked out once
+// per primitive rather than for every vertex of every face. The last angle is
+// made exact for a whole turn or a half turn, so rings close on themselves and
+// the faces round a pole meet in one point.
+struct TrigTable {
+    CSGJSCPP_VECTOR<CSGJSCPP_REAL> cosines, sines;
+
+    TrigTable(int n, CSGJSCPP_REAL turn) : cosines(n + 1), sines(n + 1) {
+        for (int i = 0; i <= n; i++) {
+            CSGJSCPP_REAL angle = (CSGJSCPP_REAL)i / n * turn;
+            cosines[i] = (CSGJSCPP_REAL)cos(angle);
+            sines[i] = (CSGJSCPP_REAL)sin(angle);
+        }
+        if (turn == (CSGJSCPP_REAL)M_PI * 2) {
+            cosines[n] = cosines[0];
+            sines[n] = sines[0];
+        } else if (turn == (CSGJSCPP_REAL)M_PI) {
+            cosines[n] = -1;
+            sines[n] = 0;
+        }
+    }
+};
+
+// The direction from the centre of a sphere to ring point `i` of stack `j`.
+inline Vector spheredir(const TrigTable &theta, const TrigTable &phi, int i, int j) {
+    return Vector(theta.cosines[i] * phi.sines[j], phi.cosines[j], theta.sines[i] * phi.sines[j]);
+}
+
+CSGJSCPP_VECTOR<Polygon> csgpolygon_sphere(const Vector &c, CSGJSCPP_REAL r, uint32_t col, int slices, int stacks) {
+    CSGJSCPP_VECTOR<Polygon> polygons;
+    TrigTable                theta(slices, (CSGJSCPP_REAL)M_PI * 2), phi(stacks, (CSGJSCPP_REAL)M_PI);
+
+    auto mkvertex = [&](int i, int j) -> Vertex {
+        Vector dir = spheredir(theta, phi, i, j);
+        return Vertex{c + (dir * r), dir, col};
+    };
+    polygons.reserve((size_t)slices * stacks);
+    for (int i = 0; i < slices; i++) {
+        for (int j = 0; j < stacks; j++) {
+
+            CSGJSCPP_VECTOR<Vertex> vertices;
+
+            vertices.push_back(mkvertex(i, j));
+            if (j > 0) {
+                vertices.push_back(mkvertex(i + 1, j));
+            }
+            if (j < stacks - 1) {
+                vertices.push_back(mkvertex(i + 1, j + 1));
+            }
+            vertices.push_back(mkvertex(i, j + 1));
+            polygons.push_back(Polygon(vertices));
+        }
+    }
+    return polygons;
+}
+
+// The same faces as `csgpolygon_sphere()`, each ring point is made once and
+// shared by the faces around it.
+Model csgmodel_sphere(const Vector &c, CSGJSCPP_REAL r, uint32_t col, int slices, int stacks) {
+    Model     model;
+    TrigTable theta(slices, (CSGJSCPP_REAL)M_PI * 2), phi(stacks, (CSGJSCPP_REAL)M_PI);
+
+    // the poles, then the rings between them.
+    model.vertices.reserve((size_t)slices * (stacks - 1) + 2);
+    for (int j : {0, stacks}) {
+        Vector dir = spheredir(theta, phi, 0, j);
+        model.vertices.push_back(Vertex{c + (dir * r), dir, col});
+    }
+    for (int j = 1; j < stacks; j++) {
+        for (int i = 0; i < slices; i++) {
+            Vector dir = spheredir(theta, phi, i, j);
+            model.vertices.push_back(Vertex{c + (dir * r), dir, col});
+        }
+    }
+    auto index = [&](int i, int j) -> Model::Index {
+        if (j == 0 || j == stacks)
+            return j == 0 ? 0 : 1;
+        return (Model::Index)(2 + (j - 1) * slices + i % slices);
+    };
+
+    model.indices.reserve((size_t)slices * (stacks - 1) * 6);
+    for (int i = 0; i < slices; i++) {
+        for (int j = 0; j < stacks; j++) {
+            Model::Index face[4];
+            int          count = 0;
+            face[count++] = index(i, j);
+            if (j > 0)
+                face[count++] = index(i + 1, j);
+            if (j < stacks - 1)
+                face[count++] = index(i + 1, j + 1);
+            face[count++] = index(i, j + 1);
+            for (int k = 2; k < count; k++) {
+                model.indices.push_back(face[0]);
+                model.indices.push_back(face[k - 1]);
+                model.indices.push_back(face[k]);
+            }
+        }
+    }
+    return model;
+}
+
+// The frame of a cylinder from `s` to `e`, shared by both generators.
+struct CylinderFrame {
+    Vector ray, axisX, axisY, axisZ;
+
+    CylinderFrame(const Vector &s, const Vector &e) : ray(e - s) {
+        axisZ = unit(ray);
+        bool isY = fabs(axisZ.y) > 0.5f;
+        axisX = unit(cross(Vector(isY, !isY, 0), axisZ));
+        axisY = unit(cross(axisX, axisZ));
+    }
+};
+
+CSGJSCPP_VECTOR<Polygon> csgpolygon_cylinder(const Vector &s, const Vector &e, CSGJSCPP_REAL r, uint32_t col,
+                                             int slices) {
+    CylinderFrame frame(s, e);
+    TrigTable     angles(slices, (CSGJSCPP_REAL)M_PI * 2);
+
+    Vertex start{s, -frame.axisZ, col};
+    Vertex end{e, unit(frame.axisZ), col};
+
+    CSGJSCPP_VECTOR<Polygon> polygons;
+
+    auto point = [&](CSGJSCPP_REAL stack, int slice, CSGJSCPP_REAL normalBlend) -> Vertex {
+        Vector out = frame.axisX * angles.cosines[slice] + frame.axisY * angles.sines[slice];
+        Vector pos = s + frame.ray * stack + out * r;
+        Vector normal = out * (1.0f - (CSGJSCPP_REAL)fabs(normalBlend)) + frame.axisZ * normalBlend;
+        return Vertex{pos, normal, col};
+    };
+
+    polygons.reserve((size_t)slices * 3);
+    for (int i = 0; i < slices; i++) {
+        polygons.push_back(Polygon({start, point(0, i, -1), point(0, i + 1, -1)}));
+        polygons.push_back(Polygon({point(0, i + 1, 0), point(0, i, 0), point(1, i, 0), point(1, i + 1, 0)}));
+        polygons.push_back(Polygon({end, point(1, i + 1, 1), point(1, i, 1)}));
+    }
+    return polygons;
+}
+
+// The same faces as `csgpolygon_cylinder()` with the four rings of points (two
+// caps and the two ends of the side) made once.
+Model csgmodel_cylinder(const Vector &s, const Vector &e, CSGJSCPP_REAL r, uint32_t col, int slices) {
+    CylinderFrame frame(s, e);
+    TrigTable     angles(slices, (CSGJSCPP_REAL)M_PI * 2);
+    Model         model;
+
+    model.vertices.reserve((size_t)slices * 4 + 2);
+    model.vertices.push_back(Vertex{s, -frame.axisZ, col});
+    model.vertices.push_back(Vertex{e, unit(frame.axisZ), col});
+    for (int ring = 0; ring < 4; ring++) {
+        CSGJSCPP_REAL stack = ring < 2 ? 0.0f : 1.0f;
+        CSGJSCPP_REAL normalBlend = ring == 0 ? -1.0f : ring == 3 ? 1.0f : 0.0f;
+        for (int i = 0; i < slices; i++) {
+            Vector out = frame.axisX * angles.cosines[i] + frame.axisY * angles.sines[i];
+            Vector normal = out * (1.0f - (CSGJSCPP_REAL)fabs(normalBlend)) + frame.axisZ * normalBlend;
+            model.vertices.push_back(Vertex{s + frame.ray * stack + out * r, normal, col});
         }
     }
+    auto point = [slices](int ring, int i) { return (Model::Index)(2 + ring * slices + i % slices); };
+
+    model.indices.reserve((size_t)slices * 12);
+    for (int i = 0; i < slices; i++) {
+        Model::Index faces[] = {0,              point(0, i),     point(0, i + 1), point(1, i + 1),
+                                point(1, i),    point(2, i),     point(1, i + 1), point(2, i),
+                                point(2, i + 1), 1,              point(3, i + 1), point(3, i)};
+        model.indices.insert(model.indices.end(), faces, faces + 12);
+    }
+    return model;
+}
 
-    for (auto it = nodes_to_delete.begin(); it != nodes_to_delete.end(); ++it)
-        delete *it;
+// The log, see csgrecordstart(). `csgjs_recording` keeps the calls cheap
+// while no log is open.
+static std::atomic<bool> csgjs_recording(false);
+static std::mutex        csgjs_logmutex;
+static FILE *            csgjs_log = nullptr;
+
+static const char     csgjs_logmagic[8] = {'C', 'S', 'G', 'J', 'S', 'L', 'O', 'G'};
+static const uint32_t csgjs_logversion = 3; // 2 added fixtjunctions, 3 polygon planes
+
+// Records are put together in memory before the call, `out` may be one of
+// the operands, and written out in one piece after it.
+typedef CSGJSCPP_VECTOR<char> LogBuffer;
+
+template <typename T> inline void logwrite(LogBuffer &file, const T &value) {
+    const char *bytes = (const char *)&value;
+    file.insert(file.end(), bytes, bytes + sizeof(T));
 }
 
-// Public interface implementation
+inline void logwrite(LogBuffer &file, const Vertex &v) {
+    const CSGJSCPP_REAL values[] = {v.pos.x, v.pos.y, v.pos.z, v.normal.x, v.normal.y, v.normal.z};
+    logwrite(file, values);
+    logwrite(file, v.col);
+}
 
-inline CSGJSCPP_VECTOR<Polygon> modeltopolygons(const Model &model) {
-    CSGJSCPP_VECTOR<Polygon> list;
-    for (size_t i = 0; i < model.indices.size(); i += 3) {
-        CSGJSCPP_VECTOR<Vertex> triangle;
-        for (int j = 0; j < 3; j++) {
-            Vertex v = model.vertices[model.indices[i + j]];
-            triangle.push_back(v);
-        }
-        list.push_back(Polygon(triangle));
+inline void logwrite(LogBuffer &file, const CSGJSCPP_VECTOR<Polygon> &polygons) {
+    logwrite(file, (uint32_t)polygons.size());
+    for (const auto &poly : polygons) {
+        logwrite(file, (uint32_t)poly.vertices.size());
+        // as it is, replaying must not work it out again from the vertices.
+        const CSGJSCPP_REAL plane[] = {poly.plane.normal.x, poly.plane.normal.y, poly.plane.normal.z, poly.plane.w};
+        logwrite(file, plane);
+        for (size_t i = 0; i < poly.vertices.size(); i++)
+            logwrite(file, polygonvertex(poly, i));
     }
-    return list;
 }
 
-Model modelfrompolygons(const CSGJSCPP_VECTOR<Polygon> &polygons) {
-    Model model;
+inline void logwrite(LogBuffer &file, const Model &model) {
+    logwrite(file, (uint32_t)model.vertices.size());
+    for (const auto &v : model.vertices)
+        logwrite(file, v);
+    logwrite(file, (uint32_t)model.indices.size());
+    for (Model::Index i : model.indices)
+        logwrite(file, (uint32_t)i);
+}
 
-    for (size_t i = 0; i < polygons.size(); i++) {
-        const Polygon &poly = polygons[i];
+inline void logwrite(LogBuffer &file, const CSGNode *tree) {
+    logwrite(file, tree ? tree->allpolygons() : CSGJSCPP_VECTOR<Polygon>());
+}
+
+inline uint8_t logoperands(const CSGJSCPP_VECTOR<Polygon> &) {
+    return CSGLogRecord::POLYGONS;
+}
 
-        if (poly.vertices.size()) {
+inline uint8_t logoperands(const Model &) {
+    return CSGLogRecord::MODELS;
+}
 
-            Model::Index a = model.AddVertex(poly.vertices[0]);
+inline uint8_t logoperands(const CSGNode *) {
+    return CSGLogRecord::TREES;
+}
 
-            for (size_t j = 2; j < poly.vertices.size(); j++) {
+inline CSGStatus logstatus(CSGStatus status, const CSGContext *) {
+    return status;
+}
 
-                Model::Index b = model.AddVertex(poly.vertices[j - 1]);
-                Model::Index c = model.AddVertex(poly.vertices[j]);
+template <typename RESULT> inline CSGStatus logstatus(const RESULT &, const CSGContext *context) {
+    return context ? context->status : CSG_OK;
+}
 
-                if (a != b && b != c && c != a) {
-                    model.indices.push_back(a);
-                    model.indices.push_back(b);
-                    model.indices.push_back(c);
-                }
-            }
-        }
+// Run `fun` and record it when a log is open. `options` or `context` (for
+// its options and status) may be null.
+template <typename OPERAND, typename FUN>
+inline auto csgjs_record(CSGLogRecord::Operation operation, const OPERAND &a, const OPERAND *b,
+                         const CSGOptions *options, const CSGContext *context, FUN fun) -> decltype(fun()) {
+    if (!csgjs_recording.load(std::memory_order_relaxed))
+        return fun();
+
+    if (context && !options)
+        options = context->options;
+    auto      start = std::chrono::steady_clock::now();
+    LogBuffer record;
+    logwrite(record, (uint8_t)operation);
+    logwrite(record, logoperands(a));
+    logwrite(record, (uint8_t)(options != nullptr));
+    if (options) {
+        double deadline = -1;
+        if (options->deadline != std::chrono::steady_clock::time_point::max())
+            deadline = std::chrono::duration<double, std::milli>(options->deadline - start).count();
+        logwrite(record, deadline);
+        logwrite(record, (uint64_t)options->maxpolygons);
+        logwrite(record, (uint64_t)options->maxnodes);
+        logwrite(record, (uint64_t)options->maxdepth);
+        logwrite(record, (uint64_t)options->maxbytes);
+        logwrite(record, (uint8_t)options->mergecoplanar);
+        logwrite(record, options->snapgrid);
+        logwrite(record, (uint8_t)options->fixtjunctions);
     }
-    return model;
+    logwrite(record, a);
+    if (b)
+        logwrite(record, *b);
+
+    start = std::chrono::steady_clock::now();
+    auto   result = fun();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    logwrite(record, (uint8_t)logstatus(result, context));
+    logwrite(record, ms);
+
+    std::lock_guard<std::mutex> lock(csgjs_logmutex);
+    if (csgjs_log)
+        fwrite(record.data(), 1, record.size(), csgjs_log);
+    return result;
 }
 
-typedef CSGNode *csg_function(const CSGNode *a1, const CSGNode *b1);
+bool csgrecordstart(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    LogBuffer header(csgjs_logmagic, csgjs_logmagic + sizeof(csgjs_logmagic));
+    logwrite(header, csgjs_logversion);
+    logwrite(header, (uint32_t)sizeof(CSGJSCPP_REAL));
+    fwrite(header.data(), 1, header.size(), file);
+
+    std::lock_guard<std::mutex> lock(csgjs_logmutex);
+    if (csgjs_log)
+        fclose(csgjs_log);
+    csgjs_log = file;
+    csgjs_recording = true;
+    return true;
+}
 
-CSGJSCPP_VECTOR<Polygon> csgjs_operation(const CSGJSCPP_VECTOR<Polygon> &apoly, const CSGJSCPP_VECTOR<Polygon> &bpoly,
-                                         csg_function fun) {
+void csgrecordstop() {
+    std::lock_guard<std::mutex> lock(csgjs_logmutex);
+    csgjs_recording = false;
+    if (csgjs_log)
+        fclose(csgjs_log);
+    csgjs_log = nullptr;
+}
 
-    CSGNode A(apoly);
-    CSGNode B(bpoly);
+template <typename T> inline bool logread(FILE *file, T &value) {
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
 
-    /* create a unique pointer here so we can delete AB on exit */
-    CSGJSCPP_UNIQUEPTR<CSGNode> AB(fun(&A, &B));
-    return AB->allpolygons();
+// Reals are read at the size they were written with.
+inline bool logread(FILE *file, unsigned realsize, CSGJSCPP_REAL &value) {
+    if (realsize == sizeof(float)) {
+        float v;
+        if (!logread(file, v))
+            return false;
+        value = (CSGJSCPP_REAL)v;
+        return true;
+    }
+    double v;
+    if (realsize != sizeof(double) || !logread(file, v))
+        return false;
+    value = (CSGJSCPP_REAL)v;
+    return true;
 }
 
-inline CSGJSCPP_VECTOR<Polygon> csgjs_operation(const Model &a, const Model &b, csg_function fun) {
-    return csgjs_operation(modeltopolygons(a), modeltopolygons(b), fun);
+inline bool logread(FILE *file, unsigned realsize, Vertex &v) {
+    return logread(file, realsize, v.pos.x) && logread(file, realsize, v.pos.y) && logread(file, realsize, v.pos.z) &&
+           logread(file, realsize, v.normal.x) && logread(file, realsize, v.normal.y) &&
+           logread(file, realsize, v.normal.z) && logread(file, v.col);
 }
 
-CSGJSCPP_VECTOR<Polygon> csgpolygon_cube(const Vector &center, const Vector &dim, const uint32_t col) {
-    struct Quad {
-        int    indices[4];
-        Vector normal;
-    } quads[] = {{{0, 4, 6, 2}, {-1, 0, 0}}, {{1, 3, 7, 5}, {+1, 0, 0}}, {{0, 1, 5, 4}, {0, -1, 0}},
-                 {{2, 6, 7, 3}, {0, +1, 0}}, {{0, 2, 3, 1}, {0, 0, -1}}, {{4, 5, 7, 6}, {0, 0, +1}}};
+// Operands take `left`, the bytes left in the file, and count off what they
+// read. Counts are checked against it before anything is allocated, so a
+// damaged or forged log can't ask for more than the file could hold.
+inline bool logread(FILE *file, unsigned realsize, unsigned version, uint64_t &left,
+                    CSGJSCPP_VECTOR<Polygon> &polygons) {
+    uint64_t vertexbytes = 6 * realsize + sizeof(uint32_t), planebytes = version >= 3 ? 4 * realsize : 0;
+    uint32_t count;
+    if (left < sizeof(count) || !logread(file, count))
+        return false;
+    left -= sizeof(count);
+    if (count > left / (sizeof(uint32_t) + planebytes + 3 * vertexbytes))
+        return false;
+    polygons.clear();
+    polygons.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t                vertices;
+        Plane                   plane;
+        CSGJSCPP_VECTOR<Vertex> list;
+        if (left < sizeof(vertices) + planebytes || !logread(file, vertices) || vertices < 3)
+            return false;
+        left -= sizeof(vertices) + planebytes;
+        if (vertices > left / vertexbytes)
+            return false;
+        left -= vertices * vertexbytes;
+        if (version >= 3 && !(logread(file, realsize, plane.normal.x) && logread(file, realsize, plane.normal.y) &&
+                              logread(file, realsize, plane.normal.z) && logread(file, realsize, plane.w)))
+            return false;
+        list.resize(vertices);
+        for (auto &v : list) {
+            if (!logread(file, realsize, v))
+                return false;
+        }
+        polygons.push_back(Polygon(CSGJSCPP_MOVE(list)));
+        // older logs have only the vertices to go on.
+        if (version >= 3)
+            polygons.back().plane = plane;
+    }
+    return true;
+}
 
-    CSGJSCPP_VECTOR<Polygon> polygons;
-    for (const auto &q : quads) {
+inline bool logread(FILE *file, unsigned realsize, uint64_t &left, Model &model) {
+    uint64_t vertexbytes = 6 * realsize + sizeof(uint32_t);
+    uint32_t count;
+    if (left < sizeof(count) || !logread(file, count))
+        return false;
+    left -= sizeof(count);
+    if (count > left / vertexbytes)
+        return false;
+    left -= count * vertexbytes;
+    model.vertices.resize(count);
+    for (auto &v : model.vertices) {
+        if (!logread(file, realsize, v))
+            return false;
+    }
+    if (left < sizeof(count) || !logread(file, count))
+        return false;
+    left -= sizeof(count);
+    if (count > left / sizeof(uint32_t))
+        return false;
+    left -= count * sizeof(uint32_t);
+    model.indices.resize(count);
+    for (auto &i : model.indices) {
+        uint32_t index;
+        if (!logread(file, index) || index >= model.vertices.size())
+            return false;
+        i = (Model::Index)index;
+    }
+    return true;
+}
 
-        CSGJSCPP_VECTOR<Vertex> verts;
+CSGLogReader::CSGLogReader(const char *path) : file(fopen(path, "rb")), realsize(0), version(0), size(0) {
+    char     magic[sizeof(csgjs_logmagic)];
+    uint32_t found, real;
+    if (file && fread(magic, sizeof(magic), 1, (FILE *)file) == 1 && !memcmp(magic, csgjs_logmagic, sizeof(magic)) &&
+        logread((FILE *)file, found) && found >= 1 && found <= csgjs_logversion && logread((FILE *)file, real)) {
+        long start = ftell((FILE *)file);
+        if (start >= 0 && !fseek((FILE *)file, 0, SEEK_END)) {
+            long end = ftell((FILE *)file);
+            if (end >= start && !fseek((FILE *)file, start, SEEK_SET)) {
+                size = (uint64_t)end;
+                realsize = real;
+                version = found;
+            }
+        }
+    }
+}
 
-        for (auto i : q.indices) {
-            Vector pos(center.x + dim.x * (2.0f * !!(i & 1) - 1), center.y + dim.y * (2.0f * !!(i & 2) - 1),
-                       center.z + dim.z * (2.0f * !!(i & 4) - 1));
+CSGLogReader::~CSGLogReader() {
+    if (file)
+        fclose((FILE *)file);
+}
 
-            verts.push_back({pos, q.normal, col});
-        }
-        polygons.push_back(Polygon(verts));
+bool CSGLogReader::ok() const {
+    return file && (realsize == sizeof(float) || realsize == sizeof(double));
+}
+
+bool CSGLogReader::next(CSGLogRecord &record) {
+    if (!ok())
+        return false;
+    FILE *  f = (FILE *)file;
+    uint8_t operation, operands, status, hasoptions;
+    if (!logread(f, operation) || !logread(f, operands) || !logread(f, hasoptions) ||
+        operation > CSGLogRecord::FIXTJUNC || operands > CSGLogRecord::TREES)
+        return false;
+    record.operation = (CSGLogRecord::Operation)operation;
+    record.operands = (CSGLogRecord::Operands)operands;
+    record.hasoptions = hasoptions != 0;
+    record.options = CSGOptions();
+    record.deadlinems = -1;
+    if (record.hasoptions) {
+        uint64_t budgets[4];
+        uint8_t  merge;
+        if (!logread(f, record.deadlinems) || fread(budgets, sizeof(budgets), 1, f) != 1 || !logread(f, merge) ||
+            !logread(f, realsize, record.options.snapgrid))
+            return false;
+        record.options.maxpolygons = (size_t)budgets[0];
+        record.options.maxnodes = (size_t)budgets[1];
+        record.options.maxdepth = (size_t)budgets[2];
+        record.options.maxbytes = (size_t)budgets[3];
+        record.options.mergecoplanar = merge != 0;
+        uint8_t fix = 0;
+        if (version >= 2 && !logread(f, fix))
+            return false;
+        record.options.fixtjunctions = fix != 0;
     }
-    return polygons;
+
+    record.a.clear();
+    record.b.clear();
+    record.modela = Model();
+    record.modelb = Model();
+    long at = ftell(f);
+    if (at < 0 || (uint64_t)at > size)
+        return false;
+    uint64_t left = size - (uint64_t)at;
+    bool     binary = record.operation != CSGLogRecord::FIXTJUNC;
+    if (record.operands == CSGLogRecord::MODELS) {
+        if (!logread(f, realsize, left, record.modela) || (binary && !logread(f, realsize, left, record.modelb)))
+            return false;
+    } else if (!logread(f, realsize, version, left, record.a) ||
+               (binary && !logread(f, realsize, version, left, record.b))) {
+        return false;
+    }
+    if (!logread(f, status) || !logread(f, record.milliseconds))
+        return false;
+    record.status = (CSGStatus)status;
+    return true;
 }
 
-Model csgmodel_cube(const Vector &center, const Vector &dim, uint32_t col) {
+Model csgunion(const Model &a, const Model &b) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, nullptr, nullptr, [&] { return csgjs_operation(a, b, csg_union); });
+}
+
+Model csgintersection(const Model &a, const Model &b) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, nullptr, nullptr,
+                        [&] { return csgjs_operation(a, b, csg_intersect); });
+}
 
-    return modelfrompolygons(csgpolygon_cube(center, dim, col));
+Model csgsubtract(const Model &a, const Model &b) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, nullptr, nullptr,
+                        [&] { return csgjs_operation(a, b, csg_subtract); });
 }
 
-CSGJSCPP_VECTOR<Polygon> csgpolygon_sphere(const Vector &c, CSGJSCPP_REAL r, uint32_t col, int slices, int stacks) {
-    CSGJSCPP_VECTOR<Polygon> polygons;
+Model csgunion(const Model &a, const Model &b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_union, context); });
+}
 
-    auto mkvertex = [c, r, col](CSGJSCPP_REAL theta, CSGJSCPP_REAL phi) -> Vertex {
-        theta *= (CSGJSCPP_REAL)M_PI * 2;
-        phi *= (CSGJSCPP_REAL)M_PI;
-        Vector dir((CSGJSCPP_REAL)cos(theta) * (CSGJSCPP_REAL)sin(phi), (CSGJSCPP_REAL)cos(phi),
-                   (CSGJSCPP_REAL)sin(theta) * (CSGJSCPP_REAL)sin(phi));
+Model csgintersection(const Model &a, const Model &b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_intersect, context); });
+}
 
-        return Vertex{c + (dir * r), dir, col};
-    };
-    for (CSGJSCPP_REAL i = 0; i < slices; i++) {
-        for (CSGJSCPP_REAL j = 0; j < stacks; j++) {
+Model csgsubtract(const Model &a, const Model &b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_subtract, context); });
+}
 
-            CSGJSCPP_VECTOR<Vertex> vertices;
+CSGNode *csgunion(const CSGNode *a, const CSGNode *b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, nullptr, &context, [&] {
+        context.begin(5);
+        CSGNode *ret = snaptree(fixsplits(csg_union(a, b, context), context), context);
+        // rebuilding splits some polygons again.
+        ret = fixsplits(csg_rebuild(ret, context), context);
+        if (context.status != CSG_OK) {
+            context.release(ret);
+            ret = nullptr;
+        }
+        context.finish();
+        return ret;
+    });
+}
 
-            vertices.push_back(mkvertex(i / slices, j / stacks));
-            if (j > 0) {
-                vertices.push_back(mkvertex((i + 1) / slices, j / stacks));
-            }
-            if (j < stacks - 1) {
-                vertices.push_back(mkvertex((i + 1) / slices, (j + 1) / stacks));
-            }
-            vertices.push_back(mkvertex(i / slices, (j + 1) / stacks));
-            polygons.push_back(Polygon(vertices));
+CSGNode *csgintersection(const CSGNode *a, const CSGNode *b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, nullptr, &context, [&] {
+        context.begin(5);
+        CSGNode *ret = snaptree(fixsplits(csg_intersect(a, b, context), context), context);
+        // rebuilding splits some polygons again.
+        ret = fixsplits(csg_rebuild(ret, context), context);
+        if (context.status != CSG_OK) {
+            context.release(ret);
+            ret = nullptr;
         }
-    }
-    return polygons;
+        context.finish();
+        return ret;
+    });
 }
 
-Model csgmodel_sphere(const Vector &c, CSGJSCPP_REAL r, uint32_t col, int slices, int stacks) {
+CSGNode *csgsubtract(const CSGNode *a, const CSGNode *b, CSGContext &context) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, nullptr, &context, [&] {
+        context.begin(5);
+        CSGNode *ret = snaptree(fixsplits(csg_subtract(a, b, context), context), context);
+        // rebuilding splits some polygons again.
+        ret = fixsplits(csg_rebuild(ret, context), context);
+        if (context.status != CSG_OK) {
+            context.release(ret);
+            ret = nullptr;
+        }
+        context.finish();
+        return ret;
+    });
+}
 
-    return modelfrompolygons(csgpolygon_sphere(c, r, col, slices, stacks));
+CSGNode *csgunion(const CSGNode *a, const CSGNode *b) {
+    CSGContext context;
+    return csgunion(a, b, context);
 }
 
-CSGJSCPP_VECTOR<Polygon> csgpolygon_cylinder(const Vector &s, const Vector &e, CSGJSCPP_REAL r, uint32_t col,
-                                             int slices) {
-    Vector ray = e - s;
+CSGNode *csgintersection(const CSGNode *a, const CSGNode *b) {
+    CSGContext context;
+    return csgintersection(a, b, context);
+}
 
-    Vector axisZ = unit(ray);
-    bool   isY = fabs(axisZ.y) > 0.5f;
-    Vector axisX = unit(cross(Vector(isY, !isY, 0), axisZ));
-    Vector axisY = unit(cross(axisX, axisZ));
+CSGNode *csgsubtract(const CSGNode *a, const CSGNode *b) {
+    CSGContext context;
+    return csgsubtract(a, b, context);
+}
 
-    Vertex start{s, -axisZ, col};
-    Vertex end{e, unit(axisZ), col};
+CSGJSCPP_VECTOR<Polygon> csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, nullptr, nullptr, [&] { return csgjs_operation(a, b, csg_union); });
+}
 
-    CSGJSCPP_VECTOR<Polygon> polygons;
+CSGJSCPP_VECTOR<Polygon> csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, nullptr, nullptr,
+                        [&] { return csgjs_operation(a, b, csg_intersect); });
+}
 
-    auto point = [axisX, axisY, s, r, ray, axisZ, col](CSGJSCPP_REAL stack, CSGJSCPP_REAL slice,
-                                                       CSGJSCPP_REAL normalBlend) -> Vertex {
-        CSGJSCPP_REAL angle = slice * (CSGJSCPP_REAL)M_PI * 2;
-        Vector        out = axisX * (CSGJSCPP_REAL)cos(angle) + axisY * (CSGJSCPP_REAL)sin(angle);
-        Vector        pos = s + ray * stack + out * r;
-        Vector        normal = out * (1.0f - (CSGJSCPP_REAL)fabs(normalBlend)) + axisZ * normalBlend;
-        return Vertex{pos, normal, col};
-    };
+CSGJSCPP_VECTOR<Polygon> csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, nullptr, nullptr,
+                        [&] { return csgjs_operation(a, b, csg_subtract); });
+}
 
-    for (CSGJSCPP_REAL i = 0; i < slices; i++) {
-        CSGJSCPP_REAL t0 = i / slices;
-        CSGJSCPP_REAL t1 = (i + 1) / slices;
-        polygons.push_back(Polygon({start, point(0, t0, -1), point(0, t1, -1)}));
-        polygons.push_back(Polygon({point(0, t1, 0), point(0, t0, 0), point(1, t0, 0), point(1, t1, 0)}));
-        polygons.push_back(Polygon({end, point(1, t1, 1), point(1, t0, 1)}));
-    }
-    return polygons;
+CSGJSCPP_VECTOR<Polygon> csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                  CSGContext &context) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_union, context); });
 }
 
-Model csgmodel_cylinder(const Vector &s, const Vector &e, CSGJSCPP_REAL r, uint32_t col, int slices) {
+CSGJSCPP_VECTOR<Polygon> csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                         CSGContext &context) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_intersect, context); });
+}
 
-    return modelfrompolygons(csgpolygon_cylinder(s, e, r, col, slices));
+CSGJSCPP_VECTOR<Polygon> csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                                     CSGContext &context) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, nullptr, &context,
+                        [&] { return csgjs_operation(a, b, csg_subtract, context); });
 }
 
-Model csgunion(const Model &a, const Model &b) {
-    return modelfrompolygons(csgjs_operation(a, b, csg_union));
+CSGStatus csgunion(const Model &a, const Model &b, Model &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_union, options); });
 }
 
-Model csgintersection(const Model &a, const Model &b) {
-    return modelfrompolygons(csgjs_operation(a, b, csg_intersect));
+CSGStatus csgintersection(const Model &a, const Model &b, Model &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_intersect, options); });
 }
 
-Model csgsubtract(const Model &a, const Model &b) {
-    return modelfrompolygons(csgjs_operation(a, b, csg_subtract));
+CSGStatus csgsubtract(const Model &a, const Model &b, Model &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_subtract, options); });
 }
 
-CSGJSCPP_VECTOR<Polygon> csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
-    return csgjs_operation(a, b, csg_union);
+CSGStatus csgunion(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                   CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::UNION, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_union, options); });
 }
 
-CSGJSCPP_VECTOR<Polygon> csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
-    return csgjs_operation(a, b, csg_intersect);
+CSGStatus csgintersection(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                          CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::INTERSECTION, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_intersect, options); });
 }
 
-CSGJSCPP_VECTOR<Polygon> csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b) {
-    return csgjs_operation(a, b, csg_subtract);
+CSGStatus csgsubtract(const CSGJSCPP_VECTOR<Polygon> &a, const CSGJSCPP_VECTOR<Polygon> &b,
+                      CSGJSCPP_VECTOR<Polygon> &out, const CSGOptions &options) {
+    return csgjs_record(CSGLogRecord::SUBTRACT, a, &b, &options, nullptr,
+                        [&] { return csgjs_operation(a, b, out, csg_subtract, options); });
 }
 
 
@@ -918,7 +4652,8 @@ This function will return a new solid with ACDB replaced by ACDEB
 Note that this can create polygons that are slightly non-convex (due to rounding errors). Therefore the result should
 not be used for further CSG operations!
 */
- CSGJSCPP_VECTOR<Polygon> csgfixtjunc(const CSGJSCPP_VECTOR<Polygon> &originalpolygons){
+// `context` may be null, when stopped through it the result is empty.
+inline CSGJSCPP_VECTOR<Polygon> fixtjunc(const CSGJSCPP_VECTOR<Polygon> &originalpolygons, CSGContext *context) {
     
 
 	 //were going to need unique vertices so while we're at it
@@ -926,7 +4661,7 @@ not be used for further CSG operations!
 	 //with indexes into this list, we can use those indexes as
 	 //unique vertex id's in the core of the algo.
 	 struct IndexedVertex {
-		 Vertex vertex;
+		 PolygonVertex vertex;
 		 size_t index; //index in to the vextor this vertex is in, also used as the unique tag.
 	 };
 
@@ -945,6 +4680,8 @@ not be used for further CSG operations!
 	};
 	CSGJSCPP_VECTOR<IndexPolygon> polygons;
 	for (const auto &originalpoly : originalpolygons) {
+		if (context && context->poll())
+			return CSGJSCPP_VECTOR<Polygon>();
 		IndexPolygon ipoly;
 		for (const auto &v : originalpoly.vertices) {
 			auto pos = CSGJSCPP_FIND_IF(uvertices.begin(), uvertices.end(), [v](const IndexedVertex &a) {return a.vertex == v; });
@@ -1126,6 +4863,8 @@ not be used for further CSG operations!
             }
             bool donesomething = false;
             while (false == sidestocheck.empty()) {
+                if (context && context->poll())
+                    return CSGJSCPP_VECTOR<Polygon>();
 
                 SideTag sidetagtocheck = sidestocheck.front();
 				sidestocheck.pop_front();
@@ -1234,18 +4973,48 @@ not be used for further CSG operations!
     }
 
 	CSGJSCPP_VECTOR<Polygon> outpolys;
-	for (const auto &indexedpoly : polygons) {
+	for (size_t k = 0; k < polygons.size(); k++) {
 		Polygon p;
-		for (auto i : indexedpoly.vertexindex) {
+		for (auto i : polygons[k].vertexindex) {
 			p.vertices.push_back(uvertices[i].vertex);
 		}
 		assert(p.vertices.size() > 2 && "logic error");
 		p.plane = Plane(p.vertices[0].pos, p.vertices[1].pos, p.vertices[2].pos);
+		copyattributes(p, originalpolygons[k]);
 		outpolys.push_back(p);
 	}
     return outpolys;
 }
 
+CSGJSCPP_VECTOR<Polygon> csgsnap(const CSGJSCPP_VECTOR<Polygon> &polygons, CSGJSCPP_REAL grid, CSGSnapStats *stats) {
+    CSGJSCPP_VECTOR<Polygon> ret = polygons;
+    CSGSnapStats             counts;
+    snappolygons(ret, grid, counts, nullptr);
+    if (stats)
+        *stats = counts;
+    return ret;
+}
+
+CSGJSCPP_VECTOR<Polygon> csgfixtjunc(const CSGJSCPP_VECTOR<Polygon> &polygons) {
+    return csgjs_record(CSGLogRecord::FIXTJUNC, polygons, (const CSGJSCPP_VECTOR<Polygon> *)nullptr, nullptr,
+                        nullptr, [&] { return fixtjunc(polygons, nullptr); });
+}
+
+CSGStatus csgfixtjunc(const CSGJSCPP_VECTOR<Polygon> &polygons, CSGJSCPP_VECTOR<Polygon> &out,
+                      const CSGOptions &options) {
+    CSGContext context;
+    context.options = &options;
+    context.begin(1);
+    CSGJSCPP_VECTOR<Polygon> result = csgjs_record(CSGLogRecord::FIXTJUNC, polygons,
+                                                   (const CSGJSCPP_VECTOR<Polygon> *)nullptr, nullptr, &context,
+                                                   [&] { return fixtjunc(polygons, &context); });
+    if (context.status == CSG_OK) {
+        out = CSGJSCPP_MOVE(result);
+        context.advance();
+    }
+    return context.status;
+}
+
 
 
 
@@ -1259,7 +5028,681 @@ not be used for further CSG operations!
 
 
 
-} // namespace csgjscpp
+// Tree files, see csgsavetree(). A header, then the nodes, the polygons and
+// the vertices as flat arrays. Children and polygon ranges are indices, 0 is no
+// child and otherwise the child is at index - 1. The root is node 0. The
+// header is a multiple of 8 bytes long and the node and polygon records a
+// multiple of the alignment of CSGJSCPP_REAL (the vertices come last, 28 bytes
+// each with floats), so the arrays of a page aligned mapping can be read in
+// place.
+static const char     csgjs_treemagic[8] = {'C', 'S', 'G', 'J', 'S', 'B', 'S', 'P'};
+static const uint32_t csgjs_treeversion = 2;
+static const uint32_t csgjs_treebyteorder = 0x01020304;
+static const uint32_t csgjs_treeconvex = 1;
+static const uint32_t csgjs_treeinverted = 2;
+
+struct TreeFileHeader {
+    char     magic[8];
+    uint32_t version, realsize, byteorder, flags;
+    uint64_t nodes, polygons, vertices;
+};
+
+struct TreeFileNode {
+    CSGJSCPP_REAL plane[4];
+    uint32_t      front, back;
+    uint32_t      firstpolygon, polygons;
+};
+
+struct TreeFilePolygon {
+    CSGJSCPP_REAL plane[4];
+    uint32_t      firstvertex, vertices;
+};
+
+struct TreeFileVertex {
+    CSGJSCPP_REAL pos[3], normal[3];
+    uint32_t      col;
+};
+
+static_assert(sizeof(TreeFileHeader) % 8 == 0, "tree file arrays must start aligned");
+static_assert(sizeof(TreeFileNode) % alignof(CSGJSCPP_REAL) == 0 &&
+                  sizeof(TreeFilePolygon) % alignof(CSGJSCPP_REAL) == 0,
+              "tree file arrays must start aligned");
+
+bool csgsavetree(const CSGNode *tree, const char *path) {
+    if (!tree)
+        return false;
+
+    // nodes are numbered breadth first as they are found.
+    CSGJSCPP_VECTOR<const CSGNode *> nodes(1, tree);
+    CSGJSCPP_VECTOR<TreeFileNode>    filenodes;
+    CSGJSCPP_VECTOR<TreeFilePolygon> filepolygons;
+    CSGJSCPP_VECTOR<TreeFileVertex>  filevertices;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const CSGNode *me = nodes[i];
+        TreeFileNode   node = {{me->plane.normal.x, me->plane.normal.y, me->plane.normal.z, me->plane.w}, 0, 0,
+                             (uint32_t)filepolygons.size(), (uint32_t)me->polygons.size()};
+        if (me->front) {
+            nodes.push_back(me->front);
+            node.front = (uint32_t)nodes.size();
+        }
+        if (me->back) {
+            nodes.push_back(me->back);
+            node.back = (uint32_t)nodes.size();
+        }
+        filenodes.push_back(node);
+
+        for (const auto &poly : me->polygons) {
+            filepolygons.push_back(
+                TreeFilePolygon{{poly.plane.normal.x, poly.plane.normal.y, poly.plane.normal.z, poly.plane.w},
+                                (uint32_t)filevertices.size(),
+                                (uint32_t)poly.vertices.size()});
+            for (size_t j = 0; j < poly.vertices.size(); j++) {
+                Vertex v = polygonvertex(poly, j);
+                filevertices.push_back(
+                    TreeFileVertex{{v.pos.x, v.pos.y, v.pos.z}, {v.normal.x, v.normal.y, v.normal.z}, v.col});
+            }
+        }
+    }
+
+    TreeFileHeader header;
+    memcpy(header.magic, csgjs_treemagic, sizeof(header.magic));
+    header.version = csgjs_treeversion;
+    header.realsize = sizeof(CSGJSCPP_REAL);
+    header.byteorder = csgjs_treebyteorder;
+    header.flags = (tree->convex ? csgjs_treeconvex : 0) | (tree->inverted ? csgjs_treeinverted : 0);
+    header.nodes = filenodes.size();
+    header.polygons = filepolygons.size();
+    header.vertices = filevertices.size();
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(filenodes.data(), sizeof(TreeFileNode), filenodes.size(), file) == filenodes.size() &&
+                   fwrite(filepolygons.data(), sizeof(TreeFilePolygon), filepolygons.size(), file) ==
+                       filepolygons.size() &&
+                   fwrite(filevertices.data(), sizeof(TreeFileVertex), filevertices.size(), file) ==
+                       filevertices.size();
+    return fclose(file) == 0 && written;
+}
+
+// How the clipping walk reads a mapped tree, nodes are indices + 1. Inverted
+// as NodeTree.
+struct MappedTree {
+    typedef uint32_t Node;
+
+    const TreeFileNode *nodes;
+    bool                inverted;
+
+    bool ok(Node me) const {
+        return me != 0;
+    }
+    Plane plane(Node me) const {
+        const CSGJSCPP_REAL *p = nodes[me - 1].plane;
+        Plane                ret;
+        ret.normal = Vector(p[0], p[1], p[2]);
+        ret.w = p[3];
+        if (inverted)
+            ret.flip();
+        return ret;
+    }
+    Node front(Node me) const {
+        return inverted ? nodes[me - 1].back : nodes[me - 1].front;
+    }
+    Node back(Node me) const {
+        return inverted ? nodes[me - 1].front : nodes[me - 1].back;
+    }
+};
+
+// Map a whole file read only, `data` stays null when it can't be.
+static void mapfile(const char *path, const char *&data, size_t &size, void *&mapping) {
+#if defined(_WIN32)
+    HANDLE file =
+        CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            size = data ? (size_t)length.QuadPart : 0;
+        }
+    }
+    CloseHandle(file);
+#else
+    (void)mapping;
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+        return;
+    struct stat info;
+    if (fstat(file, &info) == 0 && info.st_size > 0) {
+        void *view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+        if (view != MAP_FAILED) {
+            data = (const char *)view;
+            size = (size_t)info.st_size;
+        }
+    }
+    close(file);
+#endif
+}
+
+static void unmapfile(const char *data, size_t size, void *mapping) {
+#if defined(_WIN32)
+    (void)size;
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle((HANDLE)mapping);
+#else
+    (void)mapping;
+    if (data)
+        munmap((void *)data, size);
+#endif
+}
+
+CSGMappedTree::CSGMappedTree(const char *path) : data(nullptr), size(0), mapping(nullptr), valid(false) {
+    mapfile(path, data, size, mapping);
+    if (!data || size < sizeof(TreeFileHeader))
+        return;
+
+    const TreeFileHeader *header = (const TreeFileHeader *)data;
+    if (memcmp(header->magic, csgjs_treemagic, sizeof(header->magic)) || header->version != csgjs_treeversion ||
+        header->realsize != sizeof(CSGJSCPP_REAL) || header->byteorder != csgjs_treebyteorder ||
+        (header->flags & ~(csgjs_treeconvex | csgjs_treeinverted)) || !header->nodes || header->nodes >= UINT32_MAX ||
+        header->polygons >= UINT32_MAX || header->vertices >= UINT32_MAX)
+        return;
+    uint64_t length = sizeof(TreeFileHeader) + header->nodes * sizeof(TreeFileNode) +
+                      header->polygons * sizeof(TreeFilePolygon) + header->vertices * sizeof(TreeFileVertex);
+    if (length != size)
+        return;
+
+    // children are numbered after their parent, which rules out cycles, and
+    // polygon ranges stay inside the file. Vertex ranges are checked by load().
+    const TreeFileNode *nodes = (const TreeFileNode *)(header + 1);
+    for (uint64_t i = 0; i < header->nodes; i++) {
+        const TreeFileNode &me = nodes[i];
+        if ((me.front && (me.front <= i + 1 || me.front > header->nodes)) ||
+            (me.back && (me.back <= i + 1 || me.back > header->nodes)) ||
+            (uint64_t)me.firstpolygon + me.polygons > header->polygons)
+            return;
+    }
+    valid = true;
+}
+
+CSGMappedTree::~CSGMappedTree() {
+    unmapfile(data, size, mapping);
+}
+
+bool CSGMappedTree::ok() const {
+    return valid;
+}
+
+size_t CSGMappedTree::nodecount() const {
+    return ok() ? (size_t)((const TreeFileHeader *)data)->nodes : 0;
+}
+
+size_t CSGMappedTree::polygoncount() const {
+    return ok() ? (size_t)((const TreeFileHeader *)data)->polygons : 0;
+}
+
+CSGJSCPP_VECTOR<Polygon> CSGMappedTree::clippolygons(const CSGJSCPP_VECTOR<Polygon> &list, CSGContext &context) const {
+    if (!ok())
+        return list;
+    const TreeFileHeader *header = (const TreeFileHeader *)data;
+    MappedTree tree = {(const TreeFileNode *)(header + 1), (header->flags & csgjs_treeinverted) != 0};
+    return clippolygonsdepthfirst(tree, 1, list, context);
+}
+
+CSGJSCPP_VECTOR<Polygon> CSGMappedTree::clippolygons(const CSGJSCPP_VECTOR<Polygon> &list) const {
+    CSGContext context;
+    return clippolygons(list, context);
+}
+
+CSGNode *CSGMappedTree::load(CSGContext &context) const {
+    if (!ok())
+        return nullptr;
+    const TreeFileHeader * header = (const TreeFileHeader *)data;
+    const TreeFileNode *   filenodes = (const TreeFileNode *)(header + 1);
+    const TreeFilePolygon *filepolygons = (const TreeFilePolygon *)(filenodes + header->nodes);
+    const TreeFileVertex * filevertices = (const TreeFileVertex *)(filepolygons + header->polygons);
+
+    // a node with two parents would be freed twice.
+    CSGJSCPP_VECTOR<CSGNode *> nodes((size_t)header->nodes);
+    CSGJSCPP_VECTOR<bool>      parented(nodes.size(), false);
+    for (auto &node : nodes)
+        node = context.newnode();
+    bool loaded = true;
+    for (size_t i = 0; i < nodes.size() && loaded; i++) {
+        const TreeFileNode &from = filenodes[i];
+        CSGNode *           me = nodes[i];
+        loaded = !(from.front && parented[from.front - 1]) && !(from.back && parented[from.back - 1]) &&
+                 !(from.front && from.front == from.back);
+        if (!loaded)
+            break;
+        if (from.front)
+            parented[from.front - 1] = true;
+        if (from.back)
+            parented[from.back - 1] = true;
+        me->plane.normal = Vector(from.plane[0], from.plane[1], from.plane[2]);
+        me->plane.w = from.plane[3];
+        me->front = from.front ? nodes[from.front - 1] : nullptr;
+        me->back = from.back ? nodes[from.back - 1] : nullptr;
+
+        me->polygons.reserve(from.polygons);
+        for (uint32_t j = 0; j < from.polygons && loaded; j++) {
+            const TreeFilePolygon &poly = filepolygons[from.firstpolygon + j];
+            loaded = poly.vertices >= 3 && (uint64_t)poly.firstvertex + poly.vertices <= header->vertices;
+            if (!loaded)
+                break;
+            CSGJSCPP_VECTOR<Vertex> list(poly.vertices);
+            for (uint32_t k = 0; k < poly.vertices; k++) {
+                const TreeFileVertex &v = filevertices[poly.firstvertex + k];
+                list[k] = Vertex{Vector(v.pos[0], v.pos[1], v.pos[2]), Vector(v.normal[0], v.normal[1], v.normal[2]),
+                                 v.col};
+            }
+            me->polygons.push_back(Polygon(CSGJSCPP_MOVE(list)));
+            me->polygons.back().plane.normal = Vector(poly.plane[0], poly.plane[1], poly.plane[2]);
+            me->polygons.back().plane.w = poly.plane[3];
+        }
+    }
+
+    // nodes are handed back one by one, a damaged file may not be one tree.
+    if (!loaded) {
+        for (auto node : nodes) {
+            node->front = node->back = nullptr;
+            context.release(node);
+        }
+        return nullptr;
+    }
+    nodes[0]->convex = (header->flags & csgjs_treeconvex) != 0;
+    nodes[0]->inverted = (header->flags & csgjs_treeinverted) != 0;
+    updatebounds(nodes[0]);
+    return nodes[0];
+}
+
+CSGNode *CSGMappedTree::load() const {
+    CSGContext context;
+    return load(context);
+}
+
+// Model files are a header and then the vertex and the index streams. Vertices
+// are fixed size records (position, normal, colour), quantized fields are
+// 3 x uint16 + padding for positions and an OctNormal for normals. Indices are
+// uint32, zigzag deltas as LEB128 varints, or meshoptimizer's encodings.
+static const char     csgjs_modelmagic[8] = {'C', 'S', 'G', 'J', 'S', 'M', 'D', 'L'};
+static const uint32_t csgjs_modelversion = 1;
+static const uint32_t csgjs_modelquantizepositions = 1;
+static const uint32_t csgjs_modelquantizenormals = 2;
+static const uint32_t csgjs_modeldeltaindices = 4;
+static const uint32_t csgjs_modelmeshopt = 8;
+
+struct ModelFileHeader {
+    char          magic[8];
+    uint32_t      version, realsize, byteorder, flags;
+    uint32_t      stride, reserved;
+    uint64_t      vertices, indices;
+    uint64_t      vertexbytes, indexbytes;
+    CSGJSCPP_REAL boundsmin[3], boundsmax[3];
+};
 
+static uint32_t modelstride(uint32_t flags) {
+    uint32_t stride = (flags & csgjs_modelquantizepositions) ? 4 * sizeof(uint16_t) : 3 * sizeof(CSGJSCPP_REAL);
+    stride += (flags & csgjs_modelquantizenormals) ? sizeof(OctNormal) : 3 * sizeof(CSGJSCPP_REAL);
+    return stride + sizeof(uint32_t);
+}
+
+// The size of one quantization step on each axis.
+static Vector modelstep(const ModelFileHeader &header) {
+    return Vector(header.boundsmax[0] - header.boundsmin[0], header.boundsmax[1] - header.boundsmin[1],
+                  header.boundsmax[2] - header.boundsmin[2]) /
+           65535;
+}
+
+static void packmodelvertex(const Vertex &v, const ModelFileHeader &header, const Vector &step, char *out) {
+    if (header.flags & csgjs_modelquantizepositions) {
+        const CSGJSCPP_REAL p[] = {v.pos.x, v.pos.y, v.pos.z}, s[] = {step.x, step.y, step.z};
+        uint16_t            q[4] = {0, 0, 0, 0};
+        for (int i = 0; i < 3; i++)
+            q[i] = s[i] > 0
+                       ? (uint16_t)std::min<CSGJSCPP_REAL>(floor((p[i] - header.boundsmin[i]) / s[i] + 0.5f), 65535)
+                       : 0;
+        memcpy(out, q, sizeof(q));
+        out += sizeof(q);
+    } else {
+        memcpy(out, &v.pos, sizeof(v.pos));
+        out += sizeof(v.pos);
+    }
+    if (header.flags & csgjs_modelquantizenormals) {
+        OctNormal n(v.normal);
+        memcpy(out, &n, sizeof(n));
+        out += sizeof(n);
+    } else {
+        memcpy(out, &v.normal, sizeof(v.normal));
+        out += sizeof(v.normal);
+    }
+    memcpy(out, &v.col, sizeof(v.col));
+}
+
+static Vertex unpackmodelvertex(const char *in, const ModelFileHeader &header, const Vector &step) {
+    Vertex v;
+    if (header.flags & csgjs_modelquantizepositions) {
+        uint16_t q[4];
+        memcpy(q, in, sizeof(q));
+        in += sizeof(q);
+        v.pos = Vector(header.boundsmin[0] + q[0] * step.x, header.boundsmin[1] + q[1] * step.y,
+                       header.boundsmin[2] + q[2] * step.z);
+    } else {
+        memcpy(&v.pos, in, sizeof(v.pos));
+        in += sizeof(v.pos);
+    }
+    if (header.flags & csgjs_modelquantizenormals) {
+        OctNormal n;
+        memcpy(&n, in, sizeof(n));
+        in += sizeof(n);
+        v.normal = n;
+    } else {
+        memcpy(&v.normal, in, sizeof(v.normal));
+        in += sizeof(v.normal);
+    }
+    memcpy(&v.col, in, sizeof(v.col));
+    return v;
+}
+
+bool csgsavemodel(const Model &model, const char *path, const CSGModelFileOptions &options) {
+    ModelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, csgjs_modelmagic, sizeof(header.magic));
+    header.version = csgjs_modelversion;
+    header.realsize = sizeof(CSGJSCPP_REAL);
+    header.byteorder = csgjs_treebyteorder;
+    header.flags = (options.quantizepositions ? csgjs_modelquantizepositions : 0) |
+                   (options.quantizenormals ? csgjs_modelquantizenormals : 0);
+    header.stride = modelstride(header.flags);
+    header.vertices = model.vertices.size();
+    header.indices = model.indices.size();
+    for (size_t i = 0; i < model.vertices.size(); i++) {
+        const Vector &p = model.vertices[i].pos;
+        const CSGJSCPP_REAL c[] = {p.x, p.y, p.z};
+        for (int j = 0; j < 3; j++) {
+            header.boundsmin[j] = i == 0 ? c[j] : std::min(header.boundsmin[j], c[j]);
+            header.boundsmax[j] = i == 0 ? c[j] : std::max(header.boundsmax[j], c[j]);
+        }
+    }
+
+    Vector    step = modelstep(header);
+    LogBuffer vertices(model.vertices.size() * header.stride);
+    for (size_t i = 0; i < model.vertices.size(); i++)
+        packmodelvertex(model.vertices[i], header, step, vertices.data() + i * header.stride);
+
+    LogBuffer indices;
+#if defined(CSGJSCPP_USE_MESHOPTIMIZER)
+    // the index codec only takes triangle lists.
+    if (options.compress && model.indices.size() % 3 == 0) {
+        header.flags |= csgjs_modelmeshopt;
+        LogBuffer encoded(meshopt_encodeVertexBufferBound(model.vertices.size(), header.stride));
+        encoded.resize(meshopt_encodeVertexBuffer((unsigned char *)encoded.data(), encoded.size(), vertices.data(),
+                                                  model.vertices.size(), header.stride));
+        vertices.swap(encoded);
+
+        CSGJSCPP_VECTOR<uint32_t> list(model.indices.begin(), model.indices.end());
+        indices.resize(meshopt_encodeIndexBufferBound(list.size(), model.vertices.size()));
+        indices.resize(meshopt_encodeIndexBuffer((unsigned char *)indices.data(), indices.size(), list.data(),
+                                                 list.size()));
+    }
+#endif
+    if (options.compress && !(header.flags & csgjs_modelmeshopt)) {
+        header.flags |= csgjs_modeldeltaindices;
+        int64_t last = 0;
+        for (Model::Index index : model.indices) {
+            int64_t  delta = (int64_t)index - last;
+            uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+            last = (int64_t)index;
+            do {
+                indices.push_back((char)((zigzag & 0x7f) | (zigzag > 0x7f ? 0x80 : 0)));
+                zigzag >>= 7;
+            } while (zigzag);
+        }
+    } else if (!options.compress) {
+        for (Model::Index index : model.indices)
+            logwrite(indices, (uint32_t)index);
+    }
+    header.vertexbytes = vertices.size();
+    header.indexbytes = indices.size();
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(vertices.data(), 1, vertices.size(), file) == vertices.size() &&
+                   fwrite(indices.data(), 1, indices.size(), file) == indices.size();
+    return fclose(file) == 0 && written;
+}
+
+bool csgsavemodel(const Model &model, const char *path) {
+    return csgsavemodel(model, path, CSGModelFileOptions());
+}
+
+// Decodes straight out of the mapping, meshoptimizer streams are decoded whole
+// and then unpacked.
+static bool decodemodel(const char *data, size_t size, Model &model) {
+    if (!data || size < sizeof(ModelFileHeader))
+        return false;
+    ModelFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, csgjs_modelmagic, sizeof(header.magic)) || header.version != csgjs_modelversion ||
+        header.realsize != sizeof(CSGJSCPP_REAL) || header.byteorder != csgjs_treebyteorder ||
+        header.stride != modelstride(header.flags) || header.vertices > UINT32_MAX ||
+        header.indices > UINT32_MAX || header.vertexbytes > size || header.indexbytes > size ||
+        sizeof(header) + header.vertexbytes + header.indexbytes != size)
+        return false;
+#if !defined(CSGJSCPP_USE_MESHOPTIMIZER)
+    if (header.flags & csgjs_modelmeshopt)
+        return false;
+#endif
+
+    // the counts are checked against the bytes that hold them before anything
+    // is allocated, so a forged header can't ask for more than its file holds.
+    if (header.flags & csgjs_modelmeshopt) {
+        // the vertex codec spends at least 2 header bits on each group of 16
+        // bytes, so 1024 leaves room over its best case; the index codec spends
+        // at least a byte on each triangle.
+        if (header.vertices * header.stride > header.vertexbytes * 1024 || header.indices % 3 ||
+            header.indices / 3 > header.indexbytes)
+            return false;
+    } else if (header.vertexbytes != header.vertices * header.stride ||
+               // a delta takes at least a byte.
+               ((header.flags & csgjs_modeldeltaindices) ? header.indices > header.indexbytes
+                                                         : header.indexbytes != header.indices * sizeof(uint32_t))) {
+        return false;
+    }
+
+    const char *vertices = data + sizeof(header);
+    const char *indices = vertices + header.vertexbytes;
+    const char *end = indices + header.indexbytes;
+    Vector      step = modelstep(header);
+
+    model.vertices.resize((size_t)header.vertices);
+    model.indices.resize((size_t)header.indices);
+#if defined(CSGJSCPP_USE_MESHOPTIMIZER)
+    if (header.flags & csgjs_modelmeshopt) {
+        CSGJSCPP_VECTOR<char> records((size_t)(header.vertices * header.stride));
+        if (meshopt_decodeVertexBuffer(records.data(), (size_t)header.vertices, header.stride,
+                                       (const unsigned char *)vertices, (size_t)header.vertexbytes) != 0)
+            return false;
+        for (size_t i = 0; i < model.vertices.size(); i++)
+            model.vertices[i] = unpackmodelvertex(records.data() + i * header.stride, header, step);
+
+        CSGJSCPP_VECTOR<uint32_t> list((size_t)header.indices);
+        if (meshopt_decodeIndexBuffer(list.data(), list.size(), sizeof(uint32_t), (const unsigned char *)indices,
+                                      (size_t)header.indexbytes) != 0)
+            return false;
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i] >= header.vertices)
+                return false;
+            model.indices[i] = (Model::Index)list[i];
+        }
+        return true;
+    }
+#endif
+
+    for (size_t i = 0; i < model.vertices.size(); i++)
+        model.vertices[i] = unpackmodelvertex(vertices + i * header.stride, header, step);
+
+    if (header.flags & csgjs_modeldeltaindices) {
+        int64_t last = 0;
+        for (auto &index : model.indices) {
+            uint64_t zigzag = 0;
+            for (int shift = 0;; shift += 7) {
+                if (indices == end || shift > 63)
+                    return false;
+                uint8_t byte = (uint8_t)*indices++;
+                zigzag |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    break;
+            }
+            last += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            if (last < 0 || (uint64_t)last >= header.vertices)
+                return false;
+            index = (Model::Index)last;
+        }
+        return indices == end;
+    }
+
+    for (auto &index : model.indices) {
+        uint32_t value;
+        memcpy(&value, indices, sizeof(value));
+        indices += sizeof(value);
+        if (value >= header.vertices)
+            return false;
+        index = (Model::Index)value;
+    }
+    return true;
+}
+
+bool csgloadmodel(const char *path, Model &out) {
+    const char *data = nullptr;
+    size_t      size = 0;
+    void *      mapping = nullptr;
+    mapfile(path, data, size, mapping);
+    Model model;
+    bool  loaded = decodemodel(data, size, model);
+    unmapfile(data, size, mapping);
+    if (loaded)
+        out = CSGJSCPP_MOVE(model);
+    return loaded;
+}
+
+// Vertices transformed drawing `indices` through a FIFO cache of `cachesize`,
+// a vertex is in the cache while fewer than `cachesize` misses came after it.
+template <typename INDEX>
+static size_t cachemisses(const CSGJSCPP_VECTOR<INDEX> &indices, size_t vertices, unsigned cachesize) {
+    CSGJSCPP_VECTOR<size_t> missed(vertices, 0);
+    size_t                  misses = 0;
+    for (auto index : indices) {
+        if (missed[index] && misses - missed[index] < cachesize)
+            continue;
+        missed[index] = ++misses;
+    }
+    return misses;
+}
+
+static void measuremodel(const Model &model, unsigned cachesize, size_t &vertices, size_t &triangles, float &acmr,
+                         float &atvr) {
+    size_t misses = cachemisses(model.indices, model.vertices.size(), cachesize ? cachesize : 1);
+    vertices = model.vertices.size();
+    triangles = model.indices.size() / 3;
+    acmr = triangles ? (float)misses / triangles : 0;
+    atvr = vertices ? (float)misses / vertices : 0;
+}
+
+// Stats for a model left as it was.
+static void unchangedmodel(CSGOptimizeStats &measured) {
+    measured.verticesafter = measured.verticesbefore;
+    measured.trianglesafter = measured.trianglesbefore;
+    measured.acmrafter = measured.acmrbefore;
+    measured.atvrafter = measured.atvrbefore;
+}
+
+bool csgoptimizemodel(Model &model, const CSGOptimizeOptions &options, CSGOptimizeStats *stats) {
+    CSGOptimizeStats measured;
+    measuremodel(model, options.cachesize, measured.verticesbefore, measured.trianglesbefore, measured.acmrbefore,
+                 measured.atvrbefore);
+#if defined(CSGJSCPP_USE_MESHOPTIMIZER)
+    // nothing to draw, and the streams below would point into an empty vector.
+    if (model.vertices.empty() || model.indices.empty()) {
+        unchangedmodel(measured);
+        if (stats)
+            *stats = measured;
+        return true;
+    }
+
+    // meshoptimizer takes 32 bit indices and float positions.
+    CSGJSCPP_VECTOR<unsigned int> indices(model.indices.begin(), model.indices.end());
+    CSGJSCPP_VECTOR<unsigned int> scratch(indices.size());
+    size_t                        count = indices.size();
+
+    // weld by field and not by bytes, a double Vertex has padding.
+    const Vertex *    vertices = model.vertices.data();
+    meshopt_Stream    streams[3] = {{&vertices->pos, sizeof(vertices->pos), sizeof(Vertex)},
+                                 {&vertices->normal, sizeof(vertices->normal), sizeof(Vertex)},
+                                 {&vertices->col, sizeof(vertices->col), sizeof(Vertex)}};
+    CSGJSCPP_VECTOR<unsigned int> remap(model.vertices.size());
+    size_t unique = meshopt_generateVertexRemapMulti(remap.data(), indices.data(), count, model.vertices.size(),
+                                                     streams, 3);
+    CSGJSCPP_VECTOR<Vertex> welded(unique);
+    meshopt_remapIndexBuffer(indices.data(), indices.data(), count, remap.data());
+    meshopt_remapVertexBuffer(welded.data(), model.vertices.data(), model.vertices.size(), sizeof(Vertex),
+                              remap.data());
+
+    CSGJSCPP_VECTOR<float> positions(unique * 3);
+    for (size_t i = 0; i < unique; i++) {
+        positions[i * 3 + 0] = (float)welded[i].pos.x;
+        positions[i * 3 + 1] = (float)welded[i].pos.y;
+        positions[i * 3 + 2] = (float)welded[i].pos.z;
+    }
+
+    if (options.simplify < 1) {
+        size_t target = (size_t)(count / 3 * (options.simplify > 0 ? options.simplify : 0)) * 3;
+        float  error = 0;
+        count = meshopt_simplify(scratch.data(), indices.data(), count, positions.data(), unique, sizeof(float) * 3,
+                                 target, options.simplifyerror, 0, &error);
+        indices.swap(scratch);
+        indices.resize(count);
+    }
+    if (options.vertexcache) {
+        meshopt_optimizeVertexCache(scratch.data(), indices.data(), count, unique);
+        indices.swap(scratch);
+    }
+    if (options.overdraw) {
+        meshopt_optimizeOverdraw(scratch.data(), indices.data(), count, positions.data(), unique, sizeof(float) * 3,
+                                 options.overdrawthreshold);
+        indices.swap(scratch);
+    }
+    if (options.vertexfetch) {
+        CSGJSCPP_VECTOR<Vertex> fetched(unique);
+        fetched.resize(meshopt_optimizeVertexFetch(fetched.data(), indices.data(), count, welded.data(), unique,
+                                                   sizeof(Vertex)));
+        welded.swap(fetched);
+    }
+
+    model.vertices = CSGJSCPP_MOVE(welded);
+    model.indices.resize(count);
+    for (size_t i = 0; i < count; i++)
+        model.indices[i] = (Model::Index)indices[i];
+    measuremodel(model, options.cachesize, measured.verticesafter, measured.trianglesafter, measured.acmrafter,
+                 measured.atvrafter);
+    if (stats)
+        *stats = measured;
+    return true;
+#else
+    unchangedmodel(measured);
+    if (stats)
+        *stats = measured;
+    return false;
+#endif
+}
+
+} // namespace csgjscpp
 #endif // defined(CSGJSCPP_IMPLEMENTATION)
 #endif //#define CSGJSCPP
@@ -0,0 +1,148 @@
+// Re-runs the calls of a log written with csgrecordstart() and reports the
+// time and the work of each one, so slow cases seen in production can be
+// profiled without the models that caused them.
+//
+//   csgreplay <log> [repeats]
+//
+// Every call is run `repeats` times (1 by default) on one context, the fastest
+// run is reported next to the time the call took when it was recorded.
+
+#include "mycsgjs.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace csgjscpp;
+
+namespace {
+
+	const char *operationname(CSGLogRecord::Operation operation) {
+		switch (operation) {
+		case CSGLogRecord::UNION: return "union";
+		case CSGLogRecord::INTERSECTION: return "intersection";
+		case CSGLogRecord::SUBTRACT: return "subtract";
+		case CSGLogRecord::FIXTJUNC: return "fixtjunc";
+		}
+		return "?";
+	}
+
+	const char *operandsname(CSGLogRecord::Operands operands) {
+		switch (operands) {
+		case CSGLogRecord::POLYGONS: return "polygons";
+		case CSGLogRecord::MODELS: return "models";
+		case CSGLogRecord::TREES: return "trees";
+		}
+		return "?";
+	}
+
+	typedef CSGJSCPP_VECTOR<Polygon> Polygons;
+
+	template <typename OPERAND, typename RESULT>
+	RESULT binary(CSGLogRecord::Operation operation, const OPERAND &a, const OPERAND &b, CSGContext &context) {
+		if (operation == CSGLogRecord::UNION)
+			return csgunion(a, b, context);
+		if (operation == CSGLogRecord::INTERSECTION)
+			return csgintersection(a, b, context);
+		return csgsubtract(a, b, context);
+	}
+
+	CSGNode *buildtree(const Polygons &polygons, CSGContext &context) {
+		CSGNode *tree = context.newnode();
+		if (csgisconvex(polygons))
+			tree->buildconvex(polygons, context);
+		else
+			tree->build(polygons, context);
+		return tree;
+	}
+
+	// Run one call, returns the number of output polygons (triangles for models).
+	size_t run(const CSGLogRecord &record, CSGContext &context) {
+		if (record.operation == CSGLogRecord::FIXTJUNC) {
+			Polygons out;
+			if (context.options)
+				csgfixtjunc(record.a, out, *context.options);
+			else
+				out = csgfixtjunc(record.a);
+			return out.size();
+		}
+
+		if (record.operands == CSGLogRecord::MODELS)
+			return binary<Model, Model>(record.operation, record.modela, record.modelb, context).indices.size() / 3;
+		if (record.operands == CSGLogRecord::POLYGONS)
+			return binary<Polygons, Polygons>(record.operation, record.a, record.b, context).size();
+
+		// trees were recorded as their polygons, building them again is part of the time.
+		CSGNode *a = buildtree(record.a, context);
+		CSGNode *b = buildtree(record.b, context);
+		CSGNode *result = binary<const CSGNode *, CSGNode *>(record.operation, a, b, context);
+		size_t   count = result ? result->allpolygons().size() : 0;
+		context.release(a);
+		context.release(b);
+		context.release(result);
+		return count;
+	}
+
+} // namespace
+
+int main(int argc, char **argv) {
+
+	if (argc < 2) {
+		std::fprintf(stderr, "usage: %s <log> [repeats]\n", argv[0]);
+		return 2;
+	}
+	int repeats = argc > 2 ? std::atoi(argv[2]) : 1;
+	if (repeats < 1)
+		repeats = 1;
+
+	CSGLogReader reader(argv[1]);
+	if (!reader.ok()) {
+		std::fprintf(stderr, "%s: not a csgjs log\n", argv[1]);
+		return 1;
+	}
+	// before version 3 planes were not logged and are worked out from the first
+	// three vertices of each polygon, replays may split differently.
+	if (reader.version < 3)
+		std::fprintf(stderr, "%s: log version %u has no planes, replays may differ\n", argv[1], reader.version);
+
+	std::printf("%5s %-12s %-8s %8s %8s %8s %-12s %10s %10s %9s %9s %7s\n", "call", "operation", "operands", "a", "b",
+	            "out", "status", "recorded", "replayed", "polygons", "vertices", "nodes");
+
+	CSGContext   context;
+	CSGLogRecord record;
+	size_t       calls = 0;
+	double       recordedtotal = 0, replayedtotal = 0;
+	while (reader.next(record)) {
+		CSGOptions options = record.options;
+		context.options = record.hasoptions ? &options : nullptr;
+
+		size_t a = record.operands == CSGLogRecord::MODELS ? record.modela.indices.size() / 3 : record.a.size();
+		size_t b = record.operands == CSGLogRecord::MODELS ? record.modelb.indices.size() / 3 : record.b.size();
+		size_t out = 0;
+		double best = 0;
+		for (int i = 0; i < repeats; i++) {
+			if (record.deadlinems >= 0)
+				options.deadline = std::chrono::steady_clock::now() +
+				                   std::chrono::microseconds((long long)(record.deadlinems * 1000));
+			auto   start = std::chrono::steady_clock::now();
+			out = run(record, context);
+			double ms =
+			    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			best = i == 0 || ms < best ? ms : best;
+		}
+
+		// fixtjunc with options runs on its own context.
+		bool counted = record.operation != CSGLogRecord::FIXTJUNC;
+		std::printf("%5zu %-12s %-8s %8zu %8zu %8zu %-12s %8.3fms %8.3fms %9zu %9zu %7zu\n", calls,
+		            operationname(record.operation), operandsname(record.operands), a, b, out,
+		            csgstatusstring(counted ? context.status : record.status), record.milliseconds, best,
+		            counted ? context.madepolygons : 0, counted ? context.madevertices : 0,
+		            counted ? context.madenodes : 0);
+		calls++;
+		recordedtotal += record.milliseconds;
+		replayedtotal += best;
+	}
+	std::printf("%zu calls, %.3fms recorded, %.3fms replayed, %.1fKB pooled at most\n", calls, recordedtotal,
+	            replayedtotal, context.highwater / 1024.0);
+	return 0;
+}
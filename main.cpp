@@ -1,15 +1,6 @@
 
 #include "mycsgjs.h"
 
-#if defined(CSGJS_TEST_MESHOPTIMIZER)
-// meshoptimizer expects Vertex structures passed to it to be three floats
-// so this code isn't compatible if CSGJSCPP_REAL is anything other than
-// float. Could covert the Model vertices if you really want to but meh for now.
-static_assert(sizeof(CSGJSCPP_REAL) == 4, "meshoptimizer only works with floats");
-static_assert(sizeof(csgjscpp::Model::Index) == 4, "meshoptimizer only works with uint32_t indices");
-#include "meshoptimizer.h"
-#endif
-
 #include <fstream>
 
 #if defined(WIN32)
@@ -271,74 +262,26 @@ int main(int /*argc*/, char ** /*arvc*/) {
 			std::cout << "cyl subtract gourd " << t.GetElapsedMS() << "ms" << '\n';
 		}
 	}
-#if defined(CSGJS_TEST_MESHOPTIMIZER)
-
+#if defined(CSGJSCPP_USE_MESHOPTIMIZER)
     {
-        // lets have a play with the meshoptimizer
-
-        {
-            exunit::Timer t;
-
-            auto a = csgpolygon_cube({0.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, white);
-            auto b = csgpolygon_sphere({0, 0, 0}, 1.35f, white, 16);
-            auto c = csgpolygon_cylinder({-1, 0, 0}, {1, 0, 0}, 0.7f, red);
-            auto d = csgpolygon_cylinder({0, -1, 0}, {0, 1, 0}, 0.7f, green);
-            auto e = csgpolygon_cylinder({0, 0, -1}, {0, 0, 1}, 0.7f, blue);
-
-            // a.intersect(b).subtract(c.union(d).union(e))
-            auto polygons = csgsubtract(csgintersection(a, b), csgunion(csgunion(c, d), e));
-            auto model = modelfrompolygons(polygons);
-
-            Model optmodel;
-
-            // remap the indices to remove dups, there should be none as the code
-            // already does that.
-            size_t index_count = model.indices.size();
-            size_t orig_vertex_count = model.vertices.size();
-
-            // optimize the index and vertex buffers from
-            {
-
-                std::vector<unsigned int> remap(index_count);
-
-                size_t opt_vertex_count =
-                    meshopt_generateVertexRemap(remap.data(), model.indices.data(), index_count, model.vertices.data(),
-                                                orig_vertex_count, sizeof(Vertex));
-
-                optmodel.vertices.resize(opt_vertex_count);
-                optmodel.indices.resize(index_count);
-                meshopt_remapIndexBuffer(optmodel.indices.data(), model.indices.data(), index_count, remap.data());
-                meshopt_remapVertexBuffer(optmodel.vertices.data(), model.vertices.data(), orig_vertex_count,
-                                          sizeof(Vertex), &remap[0]);
-
-                std::cout << "meshoptimizer 1: expected " << orig_vertex_count << " vertices got " << opt_vertex_count
-                          << '\n';
-            }
-
-            {
-                std::vector<Model::Index> optindexbuffer(index_count);
-                meshopt_optimizeVertexCache(optindexbuffer.data(), optmodel.indices.data(), index_count,
-                                            optmodel.vertices.size());
-                optmodel.indices = optindexbuffer;
-            }
-
-            {
-                std::vector<Model::Index> optindexbuffer(index_count);
-                meshopt_optimizeOverdraw(optindexbuffer.data(), optmodel.indices.data(), index_count,
-                                         &model.vertices[0].pos.x, model.vertices.size(), sizeof(Vertex), 1.05f);
-
-                optmodel.indices = optindexbuffer;
-            }
-
-            {
-                std::vector<Vertex> optvertexbuffer(model.vertices.size());
-                meshopt_optimizeVertexFetch(optvertexbuffer.data(), model.indices.data(), index_count,
-                                            model.vertices.data(), model.vertices.size(), sizeof(Vertex));
-                model.vertices = optvertexbuffer;
-            }
-
-            exunit::modeltoply("meshop_multiops_frompolygons.ply", optmodel);
-        }
+        exunit::Timer t;
+
+        auto a = csgpolygon_cube({0.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, white);
+        auto b = csgpolygon_sphere({0, 0, 0}, 1.35f, white, 16);
+        auto c = csgpolygon_cylinder({-1, 0, 0}, {1, 0, 0}, 0.7f, red);
+        auto d = csgpolygon_cylinder({0, -1, 0}, {0, 1, 0}, 0.7f, green);
+        auto e = csgpolygon_cylinder({0, 0, -1}, {0, 0, 1}, 0.7f, blue);
+
+        // a.intersect(b).subtract(c.union(d).union(e))
+        auto model = modelfrompolygons(csgsubtract(csgintersection(a, b), csgunion(csgunion(c, d), e)));
+
+        CSGOptimizeStats stats;
+        csgoptimizemodel(model, CSGOptimizeOptions(), &stats);
+        std::cout << "meshoptimizer " << stats.verticesbefore << " -> " << stats.verticesafter << " vertices, acmr "
+                  << stats.acmrbefore << " -> " << stats.acmrafter << ", atvr " << stats.atvrbefore << " -> "
+                  << stats.atvrafter << " " << t.GetElapsedMS() << "ms" << '\n';
+
+        exunit::modeltoply("meshop_multiops_frompolygons.ply", model);
     }
 #endif
     return 0;
@@ -4,6 +4,16 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest/doctest.h"
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
 using namespace csgjscpp;
 
 using Polygons = CSGJSCPP_VECTOR<csgjscpp::Polygon>;
@@ -302,3 +312,1125 @@ TEST_CASE("tjunction sphere") {
     CHECK(outpolys.size() == inpolygons.size());
 }
 
+
+TEST_CASE("transform tree matches transformed polygons") {
+
+	Transform tr = csgtranslate({1, 2, 3}) * csgrotate({0, 1, 1}, 0.7f) * csgscale({1, -2, 0.5f});
+
+	CSGNode tree(csgpolygon_cube());
+	tree.transform(tr);
+
+	Polygons expected = csgtransform(csgpolygon_cube(), tr);
+	Polygons outpolys = tree.allpolygons();
+	REQUIRE(outpolys.size() == expected.size());
+
+	for (const auto &poly : outpolys) {
+		// the mirror in the scale must not turn the polygons inside out.
+		Plane fromverts(poly.vertices[0].pos, poly.vertices[1].pos, poly.vertices[2].pos);
+		CHECK(dot(fromverts.normal, poly.plane.normal) > 0.99f);
+		CHECK(approxequal(fromverts.w, poly.plane.w));
+		for (const auto &v : poly.vertices)
+			CHECK(poly.plane.classify(v.pos) == Plane::COPLANAR);
+	}
+}
+
+TEST_CASE("instances share one tree") {
+
+	CSGJSCPP_SHAREDPTR<const CSGNode> tree = std::make_shared<const CSGNode>(csgpolygon_cube());
+
+	CSGInstance a(tree, csgtranslate({3, 0, 0}));
+	CSGInstance b(tree, csgtranslate({-3, 0, 0}));
+
+	CSGJSCPP_UNIQUEPTR<CSGNode> placed(a.realize());
+	Polygons fromtree = placed->allpolygons();
+	Polygons frominstance = a.allpolygons();
+	REQUIRE(fromtree.size() == frominstance.size());
+	CHECK(fromtree[0].vertices[0] == frominstance[0].vertices[0]);
+	CHECK(b.allpolygons()[0].vertices[0].pos.x < 0);
+
+	// the shared tree is untouched.
+	CHECK(tree->allpolygons()[0].vertices[0].pos.x == -1.0f);
+}
+
+TEST_CASE("convex detection") {
+
+	CHECK(csgisconvex(csgpolygon_cube()));
+	CHECK(csgisconvex(csgpolygon_sphere()));
+	CHECK(csgisconvex(csgpolygon_cylinder()));
+	CHECK_FALSE(csgisconvex(csgsubtract(csgpolygon_cube(), csgpolygon_sphere({1, 1, 1}, 0.5f))));
+	CHECK_FALSE(csgisconvex(Polygons()));
+
+	// two convex pieces are not one convex solid.
+	Polygons apart = csgpolygon_cube({-2, 0, 0});
+	for (const auto &poly : csgpolygon_cube({2, 0, 0}))
+		apart.push_back(poly);
+	CHECK_FALSE(csgisconvex(apart));
+
+	// a missing face leaves edges without a neighbour.
+	Polygons open = csgpolygon_cube();
+	open.pop_back();
+	CHECK_FALSE(csgisconvex(open));
+}
+
+static CSGJSCPP_REAL area(const Polygons &polygons) {
+	CSGJSCPP_REAL total = 0;
+	for (const auto &poly : polygons) {
+		for (size_t i = 2; i < poly.vertices.size(); i++)
+			total += length(cross(poly.vertices[i - 1].pos - poly.vertices[0].pos,
+			                      poly.vertices[i].pos - poly.vertices[0].pos)) /
+			         2;
+	}
+	return total;
+}
+
+static bool similar(CSGJSCPP_REAL a, CSGJSCPP_REAL b) {
+	return fabs(a - b) < 0.001f * (fabs(a) + fabs(b) + 1);
+}
+
+TEST_CASE("convex build matches general build") {
+
+	Polygons sphere = csgpolygon_sphere({0.5f, 0, 0}, 0.8f);
+
+	CSGNode general(sphere);
+	CSGNode convex;
+	convex.buildconvex(sphere);
+	CHECK(convex.convex);
+	CHECK(general.allpolygons().size() == convex.allpolygons().size());
+
+	// clipping against the convex tree splits less, the surface left is the same.
+	Polygons cube = csgpolygon_cube();
+	CHECK(similar(area(general.clippolygons(cube)), area(convex.clippolygons(cube))));
+
+	CSGNode cubetree(cube);
+	CSGJSCPP_UNIQUEPTR<CSGNode> a(csgsubtract(&cubetree, &general));
+	CSGJSCPP_UNIQUEPTR<CSGNode> b(csgsubtract(&cubetree, &convex));
+	CHECK(similar(area(a->allpolygons()), area(b->allpolygons())));
+
+	CSGJSCPP_UNIQUEPTR<CSGNode> c(csgintersection(&cubetree, &general));
+	CSGJSCPP_UNIQUEPTR<CSGNode> d(csgintersection(&cubetree, &convex));
+	CHECK(similar(area(c->allpolygons()), area(d->allpolygons())));
+
+	CSGJSCPP_UNIQUEPTR<CSGNode> e(csgunion(&cubetree, &general));
+	CSGJSCPP_UNIQUEPTR<CSGNode> f(csgunion(&cubetree, &convex));
+	CHECK(similar(area(e->allpolygons()), area(f->allpolygons())));
+}
+
+TEST_CASE("partitioned booleans match the plain ones") {
+
+	Polygons a = csgsubtract(csgpolygon_cube(), csgpolygon_sphere({1, 1, 1}, 0.7f));
+	Polygons b = csgpolygon_sphere({0.3f, -0.2f, 0.1f}, 0.9f, 0xFFFFFF, 24, 12);
+
+	CSGPartition partition(3, 4);
+	CHECK(similar(area(csgunion(a, b)), area(csgpartition_union(a, b, partition))));
+	CHECK(similar(area(csgsubtract(a, b)), area(csgpartition_subtract(a, b, partition))));
+	CHECK(similar(area(csgsubtract(b, a)), area(csgpartition_subtract(b, a, partition))));
+	CHECK(similar(area(csgintersection(a, b)), area(csgpartition_intersection(a, b, partition))));
+
+	// a fine grid leaves cells with only one operand's polygons in them.
+	CSGPartition fine(9, 4);
+	CHECK(similar(area(csgunion(a, b)), area(csgpartition_union(a, b, fine))));
+	CHECK(similar(area(csgsubtract(b, a)), area(csgpartition_subtract(b, a, fine))));
+	CHECK(similar(area(csgintersection(a, b)), area(csgpartition_intersection(a, b, fine))));
+}
+
+TEST_CASE("point containment") {
+
+	CSGNode tree(csgsubtract(csgpolygon_cube(), csgpolygon_sphere({1, 1, 1}, 0.8f)));
+
+	CHECK(tree.classify(Vector(0, 0, 0)) == CSGNode::INSIDE);
+	CHECK(tree.classify(Vector(3, 0, 0)) == CSGNode::OUTSIDE);
+	CHECK(tree.classify(Vector(0.9f, 0.9f, 0.9f)) == CSGNode::OUTSIDE);
+	CHECK(tree.classify(Vector(-1, 0, 0)) == CSGNode::BOUNDARY);
+	CHECK(CSGNode().classify(Vector(0, 0, 0)) == CSGNode::OUTSIDE);
+
+	// the batched walk agrees with one point at a time.
+	CSGJSCPP_VECTOR<Vector> points;
+	for (int i = 0; i < 1000; i++)
+		points.push_back(Vector((i % 10) * 0.25f - 1.25f, ((i / 10) % 10) * 0.25f - 1.25f, (i / 100) * 0.25f - 1.25f));
+	auto batch = tree.classify(points);
+	REQUIRE(batch.size() == points.size());
+	int mismatches = 0;
+	for (size_t i = 0; i < points.size(); i++)
+		mismatches += batch[i] != tree.classify(points[i]);
+	CHECK(mismatches == 0);
+}
+
+TEST_CASE("ray cast") {
+
+	CSGNode tree(csgpolygon_cube());
+
+	RayHit hit;
+	REQUIRE(tree.raycast({-5, 0.1f, 0.2f}, {1, 0, 0}, hit));
+	CHECK(approxequal(hit.t, 4));
+	CHECK(hit.point == Vector(-1, 0.1f, 0.2f));
+	CHECK(hit.polygon->plane.normal == Vector(-1, 0, 0));
+
+	// from the inside the far wall is hit.
+	REQUIRE(tree.raycast({0, 0, 0}, {0, 0, -1}, hit));
+	CHECK(approxequal(hit.t, 1));
+	CHECK(hit.polygon->plane.normal == Vector(0, 0, -1));
+
+	CHECK_FALSE(tree.raycast({-5, 3, 0}, {1, 0, 0}, hit));
+	CHECK_FALSE(tree.raycast({-5, 0, 0}, {1, 0, 0}, hit, 2));
+
+	CSGInstance moved(std::make_shared<const CSGNode>(csgpolygon_cube()), csgtranslate({10, 0, 0}));
+	CHECK(moved.classify({10, 0, 0}) == CSGNode::INSIDE);
+	REQUIRE(moved.raycast({0, 0, 0}, {1, 0, 0}, hit));
+	CHECK(approxequal(hit.t, 9));
+	CHECK(hit.point == Vector(9, 0, 0));
+}
+
+TEST_CASE("node bounds") {
+
+	Polygons gourd = csgunion(csgpolygon_sphere({0, 0, 0}, 1.0f), csgpolygon_sphere({0, 1.2f, 0}, 0.7f));
+	CSGNode  tree(gourd);
+	auto     near = [](const Vector &a, const Vector &b) { return length(a - b) < 0.001f; };
+	CHECK(near(tree.boundsmin, Vector(-1, -1, -1)));
+	CHECK(near(tree.boundsmax, Vector(1, 1.9f, 1)));
+
+	// every subtree's box holds its children's.
+	std::vector<const CSGNode *> nodes(1, &tree);
+	for (size_t i = 0; i < nodes.size(); i++) {
+		for (const CSGNode *child : {nodes[i]->front, nodes[i]->back}) {
+			if (!child)
+				continue;
+			CHECK(child->boundsmin.x >= nodes[i]->boundsmin.x);
+			CHECK(child->boundsmin.y >= nodes[i]->boundsmin.y);
+			CHECK(child->boundsmin.z >= nodes[i]->boundsmin.z);
+			CHECK(child->boundsmax.x <= nodes[i]->boundsmax.x);
+			CHECK(child->boundsmax.y <= nodes[i]->boundsmax.y);
+			CHECK(child->boundsmax.z <= nodes[i]->boundsmax.z);
+			nodes.push_back(child);
+		}
+	}
+
+	CSGJSCPP_UNIQUEPTR<CSGNode> moved(tree.clone());
+	moved->transform(csgtranslate({10, 0, 0}));
+	CHECK(near(moved->boundsmin, Vector(9, -1, -1)));
+	RayHit hit;
+	CHECK_FALSE(moved->raycast({0, 3, 0}, {1, 0, 0}, hit));
+	REQUIRE(moved->raycast({0, -0.05f, 0.05f}, {1, 0, 0}, hit));
+	CHECK(hit.t > 9);
+	CHECK(hit.t < 9.05f);
+
+	// batches routed whole still come out the same.
+	Polygons far = csgpolygon_cube({5, 0, 0}), across = csgpolygon_cube({1, 0, 0});
+	CHECK(similar(area(tree.clippolygons(far)), area(far)));
+	CHECK(area(tree.clippolygons(across)) < area(across));
+	CHECK(similar(area(moved->clippolygons(across)), area(across)));
+}
+
+// Nodes below the root of `tree` with the inverted flag set.
+static size_t flaggedbelow(const CSGNode *tree) {
+	size_t                       flagged = 0;
+	std::vector<const CSGNode *> nodes = {tree->front, tree->back};
+	while (nodes.size()) {
+		const CSGNode *me = nodes.back();
+		nodes.pop_back();
+		if (!me)
+			continue;
+		flagged += me->inverted;
+		nodes.push_back(me->front);
+		nodes.push_back(me->back);
+	}
+	return flagged;
+}
+
+TEST_CASE("inversion is a flag") {
+
+	Polygons sphere = csgpolygon_sphere({0, 0, 0}, 1.0f, 0xFFFFFF, 16, 8);
+	Polygons gourd = csgunion(sphere, csgpolygon_sphere({0, 1.2f, 0}, 0.7f));
+	CSGNode  tree(gourd);
+	CSGNode *front = tree.front, *back = tree.back;
+	Vector   position = tree.polygons[0].vertices[0].pos;
+
+	// nothing is touched, the tree is read the other way round.
+	tree.invert();
+	CHECK(tree.inverted);
+	CHECK(tree.front == front);
+	CHECK(tree.back == back);
+	CHECK(tree.polygons[0].vertices[0].pos == position);
+	CHECK(flaggedbelow(&tree) == 0);
+	CHECK(tree.classify({0, 0, 0}) == CSGNode::OUTSIDE);
+	CHECK(tree.classify({3, 0, 0}) == CSGNode::INSIDE);
+	CSGJSCPP_VECTOR<Vector> points = {{0, 0, 0}, {3, 0, 0}};
+	auto                    classes = tree.classify(points);
+	CHECK(classes[0] == CSGNode::OUTSIDE);
+	CHECK(classes[1] == CSGNode::INSIDE);
+	Polygons all = tree.allpolygons();
+	CHECK(all[0].plane.normal == negate(tree.polygons[0].plane.normal));
+	RayHit hit;
+	REQUIRE(tree.raycast({-5, 0.05f, 0.05f}, {1, 0, 0}, hit));
+	CHECK(hit.flipped);
+
+	// clipping against it keeps what is inside the gourd, as a tree of the
+	// flipped polygons does.
+	Polygons flipped = gourd;
+	for (auto &poly : flipped)
+		poly.flip();
+	CSGNode  outside(flipped);
+	Polygons cube = csgpolygon_cube({0.5f, 0.5f, 0.5f});
+	CHECK(similar(area(tree.clippolygons(cube)), area(outside.clippolygons(cube))));
+
+	// a copy is inverted at its root only.
+	CSGJSCPP_UNIQUEPTR<CSGNode> copy(tree.clone());
+	CHECK(copy->inverted);
+	CHECK(flaggedbelow(copy.get()) == 0);
+	CHECK(copy->plane.normal == tree.plane.normal);
+	CHECK(similar(area(copy->clippolygons(cube)), area(outside.clippolygons(cube))));
+
+	// the booleans see the inverted operand.
+	CSGNode                     ball(sphere);
+	CSGJSCPP_UNIQUEPTR<CSGNode> rest(csgintersection(&ball, &tree));
+	REQUIRE(rest);
+	CHECK(similar(area(rest->allpolygons()), area(csgsubtract(sphere, gourd))));
+
+	const char *path = "test_csgjscpp_inverted.csgbsp";
+	REQUIRE(csgsavetree(&tree, path));
+	{
+		CSGMappedTree               mapped(path);
+		CSGJSCPP_UNIQUEPTR<CSGNode> loaded(mapped.load());
+		REQUIRE(loaded);
+		CHECK(loaded->inverted);
+		CHECK(loaded->classify({0, 0, 0}) == CSGNode::OUTSIDE);
+		CHECK(similar(area(mapped.clippolygons(cube)), area(outside.clippolygons(cube))));
+	}
+	std::remove(path);
+
+	tree.invert();
+	CHECK(tree.classify({0, 0, 0}) == CSGNode::INSIDE);
+	CHECK(tree.allpolygons()[0].plane.normal == tree.polygons[0].plane.normal);
+}
+
+TEST_CASE("concurrent queries on one tree") {
+
+	const CSGNode tree(csgpolygon_sphere({0, 0, 0}, 1.0f, 0xFFFFFF, 32, 16));
+
+	int inside[4] = {0, 0, 0, 0};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++) {
+		threads.push_back(std::thread([&tree, &inside, t]() {
+			for (int i = 0; i < 1000; i++) {
+				CSGJSCPP_REAL r = i / 1000.0f * 2.0f;
+				inside[t] += tree.classify(Vector(r, 0.01f, 0)) == CSGNode::INSIDE;
+			}
+		}));
+	}
+	for (auto &t : threads)
+		t.join();
+	for (int t = 1; t < 4; t++)
+		CHECK(inside[t] == inside[0]);
+	CHECK(inside[0] > 450);
+	CHECK(inside[0] < 550);
+}
+
+TEST_CASE("context reuse") {
+
+	Polygons a = csgsubtract(csgpolygon_cube(), csgpolygon_sphere({1, 1, 1}, 0.7f));
+	Polygons b = csgpolygon_cylinder({0.3f, -2, 0}, {0.3f, 2, 0.1f}, 0.5f);
+
+	CSGContext context;
+	for (int i = 0; i < 3; i++) {
+		CHECK(csgsubtract(a, b, context).size() == csgsubtract(a, b).size());
+		CHECK(csgunion(a, b, context).size() == csgunion(a, b).size());
+	}
+	CHECK(context.highwater > 0);
+	CHECK(context.pooledbytes() <= context.highwater);
+
+	context.trim();
+	CHECK(context.pooledbytes() == 0);
+
+	// a limit trims what is left over after each operation.
+	CSGContext limited(1024);
+	csgintersection(a, b, limited);
+	CHECK(limited.pooledbytes() <= 1024);
+}
+
+TEST_CASE("batch jobs") {
+
+	Polygons a = csgpolygon_cube();
+	Polygons b = csgpolygon_sphere({0.5f, 0.2f, 0}, 0.8f);
+
+	CSGBatch batch(3);
+	CHECK(batch.threads() == 3);
+
+	CSGJSCPP_VECTOR<std::future<Polygons>> results;
+	for (int i = 0; i < 8; i++)
+		results.push_back(batch.csgsubtract(a, b));
+	std::future<Model> model = batch.csgunion(csgmodel_cube(), csgmodel_sphere({0.5f, 0.2f, 0}, 0.8f));
+	std::future<Polygons> fixed = batch.csgfixtjunc(csgsubtract(a, b));
+
+	size_t expected = csgsubtract(a, b).size();
+	for (auto &result : results)
+		CHECK(result.get().size() == expected);
+	CHECK(model.get().indices.size() ==
+	      csgunion(csgmodel_cube(), csgmodel_sphere({0.5f, 0.2f, 0}, 0.8f)).indices.size());
+	CHECK(fixed.get().size() == expected);
+
+	// callbacks run on the workers, wait() returns once they all have.
+	std::atomic<size_t> done(0);
+	for (int i = 0; i < 8; i++)
+		batch.submit([&a, &b](CSGContext &context) { return csgunion(a, b, context); },
+		             [&done](Polygons result) { done += result.size() > 0; });
+	batch.wait();
+	CHECK(done == 8);
+
+	// a throwing job does not take its worker down.
+	std::future<int> thrown = batch.submit([](CSGContext &) -> int { throw std::runtime_error("job"); });
+	CHECK_THROWS_AS(thrown.get(), std::runtime_error);
+	std::atomic<size_t> failed(0);
+	batch.submit([](CSGContext &) -> int { throw std::runtime_error("job"); }, [](int) {},
+	             [&failed](std::exception_ptr) { failed++; });
+	batch.post([](CSGContext &) { throw std::runtime_error("posted"); });
+	CHECK_THROWS_AS(batch.wait(), std::runtime_error);
+	CHECK(failed == 1);
+	batch.wait();
+	CHECK(batch.csgsubtract(a, b).get().size() == expected);
+}
+
+TEST_CASE("cancellation, deadlines and progress") {
+
+	Polygons a = csgpolygon_sphere({0, 0, 0}, 1.0f, 0xFFFFFF, 32, 16);
+	Polygons b = csgpolygon_cylinder({0.3f, -2, 0}, {0.3f, 2, 0.1f}, 0.5f, 0xFFFFFF, 64);
+
+	std::atomic<bool> cancel(true);
+	CSGOptions        cancelled;
+	cancelled.cancel = &cancel;
+	Polygons out(1);
+	CHECK(csgsubtract(a, b, out, cancelled) == CSG_CANCELLED);
+	CHECK(out.size() == 1);
+	CHECK(csgfixtjunc(a, out, cancelled) == CSG_CANCELLED);
+
+	CSGOptions late;
+	late.deadline = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+	Model model;
+	CHECK(csgunion(modelfrompolygons(a), modelfrompolygons(b), model, late) == CSG_DEADLINE);
+	CHECK(model.indices.size() == 0);
+
+	// a stopped context starts over with the next operation.
+	CSGContext context;
+	context.options = &cancelled;
+	CHECK(csgunion(a, b, context).size() == 0);
+	CHECK(context.status == CSG_CANCELLED);
+	context.options = nullptr;
+	CHECK(csgunion(a, b, context).size() == csgunion(a, b).size());
+	CHECK(context.status == CSG_OK);
+
+	CSGJSCPP_VECTOR<float> reported;
+	CSGOptions             progress;
+	progress.progress = [&reported](float done) { reported.push_back(done); };
+	cancel = false;
+	progress.cancel = &cancel;
+	CHECK(csgsubtract(a, b, out, progress) == CSG_OK);
+	CHECK(out.size() == csgsubtract(a, b).size());
+	REQUIRE(reported.size() > 2);
+	CHECK(std::is_sorted(reported.begin(), reported.end()));
+	CHECK(reported.back() == 1.0f);
+	CHECK(std::string(csgstatusstring(CSG_DEADLINE)) == "deadline exceeded");
+}
+
+TEST_CASE("resource limits") {
+
+	Polygons a = csgpolygon_sphere({0, 0, 0}, 1.0f, 0xFFFFFF, 32, 16);
+	Polygons b = csgpolygon_sphere({0.3f, 0.2f, 0.1f}, 1.0f, 0xFFFFFF, 32, 16);
+	Polygons out;
+
+	CSGOptions polygons;
+	polygons.maxpolygons = a.size();
+	CHECK(csgunion(a, b, out, polygons) == CSG_POLYGON_LIMIT);
+
+	CSGOptions nodes;
+	nodes.maxnodes = 100;
+	CHECK(csgunion(a, b, out, nodes) == CSG_NODE_LIMIT);
+
+	CSGOptions depth;
+	depth.maxdepth = 8;
+	CHECK(csgunion(a, b, out, depth) == CSG_DEPTH_LIMIT);
+
+	CSGOptions bytes;
+	bytes.maxbytes = 64 * 1024;
+	CHECK(csgunion(a, b, out, bytes) == CSG_MEMORY_LIMIT);
+	CHECK(std::string(csgstatusstring(CSG_MEMORY_LIMIT)) == "memory limit exceeded");
+
+	// generous budgets don't get in the way.
+	CSGOptions generous;
+	generous.maxpolygons = 1000000;
+	generous.maxnodes = 1000000;
+	generous.maxdepth = 10000;
+	generous.maxbytes = (size_t)1 << 30;
+	CHECK(csgunion(a, b, out, generous) == CSG_OK);
+	CHECK(out.size() == csgunion(a, b).size());
+
+	// the budgets limit what is held at once, not everything ever made.
+	CSGContext context;
+	Polygons   result = csgunion(a, b, context);
+	CHECK(context.livepolygons == result.size());
+	CHECK(context.livenodes == 0);
+	CSGOptions held;
+	held.maxpolygons = context.madepolygons / 2;
+	CHECK(csgunion(a, b, out, held) == CSG_OK);
+}
+
+TEST_CASE("models written from the tree") {
+
+	Polygons a = csgpolygon_sphere({0, 0, 0}, 1.0f, 0xFFFFFF, 16, 8);
+	Polygons b = csgpolygon_cylinder({0.3f, -2, 0}, {0.3f, 2, 0.1f}, 0.5f);
+	Polygons result = csgsubtract(a, b);
+
+	// the hashed welding gives the same model as the linear search.
+	Model reference;
+	for (const auto &poly : result) {
+		Model::Index first = reference.AddVertex(polygonvertex(poly, 0));
+		for (size_t j = 2; j < poly.vertices.size(); j++) {
+			Model::Index second = reference.AddVertex(polygonvertex(poly, j - 1));
+			Model::Index third = reference.AddVertex(polygonvertex(poly, j));
+			if (first != second && second != third && third != first) {
+				reference.indices.push_back(first);
+				reference.indices.push_back(second);
+				reference.indices.push_back(third);
+			}
+		}
+	}
+	Model model = modelfrompolygons(result);
+	CHECK(model.vertices.size() == reference.vertices.size());
+	CHECK(model.indices == reference.indices);
+
+	// models are triangulated, only the surface is the same.
+	Model         direct = csgsubtract(modelfrompolygons(a), modelfrompolygons(b));
+	CSGJSCPP_REAL directarea = 0;
+	for (size_t i = 0; i < direct.indices.size(); i += 3) {
+		const Vector &p0 = direct.vertices[direct.indices[i]].pos;
+		const Vector &p1 = direct.vertices[direct.indices[i + 1]].pos;
+		const Vector &p2 = direct.vertices[direct.indices[i + 2]].pos;
+		directarea += length(cross(p1 - p0, p2 - p0)) * 0.5f;
+	}
+	CHECK(similar(directarea, area(result)));
+
+	CSGNode tree(result);
+	CHECK(modelfromtree(&tree).indices == modelfrompolygons(tree.allpolygons()).indices);
+}
+
+TEST_CASE("coplanar triangles are merged") {
+
+	Model cube = csgmodel_cube();
+	CHECK(modeltopolygons(cube).size() == 12);
+	Polygons faces = modeltopolygons(cube, true);
+	CHECK(faces.size() == 6);
+	for (const auto &face : faces)
+		CHECK(face.vertices.size() == 4);
+	CHECK(similar(area(faces), area(csgpolygon_cube())));
+
+	// the sphere's quads were split in two, smooth normals keep them apart.
+	Model sphere = csgmodel_sphere({0.3f, 0.2f, 0.1f}, 0.9f);
+	CHECK(modeltopolygons(sphere, true).size() == modeltopolygons(sphere).size());
+
+	CSGOptions options;
+	options.mergecoplanar = true;
+	Model merged;
+	CHECK(csgsubtract(cube, sphere, merged, options) == CSG_OK);
+	Model plain = csgsubtract(cube, sphere);
+	CHECK(similar(area(modeltopolygons(merged)), area(modeltopolygons(plain))));
+}
+
+TEST_CASE("fragment planes") {
+
+	Polygons result = csgsubtract(csgpolygon_cube(), csgpolygon_sphere({0.5f, 0.5f, 0.5f}, 0.6f));
+
+	// fragments of one input face keep its plane bit for bit.
+	size_t onface = 0;
+	for (const auto &p : result) {
+		if (p.plane.normal.x == 1 && approxequal(p.plane.w, 1)) {
+			CHECK(p.plane.normal == Vector(1, 0, 0));
+			CHECK(p.plane.w == 1);
+			onface++;
+		}
+	}
+	CHECK(onface > 1);
+}
+
+TEST_CASE("snap rounding") {
+
+	// a sliver and a polygon that collapses to a point.
+	auto     vertex = [](CSGJSCPP_REAL x, CSGJSCPP_REAL y) { return Vertex{{x, y, 0}, {0, 0, 1}, 0}; };
+	Polygons list = csgpolygon_cube();
+	list.push_back(Polygon({vertex(0, 0), vertex(1, 0), vertex(0.5f, 0.001f)}));
+	list.push_back(Polygon({vertex(0, 0), vertex(0.001f, 0), vertex(0, 0.001f)}));
+	CSGSnapStats stats;
+	Polygons     snapped = csgsnap(list, 0.01f, &stats);
+	CHECK(snapped.size() == 6);
+	CHECK(stats.polygonsin == 8);
+	CHECK(stats.polygonsout == 6);
+	CHECK(stats.verticesout == 24);
+
+	// a chain of booleans stays on the grid and does not grow more polygons.
+	CSGOptions options;
+	options.snapgrid = 2 * csgjs_EPSILON;
+	options.snapstats = &stats;
+	Polygons plain = csgpolygon_cube({0, 0, 0}, {1, 1, 1});
+	Polygons grid = plain;
+	for (int i = 0; i < 4; i++) {
+		// nearly the same hole each time, leaving slivers between them. Holes
+		// only a few csgjs_EPSILON apart are not used, rounding can put their
+		// walls on either side of the tolerance and the boolean drops both.
+		Polygons hole = csgpolygon_cylinder({0.3f + 0.001f * i, -2, 0}, {0.3f, 2, 0.2f}, 0.5f);
+		plain = csgsubtract(plain, hole);
+		REQUIRE(csgsubtract(grid, hole, grid, options) == CSG_OK);
+		CHECK(stats.polygonsout == grid.size());
+		// snapped polygons are refitted or cut, their vertices stay on their plane.
+		for (const auto &p : grid)
+			for (const auto &v : p.vertices)
+				CHECK(p.plane.classify(v.pos) == Plane::COPLANAR);
+	}
+	CHECK(grid.size() <= plain.size());
+	CHECK(fabs(area(grid) - area(plain)) < 0.01f);
+
+	// a cut just inside a face leaves a slab thinner than the grid, its four
+	// side strips collapse and only the two faces are left.
+	Polygons block = csgpolygon_cube({0, 0, 0}, {1.00009f, 1.00009f, 1.00009f});
+	Polygons cut = csgpolygon_cube({0, -1, 0}, {2, 1.99997f, 2});
+	REQUIRE(csgsubtract(block, cut).size() == 6);
+	Polygons slab;
+	REQUIRE(csgsubtract(block, cut, slab, options) == CSG_OK);
+	CHECK(stats.polygonsin == 6);
+	CHECK(stats.polygonsout == 2);
+	CHECK(slab.size() == 2);
+	for (const auto &p : grid) {
+		for (const auto &v : p.vertices) {
+			for (CSGJSCPP_REAL c : {v.pos.x, v.pos.y, v.pos.z})
+				CHECK(fabs(c / options.snapgrid - floor(c / options.snapgrid + 0.5f)) < 0.01f);
+		}
+	}
+
+	// a grid coarser than the operations can take is refused up front.
+	options.snapgrid = 10 * csgjs_EPSILON;
+	CHECK(csgsubtract(block, cut, slab, options) == CSG_INVALID_OPTIONS);
+	CHECK(slab.size() == 2);
+	CHECK(std::string(csgstatusstring(CSG_INVALID_OPTIONS)) == "invalid options");
+}
+
+TEST_CASE("vertex layout") {
+
+	// colours and normals survive splitting in either layout.
+	Polygons result = csgsubtract(csgpolygon_cube({0, 0, 0}, {1, 1, 1}, 0xFF0000),
+	                              csgpolygon_sphere({0.5f, 0.5f, 0.5f}, 0.8f, 0x0000FF));
+	for (const auto &poly : result) {
+		for (size_t i = 0; i < poly.vertices.size(); i++) {
+			Vertex v = polygonvertex(poly, i);
+			CHECK((v.col == 0xFF0000 || v.col == 0x0000FF));
+			CHECK(dot(v.normal, poly.plane.normal) > 0);
+		}
+	}
+	Model model = modelfrompolygons(result);
+	CHECK(modeltopolygons(model).size() == model.indices.size() / 3);
+
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+	CHECK(sizeof(PolygonVertex) == 16);
+	Vector normals[] = {{1, 0, 0}, {0, -1, 0}, {0, 0, -1}, unit(Vector(1, -2, 3)), unit(Vector(-0.3f, 0.1f, -0.9f))};
+	for (const Vector &n : normals) {
+		OctNormal packed(n);
+		CHECK(dot(Vector(packed), n) > 0.99999f);
+		CHECK(dot(Vector(negate(packed)), n) < -0.99999f);
+		CHECK(negate(negate(packed)) == packed);
+	}
+#endif
+}
+
+TEST_CASE("record and read back calls") {
+
+	const char *path = "test_csgjscpp.csglog";
+	REQUIRE(csgrecordstart(path));
+	Polygons cube = csgpolygon_cube();
+	Polygons sphere = csgpolygon_sphere({0.5f, 0.5f, 0.5f}, 0.8f);
+	Polygons result = csgsubtract(cube, sphere);
+	Model    model = csgunion(csgmodel_cube(), csgmodel_sphere({1, 0, 0}));
+	CSGOptions options;
+	options.maxpolygons = 100000;
+	options.fixtjunctions = true;
+	Polygons limited;
+	CHECK(csgintersection(cube, sphere, limited, options) == CSG_OK);
+	Polygons fixed = csgfixtjunc(result);
+	csgrecordstop();
+	csgunion(cube, sphere); // not recorded
+
+	CSGLogReader reader(path);
+	REQUIRE(reader.ok());
+	CSGLogRecord record;
+
+	REQUIRE(reader.next(record));
+	CHECK(record.operation == CSGLogRecord::SUBTRACT);
+	CHECK(record.operands == CSGLogRecord::POLYGONS);
+	CHECK(!record.hasoptions);
+	CHECK(record.milliseconds >= 0);
+	REQUIRE(record.a.size() == cube.size());
+	CHECK(record.a[0].vertices[0] == cube[0].vertices[0]);
+	CHECK(similar(area(csgsubtract(record.a, record.b)), area(result)));
+
+	REQUIRE(reader.next(record));
+	CHECK(record.operation == CSGLogRecord::UNION);
+	CHECK(record.operands == CSGLogRecord::MODELS);
+	CHECK(csgunion(record.modela, record.modelb).indices == model.indices);
+
+	REQUIRE(reader.next(record));
+	CHECK(record.operation == CSGLogRecord::INTERSECTION);
+	CHECK(record.hasoptions);
+	CHECK(record.status == CSG_OK);
+	CHECK(record.options.maxpolygons == 100000);
+	CHECK(record.options.fixtjunctions);
+	CHECK(record.deadlinems < 0);
+
+	REQUIRE(reader.next(record));
+	CHECK(record.operation == CSGLogRecord::FIXTJUNC);
+	REQUIRE(record.a.size() == result.size());
+	CHECK(record.b.empty());
+	// planes are logged as they were, not worked out again from the vertices.
+	bool sameplanes = true;
+	for (size_t i = 0; i < result.size(); i++)
+		sameplanes = sameplanes && record.a[i].plane.normal == result[i].plane.normal &&
+		             record.a[i].plane.w == result[i].plane.w;
+	CHECK(sameplanes);
+
+	CHECK(!reader.next(record));
+
+	// a count the file can't hold ends the log before anything is allocated.
+	{
+		const uint32_t header[] = {3, (uint32_t)sizeof(CSGJSCPP_REAL)};
+		const uint8_t  call[] = {CSGLogRecord::UNION, CSGLogRecord::POLYGONS, 0};
+		const uint32_t count = 0xfffffff0u;
+		FILE          *file = std::fopen(path, "wb");
+		REQUIRE(file);
+		std::fwrite("CSGJSLOG", 8, 1, file);
+		std::fwrite(header, sizeof(header), 1, file);
+		std::fwrite(call, sizeof(call), 1, file);
+		std::fwrite(&count, sizeof(count), 1, file);
+		std::fclose(file);
+	}
+	CSGLogReader forged(path);
+	REQUIRE(forged.ok());
+	CHECK(!forged.next(record));
+	CHECK(record.a.empty());
+	std::remove(path);
+}
+
+TEST_CASE("tree files") {
+
+	const char *path = "test_csgjscpp.csgbsp";
+	Polygons    sphere = csgpolygon_sphere({0.5f, 0, 0}, 0.8f);
+	Polygons    cube = csgpolygon_cube();
+	CSGNode     tree(sphere);
+	REQUIRE(csgsavetree(&tree, path));
+
+	{
+		CSGMappedTree mapped(path);
+		REQUIRE(mapped.ok());
+		CHECK(mapped.polygoncount() == tree.allpolygons().size());
+		CHECK(mapped.nodecount() > 1);
+		Polygons clipped = mapped.clippolygons(cube);
+		CHECK(clipped.size() == tree.clippolygons(cube).size());
+		CHECK(similar(area(clipped), area(tree.clippolygons(cube))));
+
+		CSGJSCPP_UNIQUEPTR<CSGNode> loaded(mapped.load());
+		REQUIRE(loaded);
+		Polygons before = tree.allpolygons(), after = loaded->allpolygons();
+		REQUIRE(before.size() == after.size());
+		// compact normals are packed again on the way in, so they are compared loosely.
+		for (size_t i = 0; i < before.size(); i++) {
+			REQUIRE(before[i].vertices.size() == after[i].vertices.size());
+			for (size_t j = 0; j < before[i].vertices.size(); j++) {
+				Vertex a = polygonvertex(before[i], j), b = polygonvertex(after[i], j);
+				CHECK(a.pos == b.pos);
+				CHECK(dot(a.normal, b.normal) > 0.9999f);
+				CHECK(a.col == b.col);
+			}
+		}
+		CHECK(!loaded->convex);
+	}
+
+	CSGNode convex;
+	convex.buildconvex(sphere);
+	REQUIRE(csgsavetree(&convex, path));
+	{
+		CSGMappedTree               mapped(path);
+		CSGJSCPP_UNIQUEPTR<CSGNode> loaded(mapped.load());
+		REQUIRE(loaded);
+		CHECK(loaded->convex);
+		CHECK(similar(area(loaded->clippolygons(cube)), area(convex.clippolygons(cube))));
+	}
+
+	// flags other than convex and inverted are refused.
+	{
+		FILE *file = std::fopen(path, "r+b");
+		REQUIRE(file);
+		std::fseek(file, 20, SEEK_SET);
+		std::fputc(0x05, file);
+		std::fclose(file);
+		CHECK(!CSGMappedTree(path).ok());
+	}
+
+	// a file from another version and a short one are refused.
+	{
+		FILE *file = std::fopen(path, "r+b");
+		REQUIRE(file);
+		std::fseek(file, 8, SEEK_SET);
+		std::fputc(0x7f, file);
+		std::fclose(file);
+		CSGMappedTree mapped(path);
+		CHECK(!mapped.ok());
+		CHECK(mapped.load() == nullptr);
+	}
+	{
+		FILE *file = std::fopen(path, "wb");
+		REQUIRE(file);
+		std::fwrite("CSGJSBSP", 1, 8, file);
+		std::fclose(file);
+		CHECK(!CSGMappedTree(path).ok());
+	}
+	CHECK(!CSGMappedTree("does/not/exist.csgbsp").ok());
+	std::remove(path);
+}
+
+TEST_CASE("model files") {
+
+	const char *path = "test_csgjscpp.csgmodel";
+	Model       model = csgsubtract(csgmodel_cube({0, 0, 0}, {2, 2, 2}), csgmodel_sphere({1, 1, 1}, 1.4f));
+	REQUIRE(csgsavemodel(model, path));
+	Model loaded;
+	REQUIRE(csgloadmodel(path, loaded));
+	CHECK(loaded.vertices == model.vertices);
+	CHECK(loaded.indices == model.indices);
+
+	auto filesize = [&]() {
+		FILE *file = std::fopen(path, "rb");
+		std::fseek(file, 0, SEEK_END);
+		long size = std::ftell(file);
+		std::fclose(file);
+		return size;
+	};
+	long exact = filesize();
+
+	// within half a step of 16 bits across the 4 units the difference spans.
+	CSGModelFileOptions options;
+	options.quantizepositions = true;
+	options.quantizenormals = true;
+	options.compress = true;
+	REQUIRE(csgsavemodel(model, path, options));
+	CHECK(filesize() < exact);
+	REQUIRE(csgloadmodel(path, loaded));
+	CHECK(loaded.indices == model.indices);
+	REQUIRE(loaded.vertices.size() == model.vertices.size());
+	for (size_t i = 0; i < model.vertices.size(); i++) {
+		CHECK(length(loaded.vertices[i].pos - model.vertices[i].pos) < 4.0f / 65535);
+		CHECK(dot(loaded.vertices[i].normal, unit(model.vertices[i].normal)) > 0.9999f);
+		CHECK(loaded.vertices[i].col == model.vertices[i].col);
+	}
+
+	// counts no stream could hold are turned down before anything is allocated,
+	// whichever way the file was written.
+	for (int compress = 0; compress < 2; compress++) {
+		options.compress = compress != 0;
+		REQUIRE(csgsavemodel(model, path, options));
+		unsigned char header[64 + 6 * sizeof(CSGJSCPP_REAL)];
+		FILE         *file = std::fopen(path, "rb");
+		REQUIRE(file);
+		REQUIRE(std::fread(header, sizeof(header), 1, file) == 1);
+		std::fclose(file);
+		const uint64_t forged[][2] = {{0xfffffff0u, 0}, {0, 0xfffffff0u}};
+		for (auto &counts : forged) {
+			const uint64_t fields[] = {counts[0], counts[1], 0, 0};
+			std::memcpy(header + 32, fields, sizeof(fields));
+			file = std::fopen(path, "wb");
+			REQUIRE(file);
+			REQUIRE(std::fwrite(header, sizeof(header), 1, file) == 1);
+			std::fclose(file);
+			Model forgedmodel;
+			CHECK(!csgloadmodel(path, forgedmodel));
+			CHECK(forgedmodel.vertices.empty());
+		}
+	}
+	REQUIRE(csgsavemodel(model, path, options));
+
+	// a damaged file leaves the model as it was.
+	{
+		FILE *file = std::fopen(path, "r+b");
+		REQUIRE(file);
+		std::fseek(file, -1, SEEK_END);
+		std::fputc(0xff, file);
+		std::fclose(file);
+	}
+	Model untouched = loaded;
+	CHECK(!csgloadmodel(path, loaded));
+	CHECK(loaded.indices == untouched.indices);
+	CHECK(!csgloadmodel("does/not/exist.csgmodel", loaded));
+	std::remove(path);
+}
+
+TEST_CASE("optimized models") {
+
+	// every face of the cube is its own 4 vertices, each transformed once.
+	Model            cube = csgmodel_cube();
+	CSGOptimizeStats stats;
+	Model            optimized = cube;
+	bool             optimizes = csgoptimizemodel(optimized, CSGOptimizeOptions(), &stats);
+	CHECK(stats.verticesbefore == 24);
+	CHECK(stats.trianglesbefore == 12);
+	CHECK(stats.acmrbefore == 2.0f);
+	CHECK(stats.atvrbefore == 1.0f);
+
+	// an empty model comes back empty.
+	Model empty;
+	CHECK(csgoptimizemodel(empty, CSGOptimizeOptions(), &stats) == optimizes);
+	CHECK(empty.vertices.empty());
+	CHECK(empty.indices.empty());
+	CHECK(stats.verticesafter == 0);
+	CHECK(stats.trianglesafter == 0);
+
+	Model model = csgsubtract(csgmodel_cube({0, 0, 0}, {2, 2, 2}), csgmodel_sphere({1, 1, 1}, 1.4f));
+	optimized = model;
+	REQUIRE(csgoptimizemodel(optimized, CSGOptimizeOptions(), &stats) == optimizes);
+	CHECK(stats.trianglesafter == stats.trianglesbefore);
+	CHECK(stats.acmrafter <= stats.acmrbefore);
+	if (!optimizes) {
+		CHECK(optimized.vertices == model.vertices);
+		CHECK(optimized.indices == model.indices);
+		return;
+	}
+
+	// the same triangles, reordered and each starting anywhere.
+	auto triangles = [](const Model &m) {
+		std::multiset<CSGJSCPP_VECTOR<CSGJSCPP_REAL>> set;
+		for (size_t i = 0; i < m.indices.size(); i += 3) {
+			CSGJSCPP_VECTOR<CSGJSCPP_REAL> tri, least;
+			for (size_t first = 0; first < 3; first++) {
+				tri.clear();
+				for (size_t k = 0; k < 3; k++) {
+					const Vector &p = m.vertices[m.indices[i + (first + k) % 3]].pos;
+					tri.insert(tri.end(), {p.x, p.y, p.z});
+				}
+				if (first == 0 || tri < least)
+					least = tri;
+			}
+			set.insert(least);
+		}
+		return set;
+	};
+	CHECK(triangles(optimized) == triangles(model));
+
+	CSGOptimizeOptions options;
+	options.simplify = 0.5f;
+	options.simplifyerror = 0.05f;
+	REQUIRE(csgoptimizemodel(optimized, options, &stats));
+	CHECK(stats.trianglesafter <= stats.trianglesbefore);
+	CHECK(stats.verticesafter <= stats.verticesbefore);
+}
+
+// Edges not matched by the same edge the other way round in another polygon,
+// a watertight surface has none.
+static size_t openedges(const Polygons &polygons) {
+	std::map<CSGJSCPP_VECTOR<CSGJSCPP_REAL>, int> edges;
+	for (const auto &poly : polygons) {
+		for (size_t i = 0; i < poly.vertices.size(); i++) {
+			const Vector &a = poly.vertices[i].pos, &b = poly.vertices[(i + 1) % poly.vertices.size()].pos;
+			edges[{a.x, a.y, a.z, b.x, b.y, b.z}]++;
+			edges[{b.x, b.y, b.z, a.x, a.y, a.z}]--;
+		}
+	}
+	size_t open = 0;
+	for (const auto &edge : edges)
+		open += edge.second != 0;
+	return open;
+}
+
+TEST_CASE("split edges are fixed in the output") {
+
+	Polygons   cube = csgpolygon_cube();
+	Polygons   corner = csgpolygon_cube({0.5f, 0.5f, 0.5f});
+	CSGOptions options;
+	Polygons   plain, fixed;
+	REQUIRE(openedges(cube) == 0);
+	REQUIRE(csgsubtract(cube, corner, plain, options) == CSG_OK);
+	CHECK(openedges(plain) > 0);
+
+	options.fixtjunctions = true;
+	REQUIRE(csgsubtract(cube, corner, fixed, options) == CSG_OK);
+	CHECK(openedges(fixed) == 0);
+	CHECK(fixed.size() == plain.size());
+	CHECK(similar(area(fixed), area(plain)));
+
+	// trees are fixed again after they are rebuilt.
+	CSGContext context;
+	context.options = &options;
+	CSGNode                     a(cube), b(corner);
+	CSGJSCPP_UNIQUEPTR<CSGNode> tree(csgsubtract(&a, &b, context));
+	CHECK(openedges(tree->allpolygons()) == 0);
+
+	// where faces of the operands cross, each side computes the seam on its own,
+	// snapping closes it.
+	Polygons turned = csgtransform(csgpolygon_cube({0, 0, 0}, {0.8f, 0.8f, 0.8f}),
+	                               csgrotate({1, 1, 0}, 0.6f) * csgtranslate({0.4f, 0.3f, 0.2f}));
+	options.snapgrid = 2 * csgjs_EPSILON;
+	REQUIRE(csgsubtract(cube, turned, fixed, options) == CSG_OK);
+	CHECK(openedges(fixed) == 0);
+}
+
+TEST_CASE("half-edge mesh") {
+
+	// the cube has a vertex per corner and face, 8 positions.
+	HalfEdgeMesh cube = halfedgemesh(csgmodel_cube());
+	CHECK(cube.positions() == 8);
+	REQUIRE(cube.twin.size() == 36);
+	for (uint32_t h = 0; h < cube.twin.size(); h++) {
+		REQUIRE(cube.twin[h] != HalfEdgeMesh::NONE);
+		CHECK(cube.twin[cube.twin[h]] == h);
+		CHECK(cube.origin(cube.twin[h]) == cube.target(h));
+	}
+
+	// walking round a corner visits every triangle at it once, three to six
+	// depending on which way the faces were cut.
+	for (uint32_t p = 0; p < cube.positions(); p++) {
+		uint32_t h = cube.outgoing[p], fan = 0, corners = 0;
+		do {
+			CHECK(cube.origin(h) == p);
+			h = cube.twin[HalfEdgeMesh::prev(h)];
+			fan++;
+		} while (h != cube.outgoing[p] && fan < 100);
+		for (uint32_t c = 0; c < cube.twin.size(); c++)
+			corners += cube.origin(c) == p;
+		CHECK(fan == corners);
+		CHECK(fan >= 3);
+		CHECK(fan <= 6);
+	}
+
+	// matching in parallel gives the same mesh.
+	CSGOptions options;
+	options.fixtjunctions = true;
+	Model model;
+	REQUIRE(csgsubtract(csgmodel_cube(), csgmodel_cube({0.5f, 0.5f, 0.5f}), model, options) == CSG_OK);
+	HalfEdgeMesh one = halfedgemesh(model), many = halfedgemesh(model, 4);
+	CHECK(one.twin == many.twin);
+	CHECK(one.outgoing == many.outgoing);
+	CHECK(std::count(one.twin.begin(), one.twin.end(), (uint32_t)HalfEdgeMesh::NONE) == 0);
+
+	// a lone triangle is all boundary.
+	Model triangle;
+	triangle.vertices = {Vertex{{0, 0, 0}, {0, 0, 1}, 0}, Vertex{{1, 0, 0}, {0, 0, 1}, 0},
+	                     Vertex{{0, 1, 0}, {0, 0, 1}, 0}};
+	triangle.indices = {0, 1, 2};
+	HalfEdgeMesh lone = halfedgemesh(CSGJSCPP_MOVE(triangle));
+	CHECK(lone.twin == CSGJSCPP_VECTOR<uint32_t>(3, HalfEdgeMesh::NONE));
+	CHECK(lone.target(lone.outgoing[0]) == 1);
+
+	// a cut off index list isn't a mesh.
+	Model cutoff = csgmodel_cube();
+	cutoff.indices.pop_back();
+	HalfEdgeMesh none = halfedgemesh(cutoff);
+	CHECK(none.model.indices.empty());
+	CHECK(none.twin.empty());
+	CHECK(none.positions() == 0);
+}
+
+TEST_CASE("primitive models match their polygons") {
+
+	// the same triangles, as position triples, starting from any corner.
+	auto triangles = [](const Model &model) {
+		std::map<CSGJSCPP_VECTOR<CSGJSCPP_REAL>, int> list;
+		for (size_t t = 0; t < model.indices.size(); t += 3) {
+			CSGJSCPP_VECTOR<CSGJSCPP_VECTOR<CSGJSCPP_REAL>> corners;
+			for (int k = 0; k < 3; k++) {
+				const Vertex &v = model.vertices[model.indices[t + k]];
+#if defined(CSGJSCPP_COMPACT_VERTEX)
+				// polygons keep packed normals.
+				corners.push_back({v.pos.x, v.pos.y, v.pos.z});
+#else
+				corners.push_back({v.pos.x, v.pos.y, v.pos.z, v.normal.x, v.normal.y, v.normal.z});
+#endif
+			}
+			std::rotate(corners.begin(), std::min_element(corners.begin(), corners.end()), corners.end());
+			CSGJSCPP_VECTOR<CSGJSCPP_REAL> key;
+			for (const auto &c : corners)
+				key.insert(key.end(), c.begin(), c.end());
+			list[key]++;
+		}
+		return list;
+	};
+
+	CHECK(triangles(csgmodel_cube({1, 2, 3}, {0.5f, 1, 2})) ==
+	      triangles(modelfrompolygons(csgpolygon_cube({1, 2, 3}, {0.5f, 1, 2}))));
+	CHECK(triangles(csgmodel_sphere({1, 0, 0}, 2, 0xff, 24, 12)) ==
+	      triangles(modelfrompolygons(csgpolygon_sphere({1, 0, 0}, 2, 0xff, 24, 12))));
+	CHECK(triangles(csgmodel_cylinder({0, 0, 0}, {1, 2, 3}, 0.5f, 0xff, 20)) ==
+	      triangles(modelfrompolygons(csgpolygon_cylinder({0, 0, 0}, {1, 2, 3}, 0.5f, 0xff, 20))));
+
+	// ring points are made once, rings close and the poles are single points.
+	CHECK(csgmodel_sphere({0, 0, 0}, 1, 0xff, 24, 12).vertices.size() == 24 * 11 + 2);
+	CHECK(csgmodel_cylinder({0, 0, 0}, {0, 1, 0}, 1, 0xff, 20).vertices.size() == 20 * 4 + 2);
+	CHECK(openedges(csgpolygon_sphere({0, 0, 0}, 1, 0xff, 24, 12)) == 0);
+	CHECK(openedges(csgpolygon_cylinder()) == 0);
+}
+
+TEST_CASE("preview and refine") {
+
+	CSGExpr expr = csgexpr_subtract(csgexpr_cube({0, 0, 0}, {1, 1, 1}),
+	                                csgexpr_union(csgexpr_sphere({1, 1, 1}, 0.8f, 0xff, 48, 24),
+	                                              csgexpr_cylinder({-2, 0, 0}, {2, 0, 0}, 0.4f, 0xff, 48)));
+	Polygons full = csgevaluate(expr);
+	Polygons coarse = csgevaluate(expr, 8);
+	CHECK(coarse.size() < full.size());
+	CHECK(fabs(area(coarse) - area(full)) < 0.05f * area(full));
+
+	CSGPreview preview(expr, 8);
+	CHECK(!preview.preview.empty());
+	CHECK(preview.preview.size() < full.size());
+	const Polygons &refined = preview.result();
+	CHECK(preview.ready());
+	CHECK(preview.status() == CSG_OK);
+	REQUIRE(refined.size() == full.size());
+	for (size_t i = 0; i < full.size(); i++)
+		CHECK(refined[i].vertices == full[i].vertices);
+
+	// cancelling the refinement leaves the preview.
+	CSGPreview cancelled(expr, 8);
+	cancelled.cancel();
+	CHECK(cancelled.ready());
+	CHECK((cancelled.status() == CSG_OK || cancelled.status() == CSG_CANCELLED));
+	CHECK((cancelled.status() == CSG_OK) == !cancelled.result().empty());
+	CHECK(!cancelled.preview.empty());
+
+	// what the refinement threw is rethrown by every call, not just the first.
+	CSGPreview failing(expr, 8);
+	failing.result();
+	std::promise<CSGStatus> thrown;
+	thrown.set_exception(std::make_exception_ptr(std::runtime_error("refine")));
+	failing.refine = thrown.get_future();
+	CHECK_THROWS_AS(failing.status(), std::runtime_error);
+	CHECK_THROWS_AS(failing.status(), std::runtime_error);
+	CHECK_THROWS_AS(failing.result(), std::runtime_error);
+}
+
+TEST_CASE("shared subexpressions") {
+
+	// `body` is used twice, it is subtracted once (the log has one call for it).
+	CSGExpr body = csgexpr_subtract(csgexpr_cube({0, 0, 0}, {1, 1, 1}), csgexpr_sphere({0.5f, 0.5f, 0.5f}, 0.6f));
+	CSGExpr expr = csgexpr_union(csgexpr_intersection(body, csgexpr_cube({0.5f, 0, 0}, {1, 1, 1})),
+	                             csgexpr_subtract(body, csgexpr_cylinder({-2, 0, 0}, {2, 0, 0}, 0.3f)));
+	const char *path = "test_csgjscpp_shared.csglog";
+	REQUIRE(csgrecordstart(path));
+	Polygons shared = csgevaluate(expr);
+	csgrecordstop();
+
+	CSGLogReader reader(path);
+	REQUIRE(reader.ok());
+	CSGLogRecord record;
+	int          calls = 0;
+	while (reader.next(record))
+		calls++;
+	CHECK(calls == 4);
+	std::remove(path);
+
+	// the same as working it out in full.
+	Polygons a = csgsubtract(csgpolygon_cube({0, 0, 0}, {1, 1, 1}), csgpolygon_sphere({0.5f, 0.5f, 0.5f}, 0.6f));
+	Polygons b = csgsubtract(csgpolygon_cube({0, 0, 0}, {1, 1, 1}), csgpolygon_sphere({0.5f, 0.5f, 0.5f}, 0.6f));
+	Polygons full = csgunion(csgintersection(a, csgpolygon_cube({0.5f, 0, 0}, {1, 1, 1})),
+	                         csgsubtract(b, csgpolygon_cylinder({-2, 0, 0}, {2, 0, 0}, 0.3f)));
+	REQUIRE(shared.size() == full.size());
+	for (size_t i = 0; i < full.size(); i++)
+		CHECK(shared[i].vertices == full[i].vertices);
+}